@@ -0,0 +1,48 @@
+// liblispyの使用例。インタプリタを1つ作っておき、同じ関数を繰り返し呼び出して1回あたりの時間を計測する。
+// make embed && ./embed [回数]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "lispy.h"
+
+// ホスト側で定義する組み込み関数。(host-scale x) xを10倍する。
+lispy_value* host_scale(lispy_env* env, lispy_value* args) {
+  if (lispy_count(args) != 1 || lispy_type(lispy_item(args, 0)) != LISPY_NUMBER) {
+    lispy_value_free(args);
+    return lispy_error("Function 'host-scale' expects one number.");
+  }
+  long x = lispy_to_number(lispy_item(args, 0));
+  lispy_value_free(args);
+  return lispy_number(x * 10);
+}
+
+int main(int argc, char** argv) {
+  long n = argc > 1 ? strtol(argv[1], NULL, 10) : 1000000;
+
+  lispy_t* L = lispy_new();
+  lispy_value_free(lispy_eval_file(L, "prelude.lspy"));
+  lispy_register(L, "host-scale", host_scale);
+  lispy_value_free(lispy_eval_string(L, "(fun {step x} {+ 1 (host-scale x)})"));
+
+  lispy_value* step = lispy_get(L, "step");
+  long sum = 0;
+  clock_t start = clock();
+  for (long i = 0; i < n; i++) {
+    lispy_value* r = lispy_call(L, step, lispy_list_push(lispy_list(), lispy_number(i)));
+    if (lispy_type(r) == LISPY_ERROR) { printf("Error: %s\n", lispy_to_string(r)); }
+    sum += lispy_to_number(r);
+    lispy_value_free(r);
+  }
+  double sec = (double)(clock() - start) / CLOCKS_PER_SEC;
+  printf("%ld calls, sum %ld, %.0f ns/call\n", n, sum, n ? sec * 1e9 / n : 0.0);
+
+  lispy_value* r = lispy_eval_string(L, "(fold + 0 (map step (range 10)))");
+  lispy_print(r);
+  putchar('\n');
+  lispy_value_free(r);
+
+  lispy_value_free(step);
+  lispy_free(L);
+  return 0;
+}
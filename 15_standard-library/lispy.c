@@ -1,6 +1,42 @@
+#define _POSIX_C_SOURCE 200809L
+// syscall(perf_event_open)のため。
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
 #include "mpc.h"
+#include "lispy.h"
+
+// Linuxではperf_event_openでハードウェアカウンタを読める。
+#ifdef __linux__
+#define LISPY_PERF
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+// x86-64ではSIMD命令で数値配列の演算を行う。それ以外ではスカラーのループで代替する。
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LISPY_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// x86-64では、よく呼ばれる関数を機械語にコンパイルできる(--jit)。それ以外ではJITコンパイラは無効。
+#if defined(__x86_64__) && !defined(_WIN32)
+#define LISPY_JIT_X86
+#include <setjmp.h>
+#include <sys/mman.h>
+#endif
+
+// ライブラリとしてビルドする場合(-DLISPY_LIBRARY)は、REPLとmainを含めない。
+#ifndef LISPY_LIBRARY
 
 #ifdef _WIN32
 
@@ -26,59 +62,894 @@ void add_history(char* unused) {}
 
 #endif
 
-// パーサーの宣言。
-
-mpc_parser_t* Comment;
-mpc_parser_t* Number;
-mpc_parser_t* String;
-mpc_parser_t* Symbol;
-mpc_parser_t* Sexpr;
-mpc_parser_t *Qexpr;
-mpc_parser_t* Expr;
-mpc_parser_t* Lispy;
+#endif
 
 struct lval;
 struct lenv;
+struct lmap;
+struct lfut;
+struct lpool;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lmap lmap;
+typedef struct lfut lfut;
+typedef struct lpool lpool;
+typedef struct lname lname;
+typedef struct lmemo lmemo;
+typedef struct lfold_ref lfold_ref;
+typedef struct lfold_state lfold_state;
+
+// 1回の評価に課す制限。上限が0のものは制限しない。
+typedef struct {
+  long max_steps; // 評価の段数(lval_evalの呼び出し回数)の上限
+  long max_depth; // 関数呼び出しの深さの上限
+  long max_bytes; // 値のために確保するバイト数の上限
+  long steps; // 評価を始めてからの段数
+  long bytes; // 評価を始めてから確保したバイト数
+  int exceeded; // 超えた制限(LQUOTA_*)。超えたら、その評価が終わるまで以後の評価は全てエラーになる。
+} lquota;
+
+// インタプリタ。パーサー、グローバル環境、並列処理のワーカーを持つ。
+// プロセス全体で共有する可変な状態は持たないので、複数のインタプリタを別々のスレッドで同時に使える。
+// 定数の畳み込みの状態もインタプリタごとに持ち、あるインタプリタでの再定義は他のインタプリタの畳み込みを無効にしない。
+// 組み込み関数からは、環境を外側にたどったグローバル環境を通して参照する(lenv_ctx)。
+typedef struct lctx {
+  // パーサー。作った後は読むだけなので、重ねたインタプリタは土台のものを共有する。
+  mpc_parser_t* Comment;
+  mpc_parser_t* Number;
+  mpc_parser_t* String;
+  mpc_parser_t* Symbol;
+  mpc_parser_t* Sexpr;
+  mpc_parser_t* Qexpr;
+  mpc_parser_t* Expr;
+  mpc_parser_t* Lispy;
+
+  struct lctx* base; // パーサーを借りている土台のインタプリタ。NULLなら自分で持つ。
+  struct lctx* under; // 直接重ねた土台のインタプリタ(lctx_new_layer)。重ねたものでなければNULL。
+  lenv* env; // グローバル環境
+  lpool* pool; // 並列処理のワーカー。最初に使われたときに作る。
+  pthread_mutex_t lock; // poolの作成用
+  lquota quota; // 評価の制限
+  lfold_state* fold; // 定数の畳み込みの状態。最初に使うときに作る(lfold_state_of)。
+} lctx;
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+// 値。型ごとにしか使わない部分は共用体にまとめ、全ての値が持つ部分を小さく保つ。
+// ヒーププロファイラの情報(lheap_hdr)と定数の畳み込みの情報(lfold_ref)は、必要な値だけが別に持つ。
 struct lval {
   int type; // 型
+  unsigned loc; // 読み込んだソースの位置の番号(lsrc)。0は位置なし。
+  int count; // 子要素の数(型がS式、Q式、パイプライン)。型が配列の場合は要素数。
+  unsigned char shared; // ハッシュコンスの表にある共有の値(LHCONS_*)。書き換えず、解放もしない。
+  unsigned char heap; // ヒーププロファイル中に確保し、前にlheap_hdrがある。
+
+  long num; // 値(型が範囲の場合は開始値、Q式の場合は構造的なハッシュ値のキャッシュで、0は未計算。
+            // ユーザー定義関数の場合はJITコンパイラが振る定義の番号で、0は番号なし。
+            // 組み込み関数の場合は、要素が1つのS式でも引数なしで呼び出すなら1)
+  lenv* env; // ローカル環境(型が関数)。パイプラインのmap, filter段(Q式)の場合は、段を作った環境の写し(lenv_snapshot_frames)。
+  lfold_ref* fold; // 定数の畳み込みで置き換えた値の場合は、元の式と世代。それ以外はNULL。
+
+  union {
+    struct { // 型が範囲
+      long stop; // 終了値。この値自体は含まない。
+      long step; // 増分
+    };
+    char* err; // エラー文字列(型がエラー)
+    char* sym; // シンボル名(型がシンボル)
+    char* str; // 文字列(型が文字列)
+    struct { // 型が関数
+      lbuiltin builtin; // 組み込み関数。NULLならユーザー定義関数。
+      lval* formals; // 仮引数。
+      lval* body; // 関数の実体。
+      lname* name; // 関数を束縛した名前。プロファイラが使う。
+      lmemo* memo; // 結果を覚えておく表(memoで作った関数)。コピーとは共有する。
+    };
+    struct lval** cell; // 子要素の配列(型がS式、Q式、パイプライン)
+    long* arr; // 詰めて格納された数値の配列(型が配列)
+    lmap* map; // ハッシュ表(型が辞書)
+    lfut* fut; // 評価中または評価済みの式(型がfuture)
+  };
+};
 
-  long num; // 値
-  char* err; // エラー文字列(型がエラー)
-  char* sym; // シンボル名(型がシンボル)
-  char* str; // 文字列(型が文字列)
-
-  lbuiltin builtin; // 組み込み関数(型が関数)。
-  lenv* env; // ローカル環境。
-  lval* formals; // 仮引数。
-  lval* body; // 関数の実体。
-  
-  int count; // 子要素の数
-  struct lval** cell; // 子要素の配列
+// 定数の畳み込みで置き換えた値が覚えておく、元の式と置き換えたときの状態、世代。置き換えた値とそのコピーで共有する。
+struct lfold_ref {
+  lval* orig; // 元の式。ハッシュコンスが有効なら共有の値。
+  lfold_state* st; // 置き換えたインタプリタの畳み込みの状態
+  long epoch; // 置き換えたときの世代(st->epoch)
+  lval* next; // 世代が進んだ後に、元の式を置き換え直したもの(lfold_refold)。まだなければNULL。
+  long refs; // 参照する値の数
 };
 
+struct lhamt;
+typedef struct lhamt lhamt;
+
 struct lenv {
   lenv* par; // 外側の環境
-  int count; // 定義された変数の数
-  char** syms; // 変数名の配列
+  lhamt* root; // 変数表(永続HAMT)。コピーした環境とは構造を共有する。NULLは空。
+  lctx* ctx; // 属するインタプリタ(グローバル環境とその写しのみ)
+  lname* site; // 確保した関数(ヒーププロファイル中のみ)
+  int frozen; // 凍結済みならdefや=で書き換えられない
+  int loop; // ループ変数だけを束縛する環境。本体の=は、ループ変数以外を外側の環境に束縛する。
+};
+
+// 辞書のハッシュ表。オープンアドレス法(線形探索)で衝突を解決する。
+struct lmap {
+  int cap; // スロット数。2の冪。
+  int count; // 登録されているキーの数
+  unsigned long* hashes; // キーのハッシュ値の配列
+  lval** keys; // キーの配列。NULLは空きスロット。
   lval** vals; // 値の配列
 };
 
-enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_STR, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
+// lispy.hのLISPY_*と同じ順序。LVAL_NTYPESは型の数。
+enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_STR, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_RANGE, LVAL_SEQ, LVAL_ARRAY, LVAL_MAP, LVAL_FUTURE,
+       LVAL_NTYPES };
+// パイプラインの段の種類。
+enum { LSTAGE_MAP, LSTAGE_FILTER, LSTAGE_TAKE, LSTAGE_DROP };
 enum { LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM };
+// 共有の値の種類。子要素も含めて畳み込んだ値があるものは、表が元の式と世代でも分けるので区別する。
+enum { LHCONS_PLAIN = 1, LHCONS_FOLDED = 2 };
+
+////////////////////////////////////////
+// 実行時の統計
+////////////////////////////////////////
+
+// 遅い原因がコピー、変数の探索、確保のどれにあるかを調べるためのカウンタ。常に数える。
+// カウンタはスレッドごとに持ってロックなしで増やし、読むときに全スレッドの分を合計する。
+
+enum {
+  LSTAT_COPY, // lval_copyの呼び出し数(子要素の分も含む)
+  LSTAT_COPY_BYTES, // lval_copyで複製したバイト数
+  LSTAT_ENV_GET, // lenv_getの呼び出し数
+  LSTAT_ENV_FRAMES, // lenv_getが探した環境の数
+  LSTAT_CALL_BUILTIN, // 組み込み関数の呼び出し数
+  LSTAT_CALL_LAMBDA, // ユーザー定義関数の呼び出し数
+  LSTAT_POP_BYTES, // lval_popで詰めたバイト数
+  LSTAT_ALLOC, // 型ごとのlvalの確保数
+  LSTAT_FREE = LSTAT_ALLOC + LVAL_NTYPES, // 型ごとのlvalの解放数。Q式は評価時にS式に変わるので、解放時の型で数える。
+  LSTAT_N = LSTAT_FREE + LVAL_NTYPES
+};
+
+static char* lstat_names[] = {
+  "copy", "copy-bytes", "env-get", "env-frames", "call-builtin", "call-lambda", "pop-bytes"
+};
+
+typedef struct lstats {
+  long n[LSTAT_N];
+  struct lstats* next; // 登録済みの他のスレッドのカウンタ
+} lstats;
+
+static __thread lstats lstats_local;
+static __thread int lstats_registered = 0;
+static lstats* lstats_threads = NULL; // 登録済みのスレッドのカウンタ
+static lstats lstats_retired; // 終了したスレッドの分の合計
+static pthread_mutex_t lstats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t lstats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t lstats_key;
+
+// カウンタに加える。書くのは自分のスレッドだけなので、読む側と競合しないようアトミックに書くだけでよい。
+#define LSTAT_ADD(i, k) __atomic_store_n(&lstats_local.n[i], lstats_local.n[i] + (k), __ATOMIC_RELAXED)
+
+// スレッドの終了時に、そのスレッドの分を合計に移す。
+void lstats_exit(void* p) {
+  lstats* s = p;
+  pthread_mutex_lock(&lstats_lock);
+  for (int i = 0; i < LSTAT_N; i++) { lstats_retired.n[i] += s->n[i]; }
+  lstats** q = &lstats_threads;
+  while (*q != s) { q = &(*q)->next; }
+  *q = s->next;
+  pthread_mutex_unlock(&lstats_lock);
+}
+
+void lstats_init(void) { pthread_key_create(&lstats_key, lstats_exit); }
+
+// 現在のスレッドのカウンタを登録する(初回のみ)。インタプリタを使い始めるところで呼ぶ。
+void lstats_register(void) {
+  if (lstats_registered) { return; }
+  lstats_registered = 1;
+  pthread_once(&lstats_once, lstats_init);
+  pthread_setspecific(lstats_key, &lstats_local);
+  pthread_mutex_lock(&lstats_lock);
+  lstats_local.next = lstats_threads;
+  lstats_threads = &lstats_local;
+  pthread_mutex_unlock(&lstats_lock);
+}
+
+// 全スレッドの合計。
+void lstats_total(lstats* t) {
+  lstats_register();
+  pthread_mutex_lock(&lstats_lock);
+  *t = lstats_retired;
+  for (lstats* s = lstats_threads; s; s = s->next) {
+    for (int i = 0; i < LSTAT_N; i++) { t->n[i] += __atomic_load_n(&s->n[i], __ATOMIC_RELAXED); }
+  }
+  pthread_mutex_unlock(&lstats_lock);
+}
+
+char* ltype_name(int t);
+
+// 合計を表示する。
+void lstats_print(FILE* f, lstats* t) {
+  fprintf(f, "%-14s %12s %12s\n", "lval", "alloc", "free");
+  for (int i = 0; i < LVAL_NTYPES; i++) {
+    fprintf(f, "%-14s %12li %12li\n", ltype_name(i), t->n[LSTAT_ALLOC + i], t->n[LSTAT_FREE + i]);
+  }
+  for (int i = 0; i < LSTAT_ALLOC; i++) { fprintf(f, "%-14s %12li\n", lstat_names[i], t->n[i]); }
+}
+
+// 終了時の表示(--stats)。
+void lstats_atexit(void) {
+  lstats t;
+  lstats_total(&t);
+  fputs("Stats:\n", stderr);
+  lstats_print(stderr, &t);
+}
+
+////////////////////////////////////////
+// ソースの位置
+////////////////////////////////////////
+
+// ファイルから読み込んだS式とQ式には、読み込んだ位置の番号(lval.loc)を付ける。
+// 位置そのものはこの表に置くので、lvalは大きくならない。コピーは番号を引き継ぐので、
+// 呼び出しのたびにコピーされる関数の本体も元の位置を指す。
+// 位置は1回の読み込み(単位)ごとにまとめて確保し、連続した番号を振る。同じインタプリタが同じファイルの
+// 同じ位置から読み直すと前の単位を解放し、インタプリタを破棄するとその単位を全て解放する。
+// 解放した単位の番号は使い回さないので、古い式の番号は位置なしとして扱われる。
+
+typedef struct {
+  char* file; // インターンしたファイル名
+  int line, col; // 1から数える
+  lname* anon; // この位置で作った名前のない関数の、プロファイラでの名前。必要になってから作る。
+} lsrc;
+
+// 1回の読み込みで登録した位置。番号firstから始まるn個。
+typedef struct {
+  lctx* owner; // 読み込んだインタプリタ
+  char* file; // 読み込んだファイルと、その中で読み始めた位置
+  int line, col;
+  unsigned first, n;
+  lsrc* ents;
+} lsrc_unit;
+
+static lsrc_unit* lsrc_units = NULL; // firstの順に並べた単位
+static long lsrc_nunits = 0, lsrc_cap = 0;
+static unsigned lsrc_next = 1; // 次に振る番号。0は位置なしに使う
+static int lsrc_full = 0; // 番号を使い切ったことを報告したか
+// 単位の追加と解放は書き込み、番号から位置を引くのは読み込みのロック。
+static pthread_rwlock_t lsrc_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// 評価中の式の位置。作ったエラーはこの位置を持つ。
+static __thread unsigned lsrc_cur = 0;
+
+lname* lname_intern(char* s);
+
+// n個の連続した番号を確保し、最初の番号を返す。使い切っていれば0を返し、最初の1回だけ報告する。
+unsigned lsrc_reserve(unsigned n) {
+  unsigned first = __atomic_load_n(&lsrc_next, __ATOMIC_RELAXED);
+  do {
+    if (n > UINT_MAX - first) {
+      if (!__atomic_exchange_n(&lsrc_full, 1, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "lispy: source location numbers exhausted; expressions read from now on have no location.\n");
+      }
+      return 0;
+    }
+  } while (!__atomic_compare_exchange_n(&lsrc_next, &first, first + n, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return first;
+}
+
+// 単位の解放(書き込みのロック中に呼ぶ)。
+void lsrc_unit_remove(long i) {
+  free(lsrc_units[i].ents);
+  memmove(&lsrc_units[i], &lsrc_units[i+1], sizeof(lsrc_unit) * (lsrc_nunits - i - 1));
+  lsrc_nunits--;
+}
+
+// 読み込んだ単位を登録する。同じインタプリタが同じ位置から読んだ前の単位は解放する。
+void lsrc_publish(lsrc_unit u) {
+  pthread_rwlock_wrlock(&lsrc_lock);
+  for (long i = 0; i < lsrc_nunits; i++) {
+    lsrc_unit* x = &lsrc_units[i];
+    if (x->owner == u.owner && x->file == u.file && x->line == u.line && x->col == u.col) {
+      lsrc_unit_remove(i);
+      break;
+    }
+  }
+  if (lsrc_nunits == lsrc_cap) {
+    lsrc_cap = lsrc_cap ? lsrc_cap * 2 : 16;
+    lsrc_units = realloc(lsrc_units, sizeof(lsrc_unit) * lsrc_cap);
+  }
+  // 番号は確保した順に増えるが、登録の順は前後しうるので、挿入位置を探す。
+  long i = lsrc_nunits;
+  while (i > 0 && lsrc_units[i-1].first > u.first) { i--; }
+  memmove(&lsrc_units[i+1], &lsrc_units[i], sizeof(lsrc_unit) * (lsrc_nunits - i));
+  lsrc_units[i] = u;
+  lsrc_nunits++;
+  pthread_rwlock_unlock(&lsrc_lock);
+}
+
+// インタプリタcが読み込んだ単位を全て解放する。
+void lsrc_drop(lctx* c) {
+  pthread_rwlock_wrlock(&lsrc_lock);
+  for (long i = 0; i < lsrc_nunits;) {
+    if (lsrc_units[i].owner == c) { lsrc_unit_remove(i); } else { i++; }
+  }
+  pthread_rwlock_unlock(&lsrc_lock);
+}
+
+// 番号の位置(読み込みのロック中に呼ぶ)。解放済みや位置なしならNULL。
+lsrc* lsrc_find(unsigned loc) {
+  long lo = 0, hi = lsrc_nunits;
+  while (lo < hi) {
+    long mid = (lo + hi) / 2;
+    lsrc_unit* u = &lsrc_units[mid];
+    if (loc < u->first) { hi = mid; }
+    else if (loc - u->first >= u->n) { lo = mid + 1; }
+    else { return &u->ents[loc - u->first]; }
+  }
+  return NULL;
+}
+
+// 番号の位置をxに写す。位置がなければ0。
+int lsrc_get(unsigned loc, lsrc* x) {
+  if (!loc) { return 0; }
+  pthread_rwlock_rdlock(&lsrc_lock);
+  lsrc* p = lsrc_find(loc);
+  if (p) { *x = *p; }
+  pthread_rwlock_unlock(&lsrc_lock);
+  return p != NULL;
+}
+
+// "ファイル:行:列: "を出力する。位置がなければ何もしない。
+void lsrc_fprint(FILE* f, unsigned loc) {
+  lsrc x;
+  if (lsrc_get(loc, &x)) { fprintf(f, "%s:%i:%i: ", x.file, x.line, x.col); }
+}
+
+// その位置で作った名前のない関数の、プロファイラでの名前("<lambda ファイル:行>")。位置がなければNULL。
+lname* lsrc_anon(unsigned loc) {
+  if (!loc) { return NULL; }
+  pthread_rwlock_rdlock(&lsrc_lock);
+  lsrc* x = lsrc_find(loc);
+  lname* n = x ? __atomic_load_n(&x->anon, __ATOMIC_ACQUIRE) : NULL;
+  if (x && !n) {
+    char buf[512];
+    snprintf(buf, sizeof(buf), "<lambda %s:%i>", x->file, x->line);
+    // 同時に作っても、インターンするので同じ名前になる。
+    n = lname_intern(buf);
+    __atomic_store_n(&x->anon, n, __ATOMIC_RELEASE);
+  }
+  pthread_rwlock_unlock(&lsrc_lock);
+  return n;
+}
+
+////////////////////////////////////////
+// 評価の制限
+////////////////////////////////////////
+
+// 終わらない再帰や巨大なjoinで評価がスレッドを占有し続けないよう、評価の段数、関数呼び出しの深さ、
+// 値のために確保したバイト数に上限を設ける。超えたら以後のlval_evalが全てエラーを返すので、
+// 評価は通常のエラーと同じ経路で途中の値を解放しながら打ち切られる。
+
+enum { LQUOTA_OK, LQUOTA_STEPS, LQUOTA_DEPTH, LQUOTA_BYTES };
+
+// 現在のスレッドの評価に課されている制限。制限がなければNULL。
+static __thread lquota* lquota_cur = NULL;
+// 現在のスレッドでの関数呼び出しの深さ。
+static __thread long lquota_depth = 0;
+// 現在のスレッドで評価しているインタプリタ。トップレベルの評価の外ではNULL。
+static __thread lctx* lctx_cur = NULL;
+
+// 制限を超えたことを記録する。最初に超えたものだけを残す。
+void lquota_exceed(lquota* q, int kind) {
+  int ok = LQUOTA_OK;
+  __atomic_compare_exchange_n(&q->exceeded, &ok, kind, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// 評価を1段進める。制限を超えていれば0。
+// 並列処理のワーカーも同じ制限を数えるので、カウンタはアトミックに更新する。
+static inline int lquota_step(lquota* q) {
+  if (q->max_steps && __atomic_add_fetch(&q->steps, 1, __ATOMIC_RELAXED) > q->max_steps) {
+    lquota_exceed(q, LQUOTA_STEPS);
+  }
+  return __atomic_load_n(&q->exceeded, __ATOMIC_RELAXED) == LQUOTA_OK;
+}
+
+// 値のためにnバイト確保したことを記録する。
+static inline void lquota_alloc(long n) {
+  lquota* q = lquota_cur;
+  if (q && q->max_bytes && __atomic_add_fetch(&q->bytes, n, __ATOMIC_RELAXED) > q->max_bytes) {
+    lquota_exceed(q, LQUOTA_BYTES);
+  }
+}
+
+// 環境変数で与えられた制限。なければ0(制限なし)。
+long lquota_getenv(const char* name) {
+  char* s = getenv(name);
+  return s ? strtol(s, NULL, 10) : 0;
+}
+
+// インタプリタの制限の設定。
+void lquota_set(lctx* c, long steps, long depth, long bytes) {
+  c->quota.max_steps = steps > 0 ? steps : 0;
+  c->quota.max_depth = depth > 0 ? depth : 0;
+  c->quota.max_bytes = bytes > 0 ? bytes : 0;
+}
+
+// トップレベルの評価を始める。インタプリタに制限があれば、このスレッドの評価に課す。
+// 既に評価の途中(loadや組み込み関数からの呼び出し)なら、数え直さずに続ける。戻り値はlquota_endに渡す。
+lquota* lquota_begin(lctx* c) {
+  lstats_register();
+  lquota* prev = lquota_cur;
+  lquota* q = &c->quota;
+  if (prev == q) { return prev; }
+  if (q->max_steps || q->max_depth || q->max_bytes) {
+    __atomic_store_n(&q->steps, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->exceeded, LQUOTA_OK, __ATOMIC_RELAXED);
+    lquota_cur = q;
+  } else {
+    lquota_cur = NULL;
+  }
+  return prev;
+}
+
+void lquota_end(lquota* prev) { lquota_cur = prev; }
+
+lval* lval_eval(lenv* e, lval* v);
+lctx* lenv_ctx(lenv* e);
+
+// トップレベルの式を評価する。制限はこの評価ごとに数え直す。
+lval* lquota_eval(lenv* e, lval* v) {
+  lctx* c = lenv_ctx(e);
+  lquota* prev = lquota_begin(c);
+  lctx* pc = lctx_cur;
+  lctx_cur = c;
+  unsigned loc = lsrc_cur;
+  lsrc_cur = v->loc;
+  lval* x = lval_eval(e, v);
+  lsrc_cur = loc;
+  lctx_cur = pc;
+  lquota_end(prev);
+  return x;
+}
+
+////////////////////////////////////////
+// プロファイラ
+////////////////////////////////////////
+
+// SIGPROFでCPU時間の一定間隔ごとにスレッドを止め、そのスレッドで呼び出し中のLispの関数の並びを記録する。
+// 関数の値はdefや=で束縛されたときの名前を持ち、lval_callがプロファイル中だけスレッドごとのスタックに積む。
+// 終わったら、関数ごとのself/totalの割合と、フレームグラフ用の折り畳んだスタックを出力する。
+
+#define LPROF_INTERVAL 1000 // 標本を取る間隔(CPU時間のマイクロ秒)
+#define LPROF_DEPTH 1024 // 記録するスタックの深さ。これより深い部分は省いて、一番内側の関数だけを記録する。
+#define LPROF_FRAMES (1 << 20) // 記録できるフレームの総数
+#define LPROF_SAMPLES (1 << 18) // 記録できる標本の数
+
+// 関数名。インターンして解放しないので、関数の値をコピーしても名前はポインタで共有できる。
+// プロファイルの集計用のカウンタも持つ。
+struct lname {
+  struct lname* next;
+  long self, total, seen; // プロファイラの集計
+  unsigned loc; // この名前に最初に束縛した関数の位置(lsrc)
+  long jit_calls; // この名前の関数を呼び出した回数(JITコンパイラ)
+  struct ljit* jit; // この名前の関数をコンパイルしたもの(JITコンパイラ)
+  struct { long count[LVAL_NTYPES + 1]; long bytes; } heap; // ここで確保された生きているオブジェクト
+  char str[];
+};
+
+static lname* lname_table[256];
+static pthread_mutex_t lname_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 名前をインターンする。
+lname* lname_intern(char* s) {
+  unsigned h = 0;
+  for (char* p = s; *p; p++) { h = h * 31 + (unsigned char)*p; }
+  pthread_mutex_lock(&lname_lock);
+  lname** b = &lname_table[h & 255];
+  lname* n;
+  for (n = *b; n && strcmp(n->str, s) != 0; n = n->next) {}
+  if (!n) {
+    n = calloc(1, sizeof(lname) + strlen(s) + 1);
+    strcpy(n->str, s);
+    n->next = *b;
+    *b = n;
+  }
+  pthread_mutex_unlock(&lname_lock);
+  return n;
+}
+
+// 名前を出力する。関数を束縛した位置が分かっていれば添える。
+void lname_fprint(FILE* f, lname* n) {
+  lsrc x;
+  fputs(n->str, f);
+  if (lsrc_get(__atomic_load_n(&n->loc, __ATOMIC_RELAXED), &x)) { fprintf(f, " (%s:%i)", x.file, x.line); }
+}
+
+// 標本。framesのstartから始まるn個のフレーム(外側の関数から順)。
+typedef struct {
+  long start;
+  int n;
+} lprof_sample;
+
+static int lprof_on = 0; // プロファイル中か
+static int lprof_busy = 0; // 実行中のシグナルハンドラの数
+static lname** lprof_frames;
+static lprof_sample* lprof_samples;
+static long lprof_nframes, lprof_nsamples, lprof_dropped;
+static lname* lprof_anon; // 名前のない関数
+static lname* lprof_elided; // 省いたフレーム
+static clock_t lprof_clock; // 開始時のCPU時間
+
+// スレッドで呼び出し中の関数。シグナルハンドラは割り込んだスレッドのものを読む。
+typedef struct {
+  lname* stack[LPROF_DEPTH];
+  int depth;
+  lname* leaf; // 一番内側の関数。スタックより深くても記録する。
+} lprof_thread;
+
+// 現在のスレッドの記録。共有ライブラリ(-fPIC)の動的なTLSは、スレッドが初めて触るときに__tls_get_addrを通ることがあり、
+// それはシグナルハンドラから呼べない。ハンドラが読むのはこのポインタだけにして、静的なTLS(initial-exec)に置く。
+// 記録は静的なTLSに置くには大きいので、スレッドが最初に関数を呼び出すときに確保し、終了時に解放する。
+static __thread __attribute__((tls_model("initial-exec"))) lprof_thread* lprof_self = NULL;
+static pthread_key_t lprof_key;
+static pthread_once_t lprof_once = PTHREAD_ONCE_INIT;
+
+static void lprof_thread_del(void* t) {
+  lprof_self = NULL;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  free(t);
+}
+
+static void lprof_key_init(void) { pthread_key_create(&lprof_key, lprof_thread_del); }
+
+static lprof_thread* lprof_thread_get(void) {
+  lprof_thread* t = lprof_self;
+  if (t) { return t; }
+  pthread_once(&lprof_once, lprof_key_init);
+  t = calloc(1, sizeof(lprof_thread));
+  pthread_setspecific(lprof_key, t);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  lprof_self = t;
+  return t;
+}
+
+// 呼び出す関数を積む。戻り値は積む前の深さで、呼び出しが終わったら積む前のleafと共にlprof_popに渡す。
+static inline int lprof_push(lprof_thread* t, lname* name) {
+  int d = t->depth;
+  if (!name) { name = lprof_anon; }
+  if (d < LPROF_DEPTH) { t->stack[d] = name; }
+  t->leaf = name;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  t->depth = d + 1;
+  return d;
+}
+
+static inline void lprof_pop(lprof_thread* t, int d, lname* leaf) {
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  t->depth = d;
+  t->leaf = leaf;
+}
+
+// SIGPROFのハンドラ。領域を確保済みの配列にアトミックに場所を取って書き込むだけにする。
+void lprof_handler(int sig) {
+  __atomic_add_fetch(&lprof_busy, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&lprof_on, __ATOMIC_SEQ_CST) == 1) {
+    lprof_thread* t = lprof_self;
+    int depth = t ? t->depth : 0;
+    int n = depth < LPROF_DEPTH ? depth : LPROF_DEPTH;
+    long start = __atomic_fetch_add(&lprof_nframes, n, __ATOMIC_SEQ_CST);
+    long i = __atomic_fetch_add(&lprof_nsamples, 1, __ATOMIC_SEQ_CST);
+    if (start + n > LPROF_FRAMES || i >= LPROF_SAMPLES) {
+      __atomic_add_fetch(&lprof_dropped, 1, __ATOMIC_SEQ_CST);
+      if (i < LPROF_SAMPLES) { lprof_samples[i].n = -1; }
+    } else {
+      for (int k = 0; k < n; k++) { lprof_frames[start + k] = t->stack[k]; }
+      // 深すぎる部分は省いたことを示し、最後に一番内側の関数を置く。
+      if (depth > LPROF_DEPTH) {
+        lprof_frames[start + n - 2] = lprof_elided;
+        lprof_frames[start + n - 1] = t->leaf;
+      }
+      lprof_samples[i].start = start;
+      lprof_samples[i].n = n;
+    }
+  }
+  __atomic_sub_fetch(&lprof_busy, 1, __ATOMIC_SEQ_CST);
+}
+
+// プロファイルを始める。既にプロファイル中なら0。
+int lprof_start(void) {
+  int off = 0;
+  if (!__atomic_compare_exchange_n(&lprof_on, &off, -1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) { return 0; }
+  lprof_anon = lname_intern("<lambda>");
+  lprof_elided = lname_intern("...");
+  lprof_clock = clock();
+  lprof_frames = malloc(sizeof(lname*) * LPROF_FRAMES);
+  lprof_samples = malloc(sizeof(lprof_sample) * LPROF_SAMPLES);
+  lprof_nframes = lprof_nsamples = lprof_dropped = 0;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = lprof_handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, NULL);
+
+  __atomic_store_n(&lprof_on, 1, __ATOMIC_SEQ_CST);
+  struct itimerval t = { { 0, LPROF_INTERVAL }, { 0, LPROF_INTERVAL } };
+  setitimer(ITIMER_PROF, &t, NULL);
+  return 1;
+}
+
+// プロファイルを止める。実行中のハンドラが全て抜けるまで待つ。
+void lprof_stop(void) {
+  struct itimerval t = { { 0, 0 }, { 0, 0 } };
+  setitimer(ITIMER_PROF, &t, NULL);
+  __atomic_store_n(&lprof_on, -1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&lprof_busy, __ATOMIC_SEQ_CST)) { sched_yield(); }
+  if (lprof_nsamples > LPROF_SAMPLES) { lprof_nsamples = LPROF_SAMPLES; }
+}
+
+int lprof_cmp_name(const void* a, const void* b) {
+  const lname* x = *(lname* const*)a;
+  const lname* y = *(lname* const*)b;
+  if (x->self != y->self) { return x->self < y->self ? 1 : -1; }
+  if (x->total != y->total) { return x->total < y->total ? 1 : -1; }
+  return strcmp(x->str, y->str);
+}
+
+// 関数ごとの割合を表示する。selfはその関数自身を実行中だった割合、totalは呼び出し中だった割合。
+void lprof_report(FILE* f) {
+  long n = lprof_nsamples;
+  for (int b = 0; b < 256; b++) {
+    for (lname* x = lname_table[b]; x; x = x->next) { x->self = x->total = 0; x->seen = -1; }
+  }
+  long used = 0;
+  for (long i = 0; i < n; i++) {
+    lprof_sample* s = &lprof_samples[i];
+    if (s->n < 0) { continue; }
+    used++;
+    for (int k = 0; k < s->n; k++) {
+      lname* x = lprof_frames[s->start + k];
+      // 再帰で何度も現れても、1つの標本では1回と数える。
+      if (x->seen != i) { x->seen = i; x->total++; }
+    }
+    if (s->n > 0) { lprof_frames[s->start + s->n - 1]->self++; }
+  }
+
+  long count = 0;
+  for (int b = 0; b < 256; b++) {
+    for (lname* x = lname_table[b]; x; x = x->next) { if (x->total) { count++; } }
+  }
+  lname** fns = malloc(sizeof(lname*) * (count ? count : 1));
+  count = 0;
+  for (int b = 0; b < 256; b++) {
+    for (lname* x = lname_table[b]; x; x = x->next) { if (x->total) { fns[count++] = x; } }
+  }
+  qsort(fns, count, sizeof(lname*), lprof_cmp_name);
+
+  fprintf(f, "Profile: %li samples in %.3fs CPU", used, (double)(clock() - lprof_clock) / CLOCKS_PER_SEC);
+  if (lprof_dropped) { fprintf(f, ", %li dropped", lprof_dropped); }
+  fprintf(f, "\n   self   total  function\n");
+  for (long i = 0; i < count; i++) {
+    fprintf(f, " %5.1f%%  %5.1f%%  ", 100.0 * fns[i]->self / used, 100.0 * fns[i]->total / used);
+    lname_fprint(f, fns[i]);
+    fputc('\n', f);
+  }
+  free(fns);
+}
+
+// 標本をスタックの内容で並べる。同じスタックの標本が隣り合えばよい。
+int lprof_cmp_sample(const void* a, const void* b) {
+  const lprof_sample* x = a;
+  const lprof_sample* y = b;
+  int n = x->n < y->n ? x->n : y->n;
+  for (int k = 0; k < n; k++) {
+    lname* p = lprof_frames[x->start + k];
+    lname* q = lprof_frames[y->start + k];
+    if (p != q) { return p < q ? -1 : 1; }
+  }
+  return (x->n > y->n) - (x->n < y->n);
+}
+
+// 折り畳んだスタック("外側;...;内側 標本数"の行)を出力する。flamegraph.plなどにそのまま渡せる。
+void lprof_collapsed(FILE* f) {
+  qsort(lprof_samples, lprof_nsamples, sizeof(lprof_sample), lprof_cmp_sample);
+  for (long i = 0; i < lprof_nsamples;) {
+    long j = i + 1;
+    while (j < lprof_nsamples && lprof_cmp_sample(&lprof_samples[i], &lprof_samples[j]) == 0) { j++; }
+    lprof_sample* s = &lprof_samples[i];
+    if (s->n >= 0) {
+      if (s->n == 0) { fputs("(toplevel)", f); }
+      for (int k = 0; k < s->n; k++) { fprintf(f, "%s%s", k ? ";" : "", lprof_frames[s->start + k]->str); }
+      fprintf(f, " %li\n", j - i);
+    }
+    i = j;
+  }
+}
+
+// 記録を破棄し、次のプロファイルを始められるようにする。
+void lprof_free(void) {
+  free(lprof_frames);
+  free(lprof_samples);
+  lprof_frames = NULL;
+  lprof_samples = NULL;
+  __atomic_store_n(&lprof_on, 0, __ATOMIC_SEQ_CST);
+}
+
+// プロファイルを止めて結果を出力する。pathがあれば、折り畳んだスタックをそのファイルに書く。書けなければ0。
+int lprof_finish(FILE* report, char* path) {
+  lprof_stop();
+  lprof_report(report);
+  int ok = 1;
+  if (path) {
+    FILE* f = fopen(path, "w");
+    if (f) { lprof_collapsed(f); fclose(f); } else { ok = 0; }
+  }
+  lprof_free();
+  return ok;
+}
+
+////////////////////////////////////////
+// ヒーププロファイラ
+////////////////////////////////////////
+
+// 有効にすると(--heap-profile)、lvalと環境に確保したLispの関数(呼び出し中の一番内側の関数)を記録し、
+// 関数ごと、型ごとに生きているオブジェクトの数とバイト数を数える。
+// 閉包が持ち続ける環境、巨大なリスト、解放されない文字列のどれが大きいかを調べるのに使う。
+// バイト数はlval本体、環境本体と、文字列とシンボルの中身、リストの子要素の配列、数値配列の中身の大きさ。
+// 子要素の配列と数値配列は要素数に比例するものとして数え、要素数が変わるたびに差分を数える(lheap_resize)。
+
+#define LHEAP_ENV LVAL_NTYPES // 環境の種類の番号
+#define LHEAP_KINDS (LVAL_NTYPES + 1)
+
+static int lheap_on = 0; // ヒーププロファイル中か
+static lname* lheap_top; // 関数の外で確保したもの
+static __thread lname* lheap_fn = NULL; // 呼び出し中の一番内側のLispの関数。組み込み関数は飛ばす。
+
+static inline int lheap_enabled(void) { return __atomic_load_n(&lheap_on, __ATOMIC_RELAXED); }
+
+// 現在の確保場所。
+static inline lname* lheap_site_now(void) { return lheap_fn ? lheap_fn : lheap_top; }
+
+// 種類kindのnバイトのオブジェクトをsiteで確保したことを記録する。解放時は負の数で呼ぶ。
+static inline void lheap_count(lname* site, int kind, long k, long bytes) {
+  __atomic_add_fetch(&site->heap.count[kind], k, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&site->heap.bytes, bytes, __ATOMIC_RELAXED);
+}
+
+// ヒーププロファイルを始める。以後に確保したものから数える。
+void lheap_start(void) {
+  lprof_anon = lname_intern("<lambda>");
+  lheap_top = lname_intern("<toplevel>");
+  __atomic_store_n(&lheap_on, 1, __ATOMIC_SEQ_CST);
+}
+
+int lheap_cmp(const void* a, const void* b) {
+  long x = __atomic_load_n(&(*(lname* const*)a)->heap.bytes, __ATOMIC_RELAXED);
+  long y = __atomic_load_n(&(*(lname* const*)b)->heap.bytes, __ATOMIC_RELAXED);
+  return (x < y) - (x > y);
+}
+
+char* ltype_name(int t);
+
+char* lheap_kind_name(int kind) { return kind == LHEAP_ENV ? "Environment" : ltype_name(kind); }
+
+// 生きているオブジェクトがある確保場所の一覧。多い順。
+lname** lheap_sites(long* n) {
+  pthread_mutex_lock(&lname_lock);
+  *n = 0;
+  for (int b = 0; b < 256; b++) {
+    for (lname* x = lname_table[b]; x; x = x->next) { (*n)++; }
+  }
+  lname** sites = malloc(sizeof(lname*) * (*n ? *n : 1));
+  *n = 0;
+  for (int b = 0; b < 256; b++) {
+    for (lname* x = lname_table[b]; x; x = x->next) {
+      if (__atomic_load_n(&x->heap.bytes, __ATOMIC_RELAXED) > 0) { sites[(*n)++] = x; }
+    }
+  }
+  pthread_mutex_unlock(&lname_lock);
+  qsort(sites, *n, sizeof(lname*), lheap_cmp);
+  return sites;
+}
+
+// 生きているオブジェクトの一覧を表示する。
+void lheap_report(FILE* f) {
+  long n;
+  lname** sites = lheap_sites(&n);
+  long count[LHEAP_KINDS] = { 0 };
+  long objects = 0, bytes = 0;
+  for (long i = 0; i < n; i++) {
+    for (int k = 0; k < LHEAP_KINDS; k++) {
+      long c = __atomic_load_n(&sites[i]->heap.count[k], __ATOMIC_RELAXED);
+      count[k] += c;
+      objects += c;
+    }
+    bytes += __atomic_load_n(&sites[i]->heap.bytes, __ATOMIC_RELAXED);
+  }
+
+  fprintf(f, "Live heap: %li objects, %li bytes\n", objects, bytes);
+  fprintf(f, "%-14s %12s\n", "type", "objects");
+  for (int k = 0; k < LHEAP_KINDS; k++) {
+    if (count[k]) { fprintf(f, "%-14s %12li\n", lheap_kind_name(k), count[k]); }
+  }
+  fprintf(f, "%12s %12s  %s\n", "bytes", "objects", "site");
+  for (long i = 0; i < n; i++) {
+    long c = 0;
+    for (int k = 0; k < LHEAP_KINDS; k++) { c += __atomic_load_n(&sites[i]->heap.count[k], __ATOMIC_RELAXED); }
+    fprintf(f, "%12li %12li  ", __atomic_load_n(&sites[i]->heap.bytes, __ATOMIC_RELAXED), c);
+    lname_fprint(f, sites[i]);
+    fputc('\n', f);
+  }
+  free(sites);
+}
+
+// 関数の外で作ったコピーは、元のオブジェクトを確保した場所のものとして数え直す。
+// トップレベルのdefが関数の結果を写したときに、確保場所がトップレベルに移ってしまわないように。
+static inline void lheap_inherit(lname** site, lname* from, int kind, long bytes) {
+  if (*site != lheap_top || !from || from == lheap_top) { return; }
+  lheap_count(*site, kind, -1, -bytes);
+  lheap_count(from, kind, 1, bytes);
+  *site = from;
+}
+
+// ヒーププロファイル中に確保したlvalの直前に置く情報。プロファイル中でなければ確保しないので、
+// プロファイラを使わないときの値の大きさは変わらない。
+typedef struct {
+  lname* site; // 確保した関数
+  long type; // 確保したときの型
+} lheap_hdr;
+
+static inline lheap_hdr* lheap_hdr_of(lval* v) { return (lheap_hdr*)v - 1; }
+
+// vを確保した関数。ヒーププロファイル中に確保したものでなければNULL。
+static inline lname* lheap_site(lval* v) { return v->heap ? lheap_hdr_of(v)->site : NULL; }
+
+// 子要素の配列(S式、Q式、パイプライン)または数値配列の、1要素あたりのバイト数。それ以外の型は0。
+static inline long lheap_elem_size(int type) {
+  if (type == LVAL_ARRAY) { return sizeof(long); }
+  if (type == LVAL_SEXPR || type == LVAL_QEXPR || type == LVAL_SEQ) { return sizeof(lval*); }
+  return 0;
+}
+
+// vの子要素の配列、または数値配列の要素数がk増えた(負なら減った)ことを記録する。
+static inline void lheap_resize(lval* v, long k) {
+  if (v->heap) { lheap_count(lheap_hdr_of(v)->site, lheap_hdr_of(v)->type, 0, k * lheap_elem_size(v->type)); }
+}
 
 ////////////////////////////////////////
 // lval
 ////////////////////////////////////////
 
+// 型がtypeのlvalの確保。評価の制限と統計のために数える。
+lval* lval_alloc(int type) {
+  lquota_alloc(sizeof(lval));
+  LSTAT_ADD(LSTAT_ALLOC + type, 1);
+  lval* v;
+  if (lheap_enabled()) {
+    lheap_hdr* h = malloc(sizeof(lheap_hdr) + sizeof(lval));
+    h->site = lheap_site_now();
+    h->type = type;
+    lheap_count(h->site, type, 1, sizeof(lval));
+    v = (lval*)(h + 1);
+    v->heap = 1;
+  } else {
+    v = malloc(sizeof(lval));
+    v->heap = 0;
+  }
+  v->type = type;
+  v->loc = 0;
+  v->shared = 0;
+  v->fold = NULL;
+  v->env = NULL;
+  return v;
+}
+
 // 数値型lvalの作成。
 lval* lval_num(long x) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
+  lval* v = lval_alloc(LVAL_NUM);
   v->num = x;
   return v;
 }
@@ -87,8 +958,7 @@ lval* lval_err(char *fmt, ...);
 
 // エラー型lvalの作成。
 lval* lval_err(char *fmt, ...) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
+  lval* v = lval_alloc(LVAL_ERR);
 
   va_list va;
   va_start(va, fmt);
@@ -101,22 +971,25 @@ lval* lval_err(char *fmt, ...) {
 
   va_end(va);
 
+  // 評価中の式の位置をエラーの位置とする。
+  v->loc = lsrc_cur;
+
   return v;
 }
 
 // シンボル型lvalの作成。
 lval* lval_sym(char *s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
+  lval* v = lval_alloc(LVAL_SYM);
   v->sym = malloc(strlen(s) + 1);
   strcpy(v->sym, s);
+  if (v->heap) { lheap_count(lheap_site(v), LVAL_SYM, 0, strlen(s) + 1); }
   return v;
 }
 
 // S式型lvalの作成。
 lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
+  lval* v = lval_alloc(LVAL_SEXPR);
+  v->num = 0;
   v->count = 0;
   v->cell = NULL;
   return v;
@@ -124,8 +997,8 @@ lval* lval_sexpr(void) {
 
 // リスト型の作成。
 lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
+  lval* v = lval_alloc(LVAL_QEXPR);
+  v->num = 0;
   v->count = 0;
   v->cell = NULL;
   return v;
@@ -133,48 +1006,137 @@ lval* lval_qexpr(void) {
 
 // ビルトイン関数の作成。
 lval* lval_fun(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval* v = lval_alloc(LVAL_FUN);
   v->builtin = func;
+  v->num = 0;
+  v->name = NULL;
+  v->memo = NULL;
   return v;
 }
 
 lenv* lenv_new(void);
+lval* lhcons(lval* v);
 
 // ユーザー定義関数の作成。
+// JITコンパイラ(後述)が有効か。有効なら、作った関数に定義の番号を振る。
+static int ljit_on = 0;
+static long ljit_serial = 0;
+static inline int ljit_enabled(void) { return __atomic_load_n(&ljit_on, __ATOMIC_RELAXED); }
+
 lval* lval_lambda(lval* formals, lval* body) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval* v = lval_alloc(LVAL_FUN);
 
   v->builtin = NULL;
+  v->name = NULL;
+  v->memo = NULL;
+  // 定義の番号。コピーには引き継がれ、コンパイルした定義と同じかどうかを本体を比べずに確かめられる。
+  v->num = ljit_enabled() ? __atomic_add_fetch(&ljit_serial, 1, __ATOMIC_RELAXED) : 0;
 
   // ローカル環境。
   v->env = lenv_new();
 
   v->formals = formals;
-  v->body = body;
+  v->loc = body->loc;
+  // ハッシュコンスが有効なら、本体は表の共有の値になり、関数のコピーでは複製されない。
+  v->body = lhcons(body);
+  return v;
+}
+
+// 範囲型lvalの作成。要素は必要になるまで作られない。
+lval* lval_range(long start, long stop, long step) {
+  lval* v = lval_alloc(LVAL_RANGE);
+  v->num = start;
+  v->stop = stop;
+  v->step = step;
+  return v;
+}
+
+// パイプライン型lvalの作成。cell[0]が元の列、cell[1]以降が{段の種類 引数}の形の段。
+lval* lval_seq(void) {
+  lval* v = lval_alloc(LVAL_SEQ);
+  v->count = 0;
+  v->cell = NULL;
+  return v;
+}
+
+lval* lquota_err(lquota* q);
+
+// 数値配列型lvalの作成。要素はlvalではなく、連続したlongの領域に格納する。
+// 要素数がcountに収まらない、確保できない、確保の制限を超える場合はエラーを返す。
+lval* lval_array(long n) {
+  if (n < 0 || n > INT_MAX) { return lval_err("Array size out of range. Got %li, Limit %i.", n, INT_MAX); }
+  lquota_alloc(sizeof(long) * n);
+  if (lquota_cur && __atomic_load_n(&lquota_cur->exceeded, __ATOMIC_RELAXED) != LQUOTA_OK) {
+    return lquota_err(lquota_cur);
+  }
+  long* arr = malloc(sizeof(long) * (n > 0 ? n : 1));
+  if (!arr) { return lval_err("Array of %li elements could not be allocated.", n); }
+  lval* v = lval_alloc(LVAL_ARRAY);
+  v->count = n;
+  v->arr = arr;
+  lheap_resize(v, n);
+  return v;
+}
+
+lmap* lmap_new(int cap);
+
+// 辞書型lvalの作成。
+lval* lval_map(void) {
+  lval* v = lval_alloc(LVAL_MAP);
+  v->map = lmap_new(8);
+  return v;
+}
+
+// future型lvalの作成。fの参照は呼び出し元から引き継ぐ。
+lval* lval_future(lfut* f) {
+  lval* v = lval_alloc(LVAL_FUTURE);
+  v->fut = f;
   return v;
 }
 
 lval* lval_str(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_STR;
+  lval* v = lval_alloc(LVAL_STR);
+  lquota_alloc(strlen(s) + 1);
   v->str = malloc(strlen(s) + 1);
   strcpy(v->str, s);
+  if (v->heap) { lheap_count(lheap_site(v), LVAL_STR, 0, strlen(s) + 1); }
   return v;
 }
 
 void lenv_del(lenv *e);
+void lfold_release(lfold_ref* f);
+lenv* lenv_snapshot_frames(lenv* e);
+void lenv_snapshot_frames_del(lenv* e);
+void lmap_del(lmap* m);
+void lfut_retain(lfut* f);
+void lfut_release(lfut* f);
+void lmemo_retain(lmemo* m);
+void lmemo_release(lmemo* m);
 
 // lvalのデストラクタ
 void lval_del(lval *v) {
+  // 共有の値は表が持ち続ける。
+  if (v->shared) { return; }
+  LSTAT_ADD(LSTAT_FREE + v->type, 1);
+  if (v->heap) {
+    long bytes = sizeof(lval);
+    if (v->type == LVAL_SYM) { bytes += strlen(v->sym) + 1; }
+    if (v->type == LVAL_STR) { bytes += strlen(v->str) + 1; }
+    bytes += v->count * lheap_elem_size(v->type);
+    lheap_count(lheap_hdr_of(v)->site, lheap_hdr_of(v)->type, -1, -bytes);
+  }
   switch (v->type) {
   case LVAL_NUM: break;
+  case LVAL_RANGE: break;
+  case LVAL_ARRAY: free(v->arr); break;
+  case LVAL_MAP: lmap_del(v->map); break;
+  case LVAL_FUTURE: lfut_release(v->fut); break;
   case LVAL_FUN:
     if (!v->builtin) {
       lenv_del(v->env);
       lval_del(v->formals);
       lval_del(v->body);
+      if (v->memo) { lmemo_release(v->memo); }
     }
     break;
     
@@ -182,63 +1144,121 @@ void lval_del(lval *v) {
   case LVAL_SYM: free(v->sym); break;
   case LVAL_STR: free(v->str); break;
     
-  // S式, Q式の場合は全ての子要素を解放する。
+  // S式, Q式, パイプラインの場合は全ての子要素を解放する。
   case LVAL_QEXPR:
   case LVAL_SEXPR:
+  case LVAL_SEQ:
     for (int i = 0; i < v->count; i++) {
       lval_del(v->cell[i]);
     }
     free(v->cell);
+    if (v->env) { lenv_snapshot_frames_del(v->env); }
     break;
   }
+  if (v->fold) { lfold_release(v->fold); }
   // lval自体を破棄。
-  free(v);
+  free(v->heap ? (void*)lheap_hdr_of(v) : v);
 }
 
 // lvalに子要素を追加する。
 lval* lval_add(lval* v, lval* x) {
   // 要素数を増やす。
   v->count++;
+  lquota_alloc(sizeof(lval*));
+  lheap_resize(v, 1);
   // 増やした要素数にあわせて、ヒープを拡張。
   v->cell = realloc(v->cell, sizeof(lval*) * v->count);
   // cellの末尾に新しいlvalを参照させる。
   v->cell[v->count-1] = x;
+  // 要素が変わったので、キャッシュしたハッシュ値を捨てる。
+  v->num = 0;
   return v;
 }
 
 lenv* lenv_copy(lenv* e);
+lmap* lmap_copy(lmap* m);
+
+lfold_ref* lfold_new(lval* orig, lfold_state* st, long epoch);
+lfold_ref* lfold_retain(lfold_ref* f);
+int lfold_dead(lfold_ref* f);
+lval* lfold_refold(lfold_ref* f);
 
 // lvalをコピー。
 lval* lval_copy(lval* v) {
-  lval* x = malloc(sizeof(lval));
-  x->type = v->type;
+  // 使えなくなった置き換えは、今の世代で置き換え直したものをコピーする。
+  if (v->fold && lfold_dead(v->fold)) {
+    lval* o = lval_copy(lfold_refold(v->fold));
+    o->loc = v->loc;
+    return o;
+  }
+  lval* x = lval_alloc(v->type);
+  if (x->heap) { lheap_inherit(&lheap_hdr_of(x)->site, lheap_site(v), v->type, sizeof(lval)); }
+  x->loc = v->loc;
+  long bytes = sizeof(lval);
 
   switch (v->type) {
   case LVAL_FUN:
+    x->name = v->name;
+    x->memo = v->memo;
+    if (x->memo) { lmemo_retain(x->memo); }
     if (v->builtin) { // 組み込み関数の場合。
       x->builtin = v->builtin;
+      x->num = v->num;
     } else { // ユーザー定義関数の場合。
       x->builtin = NULL;
+      x->num = v->num;
       x->env = lenv_copy(v->env);
       x->formals = lval_copy(v->formals);
-      x->body = lval_copy(v->body);
+      // 本体は評価するときにコピーするので、共有の値ならそのまま参照する。
+      x->body = v->body->shared ? v->body : lval_copy(v->body);
     }
     break;
   case LVAL_NUM: x->num = v->num; break;
+  case LVAL_RANGE: x->num = v->num; x->stop = v->stop; x->step = v->step; break;
+  case LVAL_ARRAY:
+    x->count = v->count;
+    bytes += sizeof(long) * v->count;
+    lquota_alloc(sizeof(long) * v->count);
+    x->arr = malloc(sizeof(long) * (v->count > 0 ? v->count : 1));
+    memcpy(x->arr, v->arr, sizeof(long) * v->count);
+    lheap_resize(x, x->count);
+    break;
+  case LVAL_MAP: x->map = lmap_copy(v->map); break;
+  case LVAL_FUTURE: x->fut = v->fut; lfut_retain(v->fut); break;
 
   case LVAL_ERR: x->err = malloc(strlen(v->err) + 1); strcpy(x->err, v->err); break;
-  case LVAL_SYM: x->sym = malloc(strlen(v->sym) + 1); strcpy(x->sym, v->sym); break;
-  case LVAL_STR: x->str = malloc(strlen(v->str) + 1); strcpy(x->str, v->str); break;
+  case LVAL_SYM:
+    bytes += strlen(v->sym) + 1;
+    x->sym = malloc(strlen(v->sym) + 1); strcpy(x->sym, v->sym);
+    if (x->heap) { lheap_count(lheap_site(x), LVAL_SYM, 0, strlen(v->sym) + 1); }
+    break;
+  case LVAL_STR:
+    bytes += strlen(v->str) + 1;
+    lquota_alloc(strlen(v->str) + 1);
+    x->str = malloc(strlen(v->str) + 1); strcpy(x->str, v->str);
+    if (x->heap) { lheap_count(lheap_site(x), LVAL_STR, 0, strlen(v->str) + 1); }
+    break;
     
   case LVAL_SEXPR:
   case LVAL_QEXPR:
+  case LVAL_SEQ:
+    // 同じ構造なので、ハッシュ値のキャッシュもそのまま使える。
+    x->num = v->type == LVAL_QEXPR ? v->num : 0;
+    x->env = v->env ? lenv_snapshot_frames(v->env) : NULL;
     x->count = v->count;
+    bytes += sizeof(lval*) * x->count;
+    lquota_alloc(sizeof(lval*) * x->count);
     x->cell = malloc(sizeof(lval*) * x->count);
+    lheap_resize(x, x->count);
     for (int i = 0; i < x->count; i++) {
       x->cell[i] = lval_copy(v->cell[i]);
     }
     break;
   }
+  // 畳み込んだ値は、元の式と世代を引き継ぐ。元の式は書き換えないので、複製せずに参照する。
+  if (v->fold) { x->fold = lfold_retain(v->fold); }
+  LSTAT_ADD(LSTAT_COPY, 1);
+  LSTAT_ADD(LSTAT_COPY_BYTES, bytes);
   return x;
 }
 
@@ -264,8 +1284,15 @@ lval* lval_read_str(mpc_ast_t* t) {
   return str;
 }
 
-// 抽象構文木からlvalへのマッピング。
-lval* lval_read(mpc_ast_t* t) {
+// 位置を付けるノード(S式とQ式。全体を包む">"は除く)の数。
+unsigned lval_read_count(mpc_ast_t* t) {
+  unsigned n = strcmp(t->tag, ">") != 0 && (strstr(t->tag, "sexpr") || strstr(t->tag, "qexpr"));
+  for (int i = 0; i < t->children_num; i++) { n += lval_read_count(t->children[i]); }
+  return n;
+}
+
+// 抽象構文木からlvalへのマッピング。uがあれば、S式とQ式に番号を振り、その位置をuに記録する。
+lval* lval_read_node(mpc_ast_t* t, lsrc_unit* u) {
   if (strstr(t->tag, "number")) { return lval_read_num(t); }
   if (strstr(t->tag, "string")) { return lval_read_str(t); }
   if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
@@ -275,6 +1302,15 @@ lval* lval_read(mpc_ast_t* t) {
   if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
   if (strstr(t->tag, "sexpr")) { x = lval_sexpr(); }
   if (strstr(t->tag, "qexpr")) { x = lval_qexpr(); }
+  if (x && u && strcmp(t->tag, ">") != 0) {
+    // パースした文字列がファイルのline行col列から始まる場合の位置にする。
+    lsrc* p = &u->ents[u->n];
+    p->file = u->file;
+    p->line = u->line + t->state.row;
+    p->col = (t->state.row == 0 ? u->col : 1) + t->state.col;
+    p->anon = NULL;
+    x->loc = u->first + u->n++;
+  }
 
   for (int i = 0; i < t->children_num; i++) {
     if (strstr(t->children[i]->tag, "comment")) { continue; }
@@ -283,57 +1319,101 @@ lval* lval_read(mpc_ast_t* t) {
     if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
     if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
     if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
-    x = lval_add(x, lval_read(t->children[i]));
+    x = lval_add(x, lval_read_node(t->children[i], u));
   }
   return x;
 }
 
-// lval_printとlval_expr_printはお互いに呼び合うので、前方宣言する。
-void lval_print(lval *v);
+// 抽象構文木からlvalへのマッピング。file(インターンした名前)があれば、S式とQ式にそのファイルでの位置を付け、
+// 位置の表にインタプリタcの単位として登録する。パースした文字列はファイルのline行col列から始まるものとする。
+lval* lval_read_at(lctx* c, mpc_ast_t* t, char* file, int line, int col) {
+  if (!file) { return lval_read_node(t, NULL); }
+  // 番号をまとめて確保し、位置は登録するまで他のスレッドから見えない表に書く。
+  lsrc_unit u = { c, file, line, col, 0, 0, NULL };
+  unsigned n = lval_read_count(t);
+  u.first = lsrc_reserve(n);
+  if (!u.first) { return lval_read_node(t, NULL); }
+  u.ents = malloc(sizeof(lsrc) * (n ? n : 1));
+  lval* x = lval_read_node(t, &u);
+  lsrc_publish(u);
+  return x;
+}
+
+lval* lval_read(lctx* c, mpc_ast_t* t, char* file) { return lval_read_at(c, t, file, 1, 1); }
+
+// lval_fprintとlval_expr_printはお互いに呼び合うので、前方宣言する。
+void lval_fprint(FILE* f, lval *v);
 
 // 開始と終了の文字を指定して、式をプリントする。
-void lval_expr_print(lval* v, char open, char close) {
-  putchar(open);
+void lval_expr_print(FILE* f, lval* v, char open, char close) {
+  fputc(open, f);
   for (int i = 0; i < v->count; i++ ) {
-    lval_print(v->cell[i]);
+    lval_fprint(f, v->cell[i]);
   
     if (i != (v->count-1)) {
-      putchar(' ');
+      fputc(' ', f);
     }
   }
-  putchar(close);
+  fputc(close, f);
 }
 
 // String型lvalを出力。
-void lval_print_str(lval* v) {
+void lval_print_str(FILE* f, lval* v) {
   char* escaped = malloc(strlen(v->str)+1);
   strcpy(escaped, v->str);
   // mpcライブラリの関数を用いて、エスケープ文字を処理する。
   escaped = mpcf_escape(escaped);
-  printf("\"\%s\"", escaped);
+  fprintf(f, "\"\%s\"", escaped);
   free(escaped);
 }
 
-// lvalをプリントする。
-void lval_print(lval* v) {
+// 辞書型lvalを出力。#{キー 値 キー 値 ...}の形式。
+void lval_map_print(FILE* f, lval* v) {
+  int first = 1;
+  fprintf(f, "#{");
+  for (int i = 0; i < v->map->cap; i++) {
+    if (!v->map->keys[i]) { continue; }
+    if (!first) { fputc(' ', f); }
+    lval_fprint(f, v->map->keys[i]); fputc(' ', f); lval_fprint(f, v->map->vals[i]);
+    first = 0;
+  }
+  fputc('}', f);
+}
+
+// lvalをファイルに出力する。
+void lval_fprint(FILE* f, lval* v) {
+  // 畳み込んだ値は、元の式として出力する。
+  if (v->fold) { lval_fprint(f, v->fold->orig); return; }
   switch (v->type) {
-  case LVAL_NUM: printf("%li", v->num); break;
-  case LVAL_ERR: printf("Error: %s", v->err); break;
-  case LVAL_SYM: printf("%s", v->sym); break;
+  case LVAL_NUM: fprintf(f, "%li", v->num); break;
+  case LVAL_RANGE: fprintf(f, "<range %li %li %li>", v->num, v->stop, v->step); break;
+  case LVAL_ERR: fprintf(f, "Error: %s", v->err); break;
+  case LVAL_SYM: fprintf(f, "%s", v->sym); break;
     // 格納されている文字列のエスケープ文字などを処理してから出力する。
-  case LVAL_STR: lval_print_str(v); break;
+  case LVAL_STR: lval_print_str(f, v); break;
   case LVAL_FUN:
     if (v->builtin) {
-      printf("<builtin>");
+      fprintf(f, "<builtin>");
     } else {
-      printf("(\\ "); lval_print(v->formals); putchar(' '); lval_print(v->body); putchar(')');
+      fprintf(f, "(\\ "); lval_fprint(f, v->formals); fputc(' ', f); lval_fprint(f, v->body); fputc(')', f);
     }
     break;
-  case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
-  case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
+  case LVAL_SEXPR: lval_expr_print(f, v, '(', ')'); break;
+  case LVAL_QEXPR: lval_expr_print(f, v, '{', '}'); break;
+  case LVAL_SEQ: fprintf(f, "<seq>"); break;
+  case LVAL_FUTURE: fprintf(f, "<future>"); break;
+  case LVAL_MAP: lval_map_print(f, v); break;
+  case LVAL_ARRAY:
+    fputc('[', f);
+    for (int i = 0; i < v->count; i++) { fprintf(f, i ? " %li" : "%li", v->arr[i]); }
+    fputc(']', f);
+    break;
   }
 }
 
+// lvalを標準出力にプリントする。
+void lval_print(lval* v) { lval_fprint(stdout, v); }
+
 // 改行付きlval_print
 void lval_println(lval* v) { lval_print(v); putchar('\n'); }  
 
@@ -343,8 +1423,11 @@ lval* lval_pop(lval* v, int i) {
   lval* x = v->cell[i];
 
   memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
+  LSTAT_ADD(LSTAT_POP_BYTES, sizeof(lval*) * (v->count-i-1));
 
   v->count--;
+  v->num = 0;
+  lheap_resize(v, -1);
 
   v->cell = realloc(v->cell, sizeof(lval *) * v->count);
   return x;
@@ -369,14 +1452,72 @@ lval* lval_join(lval* x, lval* y) {
   return x;
 }
 
+// 範囲の要素数。幅と増分はlongに収まらないことがあるので、unsigned longで計算する。
+unsigned long lval_range_ulen(long num, long stop, long step) {
+  unsigned long span, ustep;
+  if (step > 0 && num < stop) {
+    span = (unsigned long)stop - (unsigned long)num;
+    ustep = (unsigned long)step;
+  } else if (step < 0 && num > stop) {
+    span = (unsigned long)num - (unsigned long)stop;
+    ustep = -(unsigned long)step;
+  } else {
+    return 0;
+  }
+  return span / ustep + (span % ustep != 0);
+}
+
+// 範囲の要素数。builtin_rangeでlongに収まる範囲だけを作る。
+long lval_range_len(lval* r) { return (long)lval_range_ulen(r->num, r->stop, r->step); }
+
+// 範囲のi番目の要素。途中の積がlongに収まらなくても、要素自体は範囲内にある。
+long lval_range_nth(lval* r, long i) {
+  return (long)((unsigned long)r->num + (unsigned long)i * (unsigned long)r->step);
+}
+
+// 範囲と、範囲またはリストを要素ごとに比較する。
+int lval_range_eq(lval* x, lval* y) {
+  if (x->type != LVAL_RANGE) { lval* t = x; x = y; y = t; }
+  long n = lval_range_len(x);
+
+  if (y->type == LVAL_RANGE) {
+    if (n != lval_range_len(y)) { return 0; }
+    return n == 0 || (x->num == y->num && (n == 1 || x->step == y->step));
+  }
+
+  if (y->type != LVAL_QEXPR || n != y->count) { return 0; }
+  for (long i = 0; i < n; i++) {
+    if (y->cell[i]->type != LVAL_NUM || y->cell[i]->num != lval_range_nth(x, i)) { return 0; }
+  }
+  return 1;
+}
+
+int lmap_eq(lmap* x, lmap* y);
+
 // lval同士の同一性をチェック。
 int lval_eq(lval* x, lval* y) {
+  // 同じオブジェクトなら比べるまでもない。
+  if (x == y) { return 1; }
+  // 定数の畳み込みで置き換えた値は、元の式で比べる。置き換えは世代や定義によって違うため。
+  if (x->fold || y->fold) { return lval_eq(x->fold ? x->fold->orig : x, y->fold ? y->fold->orig : y); }
+  // ハッシュコンスした値同士は、構造が同じなら同じオブジェクト。表は畳み込んだ元の式と世代でも
+  // 値を分けるので、畳み込んだ値を含むものは要素をたどって比べる。
+  if (x->shared == LHCONS_PLAIN && y->shared == LHCONS_PLAIN) { return 0; }
+
+  // 範囲は要素で比較する。(== (range 0 0) nil)のように空リストとも比較できる。
+  if (x->type == LVAL_RANGE || y->type == LVAL_RANGE) { return lval_range_eq(x, y); }
+
   // 型が違う場合は、同一でない。
   if (x->type != y->type) { return 0; }
 
   switch(x->type) {
     // 数値型の比較。
   case LVAL_NUM: return (x->num == y->num);
+  case LVAL_ARRAY:
+    return x->count == y->count && memcmp(x->arr, y->arr, sizeof(long) * x->count) == 0;
+  case LVAL_MAP: return lmap_eq(x->map, y->map);
+    // futureは同じものから作ったコピー同士だけが等しい。
+  case LVAL_FUTURE: return x->fut == y->fut;
 
     // エラー、シンボル、文字列は含まれている文字列を比較。
   case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
@@ -386,15 +1527,19 @@ int lval_eq(lval* x, lval* y) {
     // 関数の比較。
   case LVAL_FUN:
     if (x->builtin || y->builtin) {
-      return x->builtin == y->builtin;
+      return x->builtin == y->builtin && x->num == y->num;
     } else {
       return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
     }
 
-    // S式、リストの比較。
+    // S式、リスト、パイプラインの比較。
   case LVAL_QEXPR:
   case LVAL_SEXPR:
+  case LVAL_SEQ:
+    // 長さが違えば同一でない。(== l nil)はここで終わる。
     if (x->count != y->count) { return 0; }
+    // 両方のリストにハッシュ値が覚えてあれば、違うものは要素をたどらずに区別できる。
+    if (x->type == LVAL_QEXPR && x->num && y->num && x->num != y->num) { return 0; }
     // 要素の内、１つでも異なるものがあれば同一でない。
     for (int i = 0; i < x->count; i++) {
       if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
@@ -406,18 +1551,542 @@ int lval_eq(lval* x, lval* y) {
   return 0;
 }
 
-// Assertマクロ。
-#define LASSERT(args, cond, fmt, ...)           \
-  if (!(cond)) {                                \
-    lval* err = lval_err(fmt, ##__VA_ARGS__);   \
-    lval_del(args);                             \
-    return err;                                 \
+////////////////////////////////////////
+// 辞書(ハッシュ表)
+////////////////////////////////////////
+
+// ハッシュ値の混合(splitmix64の最終段)。
+unsigned long lhash_mix(unsigned long h) {
+  h ^= h >> 30; h *= 0xbf58476d1ce4e5b9UL;
+  h ^= h >> 27; h *= 0x94d049bb133111ebUL;
+  h ^= h >> 31;
+  return h;
 }
 
-#define LASSERT_NUM(msg, val, cnt)          \
-  LASSERT(val, (val->count == cnt), msg)    \
+// 文字列のハッシュ値(FNV-1a)。
+unsigned long lhash_str(char* s) {
+  unsigned long h = 14695981039346656037UL;
+  for (; *s; s++) { h ^= (unsigned char)*s; h *= 1099511628211UL; }
+  return h;
+}
 
-#define LASSERT_TYPE(msg, val, ind, aType)               \
+// ハッシュ値を計算できる型かどうか。リストは全要素が計算できる場合のみ。
+int lval_hashable(lval* v) {
+  if (v->fold) { v = v->fold->orig; }
+  switch (v->type) {
+  case LVAL_NUM: case LVAL_STR: case LVAL_SYM: return 1;
+  case LVAL_QEXPR:
+    for (int i = 0; i < v->count; i++) {
+      if (!lval_hashable(v->cell[i])) { return 0; }
+    }
+    return 1;
+  }
+  return 0;
+}
+
+unsigned long lval_qexpr_hash(lval* v);
+
+// lvalのハッシュ値。lval_eqで等しいものは同じ値になる。リストは要素から構造的に求める。
+// 畳み込んだ値は、lval_eqと同じく元の式から求める。
+unsigned long lval_hash(lval* v) {
+  if (v->fold) { v = v->fold->orig; }
+  unsigned long h = lhash_mix((unsigned long)v->type + 1);
+  switch (v->type) {
+  case LVAL_NUM: return lhash_mix(h ^ (unsigned long)v->num);
+  case LVAL_STR: return lhash_mix(h ^ lhash_str(v->str));
+  case LVAL_SYM: return lhash_mix(h ^ lhash_str(v->sym));
+  case LVAL_QEXPR: return lval_qexpr_hash(v);
+  }
+  return h;
+}
+
+// リストのハッシュ値。求めた値はnumに覚えておき、要素を書き換えるまで(lval_add, lval_popなど)使い回す。
+// ハッシュ値を計算できない要素を含むリストは0を返し、覚えない。範囲のように、型が違っても
+// lval_eqで等しくなる要素があるため。
+unsigned long lval_qexpr_hash(lval* v) {
+  if (v->num) { return v->num; }
+  unsigned long h = lhash_mix((unsigned long)LVAL_QEXPR + 1);
+  for (int i = 0; i < v->count; i++) {
+    lval* c = v->cell[i]->fold ? v->cell[i]->fold->orig : v->cell[i];
+    if (c->type != LVAL_NUM && c->type != LVAL_STR && c->type != LVAL_SYM && c->type != LVAL_QEXPR) { return 0; }
+    unsigned long k = lval_hash(c);
+    if (!k) { return 0; }
+    h = lhash_mix(h * 31 + k);
+  }
+  if (!h) { h = 1; }
+  // 共有の値は複数のスレッドから読まれるので書き換えない。表に入れるときに求めてある。
+  if (!v->shared) { v->num = h; }
+  return h;
+}
+
+// ハッシュ表の作成。capは2の冪。
+lmap* lmap_new(int cap) {
+  lmap* m = malloc(sizeof(lmap));
+  m->cap = cap;
+  m->count = 0;
+  m->hashes = malloc(sizeof(unsigned long) * cap);
+  m->keys = calloc(cap, sizeof(lval*));
+  m->vals = malloc(sizeof(lval*) * cap);
+  return m;
+}
+
+// ハッシュ表の破棄。
+void lmap_del(lmap* m) {
+  for (int i = 0; i < m->cap; i++) {
+    if (m->keys[i]) { lval_del(m->keys[i]); lval_del(m->vals[i]); }
+  }
+  free(m->hashes);
+  free(m->keys);
+  free(m->vals);
+  free(m);
+}
+
+// ハッシュ表のコピー。スロットの配置ごと複製するので、再ハッシュは不要。
+lmap* lmap_copy(lmap* m) {
+  lmap* n = lmap_new(m->cap);
+  n->count = m->count;
+  memcpy(n->hashes, m->hashes, sizeof(unsigned long) * m->cap);
+  for (int i = 0; i < m->cap; i++) {
+    if (m->keys[i]) {
+      n->keys[i] = lval_copy(m->keys[i]);
+      n->vals[i] = lval_copy(m->vals[i]);
+    }
+  }
+  return n;
+}
+
+// キーのスロット位置を探す。見つからなければ、挿入すべき空きスロットの位置を返す。
+int lmap_find(lmap* m, lval* k, unsigned long h) {
+  int mask = m->cap - 1;
+  int i = h & mask;
+  while (m->keys[i]) {
+    if (m->hashes[i] == h && lval_eq(m->keys[i], k)) { return i; }
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+// キーに対応する値。なければNULL。
+lval* lmap_get(lmap* m, lval* k) {
+  int i = lmap_find(m, k, lval_hash(k));
+  return m->keys[i] ? m->vals[i] : NULL;
+}
+
+void lmap_put(lmap* m, lval* k, lval* v);
+
+// スロット数を倍にして、全てのキーを入れ直す。
+void lmap_grow(lmap* m) {
+  lmap* n = lmap_new(m->cap * 2);
+  for (int i = 0; i < m->cap; i++) {
+    if (!m->keys[i]) { continue; }
+    int j = lmap_find(n, m->keys[i], m->hashes[i]);
+    n->hashes[j] = m->hashes[i];
+    n->keys[j] = m->keys[i];
+    n->vals[j] = m->vals[i];
+  }
+  free(m->hashes); free(m->keys); free(m->vals);
+  m->cap = n->cap;
+  m->hashes = n->hashes;
+  m->keys = n->keys;
+  m->vals = n->vals;
+  free(n);
+}
+
+// キーと値を登録する。k, vの所有権はハッシュ表に移る。既存のキーなら値を置き換える。
+void lmap_put(lmap* m, lval* k, lval* v) {
+  // 負荷率が3/4を超えないように拡張する。
+  if ((m->count + 1) * 4 > m->cap * 3) { lmap_grow(m); }
+
+  unsigned long h = lval_hash(k);
+  int i = lmap_find(m, k, h);
+  if (m->keys[i]) {
+    lval_del(k);
+    lval_del(m->vals[i]);
+    m->vals[i] = v;
+    return;
+  }
+  m->hashes[i] = h;
+  m->keys[i] = k;
+  m->vals[i] = v;
+  m->count++;
+}
+
+// キーを削除する。線形探索の連鎖が切れないよう、後続の要素を前に詰める(後方シフト削除)。
+int lmap_remove(lmap* m, lval* k) {
+  int mask = m->cap - 1;
+  int i = lmap_find(m, k, lval_hash(k));
+  if (!m->keys[i]) { return 0; }
+
+  lval_del(m->keys[i]);
+  lval_del(m->vals[i]);
+  m->keys[i] = NULL;
+  m->count--;
+
+  int j = i;
+  while (1) {
+    j = (j + 1) & mask;
+    if (!m->keys[j]) { break; }
+    // jの要素の本来の位置がiとjの間(巡回的に)にあれば、動かさなくてよい。
+    int home = m->hashes[j] & mask;
+    if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) { continue; }
+    m->hashes[i] = m->hashes[j];
+    m->keys[i] = m->keys[j];
+    m->vals[i] = m->vals[j];
+    m->keys[j] = NULL;
+    i = j;
+  }
+  return 1;
+}
+
+// 辞書同士の比較。キーの集合が同じで、対応する値が全て等しければ同一。
+int lmap_eq(lmap* x, lmap* y) {
+  if (x->count != y->count) { return 0; }
+  for (int i = 0; i < x->cap; i++) {
+    if (!x->keys[i]) { continue; }
+    int j = lmap_find(y, x->keys[i], x->hashes[i]);
+    if (!y->keys[j] || !lval_eq(x->vals[i], y->vals[j])) { return 0; }
+  }
+  return 1;
+}
+
+////////////////////////////////////////
+// メモ化
+////////////////////////////////////////
+
+// memoで作った関数は、引数ごとの結果を表に覚えておき、同じ引数での呼び出しには覚えた結果のコピーを返す。
+// 引数は構造的なハッシュ値(lval_hash)で引くので、ハッシュ値を計算できる引数だけを覚える。
+// 表の大きさには上限があり、超えたら最も長く使われていない結果から捨てる(LRU)。
+// 関数の値をコピーしても表は共有するので、defで束縛し直した関数の再帰呼び出しも表を使う。
+
+#define LMEMO_CAP 4096 // 表の大きさの既定値
+
+typedef struct lmemo_ent {
+  unsigned long hash;
+  lval* args; // 引数のS式
+  lval* val; // 結果
+  struct lmemo_ent* chain; // 同じバケットの次の要素
+  struct lmemo_ent* prev; // 使った順の前後。lru.nextが最も最近、lru.prevが最も古い。
+  struct lmemo_ent* next;
+} lmemo_ent;
+
+struct lmemo {
+  int refs; // 表を共有する関数の値の数
+  long cap; // 覚えておく結果の数の上限
+  long count;
+  long mask; // バケット数-1
+  lmemo_ent** buckets;
+  lmemo_ent lru; // 使った順のリストの番兵
+  long hits, misses, evictions;
+  pthread_mutex_t lock; // 並列処理のワーカーからも呼ばれる
+};
+
+lmemo* lmemo_new(long cap) {
+  lmemo* m = calloc(1, sizeof(lmemo));
+  m->refs = 1;
+  m->cap = cap;
+  long n = 16;
+  while (n < cap && n < (1L << 20)) { n *= 2; }
+  m->mask = n - 1;
+  m->buckets = calloc(n, sizeof(lmemo_ent*));
+  m->lru.prev = m->lru.next = &m->lru;
+  pthread_mutex_init(&m->lock, NULL);
+  return m;
+}
+
+void lmemo_retain(lmemo* m) { __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED); }
+
+void lmemo_release(lmemo* m) {
+  if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) != 0) { return; }
+  for (lmemo_ent* x = m->lru.next; x != &m->lru;) {
+    lmemo_ent* next = x->next;
+    lval_del(x->args);
+    lval_del(x->val);
+    free(x);
+    x = next;
+  }
+  pthread_mutex_destroy(&m->lock);
+  free(m->buckets);
+  free(m);
+}
+
+// 使った順のリストから外す。
+static inline void lmemo_unlink(lmemo_ent* x) {
+  x->prev->next = x->next;
+  x->next->prev = x->prev;
+}
+
+// 使った順のリストの先頭(最も最近)に置く。
+static inline void lmemo_link(lmemo* m, lmemo_ent* x) {
+  x->prev = &m->lru;
+  x->next = m->lru.next;
+  m->lru.next->prev = x;
+  m->lru.next = x;
+}
+
+// 引数のハッシュ値。ハッシュ値を計算できない引数があれば0を返し、覚えない。
+int lmemo_hash(lval* a, unsigned long* h) {
+  *h = lhash_mix((unsigned long)a->count + 1);
+  for (int i = 0; i < a->count; i++) {
+    if (!lval_hashable(a->cell[i])) { return 0; }
+    *h = lhash_mix(*h * 31 + lval_hash(a->cell[i]));
+  }
+  return 1;
+}
+
+// 覚えている結果のコピー。なければNULL。
+lval* lmemo_get(lmemo* m, lval* a, unsigned long h) {
+  pthread_mutex_lock(&m->lock);
+  lmemo_ent* x = m->buckets[h & m->mask];
+  while (x && !(x->hash == h && lval_eq(x->args, a))) { x = x->chain; }
+  lval* r = NULL;
+  if (x) {
+    m->hits++;
+    lmemo_unlink(x);
+    lmemo_link(m, x);
+    r = lval_copy(x->val);
+  } else {
+    m->misses++;
+  }
+  pthread_mutex_unlock(&m->lock);
+  return r;
+}
+
+// バケットの連鎖から外す。
+void lmemo_unchain(lmemo* m, lmemo_ent* x) {
+  lmemo_ent** p = &m->buckets[x->hash & m->mask];
+  while (*p != x) { p = &(*p)->chain; }
+  *p = x->chain;
+}
+
+// 結果を覚える。args, valの所有権は表に移る。上限を超えたら最も古いものを捨てる。
+void lmemo_put(lmemo* m, lval* args, unsigned long h, lval* val) {
+  pthread_mutex_lock(&m->lock);
+  // 別のスレッドが先に覚えていれば、そちらを残す。
+  lmemo_ent* x = m->buckets[h & m->mask];
+  while (x && !(x->hash == h && lval_eq(x->args, args))) { x = x->chain; }
+  if (x) {
+    pthread_mutex_unlock(&m->lock);
+    lval_del(args);
+    lval_del(val);
+    return;
+  }
+
+  if (m->count >= m->cap) {
+    lmemo_ent* old = m->lru.prev;
+    lmemo_unlink(old);
+    lmemo_unchain(m, old);
+    lval_del(old->args);
+    lval_del(old->val);
+    free(old);
+    m->count--;
+    m->evictions++;
+  }
+
+  x = malloc(sizeof(lmemo_ent));
+  x->hash = h;
+  x->args = args;
+  x->val = val;
+  x->chain = m->buckets[h & m->mask];
+  m->buckets[h & m->mask] = x;
+  lmemo_link(m, x);
+  m->count++;
+  pthread_mutex_unlock(&m->lock);
+}
+
+lval* lval_invoke_lambda(lenv* e, lval* f, lval* a);
+
+// memoで作った関数fの呼び出し。fはlval_invokeと同じく呼び出しで消費される。
+lval* lmemo_call(lenv* e, lval* f, lval* a) {
+  lmemo* m = f->memo;
+  unsigned long h;
+  // 部分適用や可変長引数の呼び出し、ハッシュ値を計算できない引数は覚えない。
+  // 部分適用で作る関数が表を引き継がないように、fから表を外して呼び出す。
+  int plain = a->count != f->formals->count || !lmemo_hash(a, &h);
+  for (int i = 0; i < f->formals->count && !plain; i++) {
+    if (strcmp(f->formals->cell[i]->sym, "&") == 0) { plain = 1; }
+  }
+  if (plain) {
+    f->memo = NULL;
+    lmemo_release(m);
+    return lval_invoke_lambda(e, f, a);
+  }
+
+  lval* r = lmemo_get(m, a, h);
+  if (r) { lval_del(a); return r; }
+
+  // fが表を参照しているので、呼び出し中に表が解放されることはない。
+  lval* args = lval_copy(a);
+  r = lval_invoke_lambda(e, f, a);
+  // エラーは覚えない。制限で打ち切られた呼び出しなどは、次は成功するかもしれない。
+  if (r->type == LVAL_ERR) { lval_del(args); return r; }
+  lmemo_put(m, args, h, lval_copy(r));
+  return r;
+}
+
+////////////////////////////////////////
+// ハッシュコンス
+////////////////////////////////////////
+
+// 有効にすると(--hashcons、または環境変数LISPY_HASHCONS)、関数の本体とdefで束縛する値を表に登録し、
+// 構造が同じ部分木を1つの共有の値にまとめる。共有の値は書き換えず、解放もしないので、
+// 関数の値のコピー(lenv_get, lval_callなど)は本体を複製せずに参照するだけで済み、
+// 共有の値同士の比較はポインタの比較になる。評価は式をその場で書き換えるので、
+// 評価する本体や変数の値を取り出すときには、これまで通り共有しないコピーを作る。
+// 表は捨てずに持ち続けるため、その場限りの関数をたくさん作るプログラムではメモリが増える。既定では無効。
+
+typedef struct lhcons_ent {
+  unsigned long hash;
+  lval* v;
+  struct lhcons_ent* next;
+} lhcons_ent;
+
+static int lhcons_on = 0;
+static lhcons_ent** lhcons_buckets;
+static long lhcons_mask, lhcons_count, lhcons_bytes, lhcons_hits;
+static pthread_mutex_t lhcons_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int lhcons_enabled(void) { return __atomic_load_n(&lhcons_on, __ATOMIC_RELAXED); }
+
+// 表を用意する。定数の畳み込みも、ハッシュコンスが有効なら元の式を共有の値にするためにこの表を使う。
+void lhcons_init(void) {
+  pthread_mutex_lock(&lhcons_lock);
+  if (!lhcons_buckets) {
+    lhcons_mask = 1023;
+    lhcons_buckets = calloc(lhcons_mask + 1, sizeof(lhcons_ent*));
+  }
+  pthread_mutex_unlock(&lhcons_lock);
+}
+
+// ハッシュコンスを始める。以後に作った関数とdefした値から表に登録する。
+void lhcons_start(void) {
+  lhcons_init();
+  __atomic_store_n(&lhcons_on, 1, __ATOMIC_SEQ_CST);
+}
+
+// 表に登録できる値かどうか。数値、文字列、シンボルと、それだけからなるS式、Q式。
+int lhcons_ok(lval* v) {
+  switch (v->type) {
+  case LVAL_NUM: case LVAL_STR: case LVAL_SYM: return 1;
+  case LVAL_FUN: return v->builtin && v->fold; // 定数の畳み込みで置き換えた組み込み関数
+  case LVAL_QEXPR: case LVAL_SEXPR:
+    for (int i = 0; i < v->count; i++) {
+      if (!lhcons_ok(v->cell[i])) { return 0; }
+    }
+    return 1;
+  }
+  return 0;
+}
+
+// 表の中での同一性。子要素は登録済みなので、ポインタで比べれば足りる。
+unsigned long lhcons_hash(lval* v) {
+  unsigned long o = v->fold ? (unsigned long)v->fold->orig ^ (unsigned long)v->fold->st ^ (unsigned long)v->fold->epoch : 0;
+  if (v->type != LVAL_QEXPR && v->type != LVAL_SEXPR) { return lval_hash(v) ^ o; }
+  unsigned long h = lhash_mix((unsigned long)v->type + 1 + o);
+  for (int i = 0; i < v->count; i++) { h = lhash_mix(h * 31 + (unsigned long)v->cell[i]); }
+  return h;
+}
+
+int lhcons_same(lval* x, lval* y) {
+  if (x->type != y->type) { return 0; }
+  // 畳み込んだ値は、元の式と状態、世代も同じものだけをまとめる。
+  if (!x->fold != !y->fold) { return 0; }
+  if (x->fold && (x->fold->orig != y->fold->orig || x->fold->st != y->fold->st || x->fold->epoch != y->fold->epoch)) {
+    return 0;
+  }
+  switch (x->type) {
+  case LVAL_NUM: return x->num == y->num;
+  case LVAL_STR: return strcmp(x->str, y->str) == 0;
+  case LVAL_SYM: return strcmp(x->sym, y->sym) == 0;
+  case LVAL_FUN: return x->builtin == y->builtin && x->num == y->num;
+  }
+  if (x->count != y->count) { return 0; }
+  for (int i = 0; i < x->count; i++) {
+    if (x->cell[i] != y->cell[i]) { return 0; }
+  }
+  return 1;
+}
+
+// lhcons_okな値vを子要素から順に登録し、共有の値を返す。vは消費される。
+lval* lhcons_intern(lval* v) {
+  if (v->shared) { return v; }
+  // ハッシュコンスを有効にする前に畳み込んだ値は、元の式も登録する。
+  if (v->fold && !v->fold->orig->shared) {
+    lfold_ref* f = lfold_new(lhcons_intern(lval_copy(v->fold->orig)), v->fold->st, v->fold->epoch);
+    lfold_release(v->fold);
+    v->fold = f;
+  }
+  long bytes = sizeof(lval);
+  int folded = v->fold != NULL;
+  if (v->type == LVAL_QEXPR || v->type == LVAL_SEXPR) {
+    for (int i = 0; i < v->count; i++) {
+      v->cell[i] = lhcons_intern(v->cell[i]);
+      if (v->cell[i]->shared == LHCONS_FOLDED) { folded = 1; }
+    }
+    bytes += sizeof(lval*) * v->count;
+  }
+  if (v->type == LVAL_SYM) { bytes += strlen(v->sym) + 1; }
+  if (v->type == LVAL_STR) { bytes += strlen(v->str) + 1; }
+  unsigned long h = lhcons_hash(v);
+
+  pthread_mutex_lock(&lhcons_lock);
+  for (lhcons_ent* x = lhcons_buckets[h & lhcons_mask]; x; x = x->next) {
+    if (x->hash == h && lhcons_same(x->v, v)) {
+      lhcons_hits++;
+      pthread_mutex_unlock(&lhcons_lock);
+      lval_del(v);
+      return x->v;
+    }
+  }
+  // 共有にする前に、Q式の構造的なハッシュ値を求めておく。共有の値のnumは書き換えない。
+  if (v->type == LVAL_QEXPR) { lval_qexpr_hash(v); }
+  if (v->type == LVAL_SEXPR) { v->num = 0; }
+  v->shared = folded ? LHCONS_FOLDED : LHCONS_PLAIN;
+
+  // 要素数がバケット数を超えたら、2倍に広げて入れ直す。
+  if (lhcons_count > lhcons_mask) {
+    long mask = lhcons_mask * 2 + 1;
+    lhcons_ent** b = calloc(mask + 1, sizeof(lhcons_ent*));
+    for (long i = 0; i <= lhcons_mask; i++) {
+      for (lhcons_ent* x = lhcons_buckets[i]; x;) {
+        lhcons_ent* next = x->next;
+        x->next = b[x->hash & mask];
+        b[x->hash & mask] = x;
+        x = next;
+      }
+    }
+    free(lhcons_buckets);
+    lhcons_buckets = b;
+    lhcons_mask = mask;
+  }
+  lhcons_ent* x = malloc(sizeof(lhcons_ent));
+  x->hash = h;
+  x->v = v;
+  x->next = lhcons_buckets[h & lhcons_mask];
+  lhcons_buckets[h & lhcons_mask] = x;
+  lhcons_count++;
+  lhcons_bytes += bytes;
+  pthread_mutex_unlock(&lhcons_lock);
+  return v;
+}
+
+// 有効なら値vを表に登録して共有の値を返す。登録できない値と、無効なときはvをそのまま返す。
+lval* lhcons(lval* v) {
+  if (!lhcons_enabled() || !lhcons_ok(v)) { return v; }
+  return lhcons_intern(v);
+}
+
+// Assertマクロ。
+#define LASSERT(args, cond, fmt, ...)           \
+  if (!(cond)) {                                \
+    lval* err = lval_err(fmt, ##__VA_ARGS__);   \
+    lval_del(args);                             \
+    return err;                                 \
+}
+
+#define LASSERT_NUM(msg, val, cnt)          \
+  LASSERT(val, (val->count == cnt), msg)    \
+
+#define LASSERT_TYPE(msg, val, ind, aType)               \
   LASSERT(val, (val->cell[ind]->type == aType), msg)    \
 
 // enumから型名。
@@ -430,6 +2099,11 @@ char* ltype_name(int t) {
   case LVAL_STR: return "String";
   case LVAL_SEXPR: return "S-Expression";
   case LVAL_QEXPR: return "Q-Expression";
+  case LVAL_RANGE: return "Range";
+  case LVAL_SEQ: return "Sequence";
+  case LVAL_ARRAY: return "Array";
+  case LVAL_MAP: return "Dictionary";
+  case LVAL_FUTURE: return "Future";
   default: return "Unknown";
   }
 }
@@ -437,12 +2111,20 @@ char* ltype_name(int t) {
 lval* lval_eval(lenv* e, lval* v);
 lval* builtin(lenv *e, lval* a, char* func);
 lval* lval_call(lenv* e, lval* f, lval* a);
+lval* lquota_err(lquota* q);
+
+// 引数なしで呼び出すように登録した組み込み関数か。(dict)や(stats)のように、要素が１つのS式でも呼び出す。
+int lval_nullary(lval* f) { return f->type == LVAL_FUN && f->builtin && f->num; }
 
 // S式を評価。
 lval* lval_eval_sexpr(lenv* e, lval* v) {
+  // 位置のある式を評価する間は、それをエラーの位置とする。子要素の評価で変わった位置は戻す。
+  unsigned loc = v->loc ? v->loc : lsrc_cur;
+  lsrc_cur = loc;
   for (int i = 0; i < v->count; i++) {
     // 子要素のS式を再帰的に評価。
     v->cell[i] = lval_eval(e, v->cell[i]);
+    lsrc_cur = loc;
   }
 
   for (int i = 0; i < v->count; i++) {
@@ -453,8 +2135,11 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
   // 空のS式。
   if (v->count == 0) { return v; }
 
-  // 要素が１つのS式は、それを取り出す。
-  if (v->count == 1) { return lval_take(v, 0); }
+  // 要素が１つのS式は、それを取り出す。関数もそのまま値として取り出す。
+  // ただし(dict)のように引数なしで呼び出すための組み込み関数は、呼び出す。
+  if (v->count == 1 && !lval_nullary(v->cell[0])) {
+    return lval_take(v, 0);
+  }
 
   // lvalから先頭要素を取得。
   // このとき、もとのlvalからは先頭要素が削除されていることに注意。
@@ -479,10 +2164,44 @@ void lenv_put(lenv* e, lval* k, lval* v);
 lval* builtin_eval(lenv *e, lval* a);
 lval* builtin_list(lenv *e, lval* a);
 
-// 関数適用。fは関数、aは実引数。
+lval* lval_invoke(lenv* e, lval* f, lval* a);
+
+// 関数適用。fは関数、aは実引数。プロファイル中とヒーププロファイル中は、呼び出し中の関数として名前を積む。
 lval* lval_call(lenv* e, lval* f, lval* a) {
+  if (__atomic_load_n(&lprof_on, __ATOMIC_RELAXED) <= 0 && !lheap_enabled()) { return lval_invoke(e, f, a); }
+  lprof_thread* t = lprof_thread_get();
+  lname* leaf = t->leaf;
+  lname* fn = lheap_fn;
+  // 名前のない関数は作った位置で区別する。
+  int d = lprof_push(t, f->name ? f->name : lsrc_anon(f->loc));
+  if (!f->builtin) { lheap_fn = t->leaf; }
+  lval* r = lval_invoke(e, f, a);
+  lprof_pop(t, d, leaf);
+  lheap_fn = fn;
+  return r;
+}
+
+lval* lval_invoke(lenv* e, lval* f, lval* a) {
   // ビルトイン関数であれば、そのまま関数ポインタを実行。
-  if (f->builtin) { return f->builtin(e, a); }
+  if (f->builtin) {
+    LSTAT_ADD(LSTAT_CALL_BUILTIN, 1);
+    return f->builtin(e, a);
+  }
+  if (f->memo) { return lmemo_call(e, f, a); }
+  return lval_invoke_lambda(e, f, a);
+}
+
+lval* ljit_call(lenv* e, lval* f, lval* a);
+
+// ユーザー定義関数の適用。仮引数を実引数に束縛して本体を評価する。
+lval* lval_invoke_lambda(lenv* e, lval* f, lval* a) {
+  LSTAT_ADD(LSTAT_CALL_LAMBDA, 1);
+
+  // コンパイル済みの関数は機械語で実行する。実行できなければ(NULL)、以下でインタプリタが評価する。
+  if (ljit_enabled() && f->name) {
+    lval* r = ljit_call(e, f, a);
+    if (r) { return r; }
+  }
 
   int given = a->count; // 実引数の数。
   int total = f->formals->count; // 仮引数の数。
@@ -547,8 +2266,17 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
   if (f->formals->count == 0) {
     // 関数が評価される環境を、関数内の環境の親に設定。
     f->env->par = e;
+    // 呼び出しの深さが制限を超えたら、本体を評価せずに打ち切る。
+    lquota* q = lquota_cur;
+    if (q && q->max_depth && lquota_depth >= q->max_depth) {
+      lquota_exceed(q, LQUOTA_DEPTH);
+      return lquota_err(q);
+    }
     // 関数の評価値を返却。
-    return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+    lquota_depth++;
+    lval* r = builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+    lquota_depth--;
+    return r;
   } else {
     // 部分適応した関数を返却。
     return lval_copy(f);
@@ -561,8 +2289,24 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
 
 lval* lenv_get(lenv* e, lval* v);
 
+// 制限を超えて打ち切ったことを表すエラー。
+lval* lquota_err(lquota* q) {
+  switch (__atomic_load_n(&q->exceeded, __ATOMIC_RELAXED)) {
+  case LQUOTA_STEPS: return lval_err("Evaluation aborted: exceeded the limit of %li steps.", q->max_steps);
+  case LQUOTA_DEPTH: return lval_err("Evaluation aborted: exceeded the call depth limit of %li.", q->max_depth);
+  default: return lval_err("Evaluation aborted: exceeded the limit of %li bytes.", q->max_bytes);
+  }
+}
+
+lval* lfold_eval(lenv* e, lval* v);
+
 // lvalを評価。
 lval* lval_eval(lenv *e, lval* v) {
+  // 制限を超えていれば評価せずにエラーを返す。途中の値は呼び出し元がエラーと同様に解放する。
+  if (lquota_cur && !lquota_step(lquota_cur)) {
+    lval_del(v);
+    return lquota_err(lquota_cur);
+  }
   if (v->type == LVAL_SYM) {
     // シンボルの場合、環境から値を取得する。
     lval* x = lenv_get(e, v);
@@ -570,89 +2314,352 @@ lval* lval_eval(lenv *e, lval* v) {
     return x;
   }
   if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
+  // 定数の畳み込みで置き換えた値。
+  if (v->fold) { return lfold_eval(e, v); }
   return v;
 }
 
+////////////////////////////////////////
+// 変数表(永続HAMT)
+////////////////////////////////////////
+
+// 環境の変数表は、Hash Array Mapped Trie(HAMT)で持つ。
+// ノードと葉は参照カウントで複数の環境から共有され、変更は根からの経路だけを複製して行う。
+// そのため環境のコピーは根の参照を増やすだけで済み、束縛の追加はO(log n)個のノードしか触らない。
+
+#define LHAMT_BITS 5
+#define LHAMT_MASK ((1u << LHAMT_BITS) - 1)
+
+// 葉。変数名と値の組。
+typedef struct {
+  int refs; // 参照数
+  unsigned long hash; // 変数名のハッシュ値
+  char* sym; // 変数名
+  lval* val; // 値
+} lhleaf;
+
+// ノードの子。葉かノードのどちらか一方。
+typedef struct {
+  lhleaf* leaf;
+  lhamt* node;
+} lhent;
+
+struct lhamt {
+  int refs; // 参照数
+  unsigned int bitmap; // どの位置に子があるか(ハッシュ値の5ビットごと)
+  int count; // 子の数
+  lhent* ents; // 子の配列。ビットマップの順に詰めて並べる。
+};
+
+void lhamt_release(lhamt* n);
+
+// 参照数の増減。環境は並列処理のワーカーからも同時にコピーされるので、不可分操作で行う。
+void lref_inc(int* refs) { __atomic_add_fetch(refs, 1, __ATOMIC_RELAXED); }
+int lref_dec(int* refs) { return __atomic_sub_fetch(refs, 1, __ATOMIC_ACQ_REL); }
+int lref_get(int* refs) { return __atomic_load_n(refs, __ATOMIC_ACQUIRE); }
+
+// 葉の参照を手放す。
+void lhleaf_release(lhleaf* l) {
+  if (lref_dec(&l->refs) > 0) { return; }
+  free(l->sym);
+  lval_del(l->val);
+  free(l);
+}
+
+// 子の参照を増やす。
+void lhent_retain(lhent* x) {
+  lref_inc(x->leaf ? &x->leaf->refs : &x->node->refs);
+}
+
+// 子の参照を手放す。
+void lhent_release(lhent* x) {
+  if (x->leaf) { lhleaf_release(x->leaf); } else { lhamt_release(x->node); }
+}
+
+// ノードの参照を増やす。
+lhamt* lhamt_retain(lhamt* n) {
+  if (n) { lref_inc(&n->refs); }
+  return n;
+}
+
+// ノードの参照を手放す。最後の参照であれば子の参照も手放して解放する。
+void lhamt_release(lhamt* n) {
+  if (!n || lref_dec(&n->refs) > 0) { return; }
+  for (int i = 0; i < n->count; i++) { lhent_release(&n->ents[i]); }
+  free(n->ents);
+  free(n);
+}
+
+// 空のノード。
+lhamt* lhamt_new(void) {
+  lhamt* n = malloc(sizeof(lhamt));
+  n->refs = 1;
+  n->bitmap = 0;
+  n->count = 0;
+  n->ents = NULL;
+  return n;
+}
+
+// ノードを書き換え可能にする。他から共有されていれば複製し(子は共有のまま)、元の参照を手放す。
+// 参照を1つしか持っていなければ、他のスレッドが新たに参照を得ることもないので、その場で書き換えてよい。
+lhamt* lhamt_own(lhamt* n) {
+  if (lref_get(&n->refs) == 1) { return n; }
+  lhamt* c = lhamt_new();
+  c->bitmap = n->bitmap;
+  c->count = n->count;
+  c->ents = malloc(sizeof(lhent) * n->count);
+  memcpy(c->ents, n->ents, sizeof(lhent) * n->count);
+  for (int i = 0; i < c->count; i++) { lhent_retain(&c->ents[i]); }
+  lhamt_release(n);
+  return c;
+}
+
+// ノードのi番目に子を挿入する。
+void lhamt_insert(lhamt* n, int i, lhent x) {
+  n->ents = realloc(n->ents, sizeof(lhent) * (n->count + 1));
+  memmove(&n->ents[i+1], &n->ents[i], sizeof(lhent) * (n->count - i));
+  n->ents[i] = x;
+  n->count++;
+}
+
+// ハッシュ値を使い切った深さでは、衝突した葉をビットマップを使わずに並べる。
+int lhamt_exhausted(int shift) { return shift >= (int)(sizeof(unsigned long) * 8); }
+
+// 変数名に対応する葉を探す。
+lhleaf* lhamt_get(lhamt* n, unsigned long hash, char* sym) {
+  int shift = 0;
+  while (n) {
+    if (lhamt_exhausted(shift)) {
+      for (int i = 0; i < n->count; i++) {
+        if (strcmp(n->ents[i].leaf->sym, sym) == 0) { return n->ents[i].leaf; }
+      }
+      return NULL;
+    }
+
+    unsigned int bit = 1u << ((hash >> shift) & LHAMT_MASK);
+    if (!(n->bitmap & bit)) { return NULL; }
+    lhent* x = &n->ents[__builtin_popcount(n->bitmap & (bit - 1))];
+    if (x->leaf) {
+      return (x->leaf->hash == hash && strcmp(x->leaf->sym, sym) == 0) ? x->leaf : NULL;
+    }
+    n = x->node;
+    shift += LHAMT_BITS;
+  }
+  return NULL;
+}
+
+// 2つの葉を持つノードを作る。ハッシュ値の同じ位置が重なる間は、さらに下の階層に分ける。
+lhamt* lhamt_pair(lhleaf* a, lhleaf* b, int shift) {
+  lhamt* n = lhamt_new();
+  if (lhamt_exhausted(shift)) {
+    n->ents = malloc(sizeof(lhent) * 2);
+    n->ents[0] = (lhent){ a, NULL };
+    n->ents[1] = (lhent){ b, NULL };
+    n->count = 2;
+    return n;
+  }
+
+  unsigned int ia = (a->hash >> shift) & LHAMT_MASK;
+  unsigned int ib = (b->hash >> shift) & LHAMT_MASK;
+  if (ia == ib) {
+    n->bitmap = 1u << ia;
+    n->ents = malloc(sizeof(lhent));
+    n->ents[0] = (lhent){ NULL, lhamt_pair(a, b, shift + LHAMT_BITS) };
+    n->count = 1;
+    return n;
+  }
+
+  n->bitmap = (1u << ia) | (1u << ib);
+  n->ents = malloc(sizeof(lhent) * 2);
+  n->ents[ia < ib ? 0 : 1] = (lhent){ a, NULL };
+  n->ents[ia < ib ? 1 : 0] = (lhent){ b, NULL };
+  n->count = 2;
+  return n;
+}
+
+// 葉を登録したノードを返す。nの参照1つを受け取り、結果の参照1つを返す。
+// 共有されているノードだけを複製するので、手元にしかない環境への束縛はその場で書き換わる。
+// leafの参照も受け取る。同じ変数名の葉があれば置き換える。
+lhamt* lhamt_put(lhamt* n, lhleaf* leaf, int shift) {
+  n = lhamt_own(n);
+
+  if (lhamt_exhausted(shift)) {
+    for (int i = 0; i < n->count; i++) {
+      if (strcmp(n->ents[i].leaf->sym, leaf->sym) == 0) {
+        lhleaf_release(n->ents[i].leaf);
+        n->ents[i].leaf = leaf;
+        return n;
+      }
+    }
+    lhamt_insert(n, n->count, (lhent){ leaf, NULL });
+    return n;
+  }
+
+  unsigned int bit = 1u << ((leaf->hash >> shift) & LHAMT_MASK);
+  int i = __builtin_popcount(n->bitmap & (bit - 1));
+
+  // 空いている位置にはそのまま葉を置く。
+  if (!(n->bitmap & bit)) {
+    n->bitmap |= bit;
+    lhamt_insert(n, i, (lhent){ leaf, NULL });
+    return n;
+  }
+
+  lhent* x = &n->ents[i];
+  if (x->node) {
+    x->node = lhamt_put(x->node, leaf, shift + LHAMT_BITS);
+  } else if (x->leaf->hash == leaf->hash && strcmp(x->leaf->sym, leaf->sym) == 0) {
+    lhleaf_release(x->leaf);
+    x->leaf = leaf;
+  } else {
+    // 別の変数と位置が重なったら、両方を持つ下の階層のノードに置き換える。
+    x->node = lhamt_pair(x->leaf, leaf, shift + LHAMT_BITS);
+    x->leaf = NULL;
+  }
+  return n;
+}
+
 // コンストラクタ(lenv)
 lenv* lenv_new(void) {
   lenv* e = malloc(sizeof(lenv));
   e->par = NULL;
-  e->count = 0;
-  e->syms = NULL;
-  e->vals = NULL;
+  e->root = NULL;
+  e->ctx = NULL;
+  e->frozen = 0;
+  e->loop = 0;
+  e->site = NULL;
+  if (lheap_enabled()) {
+    e->site = lheap_site_now();
+    lheap_count(e->site, LHEAP_ENV, 1, sizeof(lenv));
+  }
   return e;
 }
 
 // デストラクタ(lenv)
 void lenv_del(lenv *e) {
-  for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
-    lval_del(e->vals[i]);
-  }
-  free(e->syms);
-  free(e->vals);
+  if (e->site) { lheap_count(e->site, LHEAP_ENV, -1, -(long)sizeof(lenv)); }
+  lhamt_release(e->root);
   free(e);
 }
 
 // 変数の値の取得。
 lval* lenv_get(lenv* e, lval* k) {
-  for (int i = 0; i < e->count; i++) {
+  unsigned long h = lhash_str(k->sym);
+  long frames = 0;
+  for (; e; e = e->par) {
+    frames++;
     // 環境の中に該当するシンボルがあれば、その値のコピーを返す。
-    if (strcmp(e->syms[i], k->sym) == 0) { return lval_copy(e->vals[i]); }
-  }
-
-  if (e->par) {
-    // 外側の環境を探索。
-    return lenv_get(e->par, k);
-  } else {
-    // シンボルが見つからなければエラー。
-    return lval_err("Unboud Symbol '%s'", k->sym);
+    lhleaf* l = lhamt_get(e->root, h, k->sym);
+    if (l) {
+      LSTAT_ADD(LSTAT_ENV_GET, 1);
+      LSTAT_ADD(LSTAT_ENV_FRAMES, frames);
+      return lval_copy(l->val);
+    }
   }
+  LSTAT_ADD(LSTAT_ENV_GET, 1);
+  LSTAT_ADD(LSTAT_ENV_FRAMES, frames);
+  // シンボルが見つからなければエラー。
+  return lval_err("Unboud Symbol '%s'", k->sym);
 }
 
-// 変数の束縛。
+// 変数の束縛。既にシンボルが登録済みの場合は、その値を上書きする。
 void lenv_put(lenv* e, lval* k, lval* v) {
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      // 既にシンボルが登録済みの場合は、その値を上書きする。
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
-    }
-  }
-
-  // 新規の変数。
-  e->count++;
-  // 値の領域の拡張。
-  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-  // シンボルの領域の拡張。
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);
-
-  // 値の配列の末尾に対象の値を追加。
-  e->vals[e->count-1] = lval_copy(v);
-  // シンボルの配列の末尾に対象のシンボルを追加。
-  e->syms[e->count-1] = malloc(strlen(k->sym)+1);
-  strcpy(e->syms[e->count-1], k->sym);
+  lhleaf* l = malloc(sizeof(lhleaf));
+  l->refs = 1;
+  l->hash = lhash_str(k->sym);
+  l->sym = malloc(strlen(k->sym) + 1);
+  strcpy(l->sym, k->sym);
+  // 共有の値は書き換えられないので、コピーせずに参照する。
+  l->val = v->shared ? v : lval_copy(v);
+
+  e->root = lhamt_put(e->root ? e->root : lhamt_new(), l, 0);
 }
 
-// lenvのコピー。
+// lenvのコピー。変数表は共有するので、大きさによらず定数時間。
+// 凍結した環境の写しも書き換えられる。書き込みは写しの側にだけ経路をコピーして行われ、元の環境は変わらない。
 lenv* lenv_copy(lenv* e) {
   lenv* n = malloc(sizeof(lenv));
   n->par = e->par;
-  n->count = e->count;
-  n->syms = malloc(sizeof(char*) * n->count);
-  n->vals = malloc(sizeof(lval*) * n->count);
-  for (int i = 0; i < e->count; i++) {
-    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-    strcpy(n->syms[i], e->syms[i]);
-    n->vals[i] = lval_copy(e->vals[i]);
+  n->root = lhamt_retain(e->root);
+  n->ctx = e->ctx;
+  n->frozen = 0;
+  n->loop = e->loop;
+  n->site = NULL;
+  if (lheap_enabled()) {
+    n->site = lheap_site_now();
+    lheap_count(n->site, LHEAP_ENV, 1, sizeof(lenv));
+    lheap_inherit(&n->site, e->site, LHEAP_ENV, sizeof(lenv));
   }
   return n;
 }
 
+// 環境を凍結する。以後はdefや=で書き換えられず、写しの土台として複数のスレッドから読める。
+void lenv_freeze(lenv* e) { e->frozen = 1; }
+
+// 環境を外側の環境まで含めて写す。各階層の変数表は共有するので、階層の数に比例する時間で済む。
+// 元の環境をその後書き換えても、写しからは見えない。
+lenv* lenv_snapshot(lenv* e) {
+  lenv* r = NULL;
+  lenv** p = &r;
+  for (; e; e = e->par) {
+    *p = lenv_copy(e);
+    p = &(*p)->par;
+  }
+  return r;
+}
+
+// lenv_snapshotで作った環境を、外側の環境まで含めて破棄する。
+void lenv_snapshot_del(lenv* e) {
+  while (e) {
+    lenv* par = e->par;
+    lenv_del(e);
+    e = par;
+  }
+}
+
+// グローバル環境の手前までの環境を写す。グローバル環境は写さずにそのまま参照するので、写しの中のdefも効く。
+// eがグローバル環境なら、写さずにそれ自体を返す。
+lenv* lenv_snapshot_frames(lenv* e) {
+  lenv* r = e;
+  lenv** p = &r;
+  for (; e->par; e = e->par) {
+    *p = lenv_copy(e);
+    p = &(*p)->par;
+  }
+  *p = e;
+  return r;
+}
+
+// lenv_snapshot_framesで作った環境を、グローバル環境を除いて破棄する。
+void lenv_snapshot_frames_del(lenv* e) {
+  while (e->par) {
+    lenv* par = e->par;
+    lenv_del(e);
+    e = par;
+  }
+}
+
+// 環境が属するインタプリタ。
+lctx* lenv_ctx(lenv* e) {
+  while (e->par) { e = e->par; }
+  return e->ctx;
+}
+
 // グローバル変数の設定。
+void lfold_define(lenv* e, char* sym);
+
 void lenv_def(lenv* e, lval* k, lval* v) {
   while (e->par) { e = e->par; }
+  // 再定義なら、畳み込んだ値を無効にする。
+  lfold_define(e, k->sym);
+  // グローバル変数の値は書き換えられないので、リストのハッシュ値をここで求めておけば、
+  // 参照のたびに作るコピーが引き継ぎ、比較がハッシュ値の違いだけで済むようになる。
+  if (v->type == LVAL_QEXPR) { lval_qexpr_hash(v); }
+  // ハッシュコンスが有効なら、共有の値を複製せずに束縛する。
+  if (lhcons_enabled() && !v->shared && lhcons_ok(v)) {
+    lenv_put(e, k, lhcons(lval_copy(v)));
+    return;
+  }
   lenv_put(e, k, v);
 }
 
@@ -664,6 +2671,13 @@ void lenv_def(lenv* e, lval* k, lval* v) {
 lval* builtin_head(lenv *e, lval* a) {
   // 引数が1つであること。
   LASSERT(a, (a->count == 1), "Function 'head' passed too many arguments. Got %i, Expected %i.", a->count, 1);
+  // 範囲の場合は、先頭要素だけのリスト。
+  if (a->cell[0]->type == LVAL_RANGE) {
+    LASSERT(a, (lval_range_len(a->cell[0]) != 0), "Function 'head' passed empty range!");
+    lval* v = lval_add(lval_qexpr(), lval_num(a->cell[0]->num));
+    lval_del(a);
+    return v;
+  }
   // 型がリストであること。
   LASSERT(a, (a->cell[0]->type == LVAL_QEXPR), "Function 'head' passed incorrect type for argument 0. Got %s, Expected %s.", ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
   // 空リストでないこと。
@@ -679,6 +2693,13 @@ lval* builtin_head(lenv *e, lval* a) {
 // 組み込み関数tail。
 lval* builtin_tail(lenv *e, lval* a) {
   LASSERT(a, (a->count == 1), "Function 'tail' passed too many arguments!");
+  // 範囲の場合は、開始値をずらした範囲。
+  if (a->cell[0]->type == LVAL_RANGE) {
+    LASSERT(a, (lval_range_len(a->cell[0]) != 0), "Function 'tail' passed empty range!");
+    lval* v = lval_take(a, 0);
+    v->num = lval_range_len(v) > 1 ? v->num + v->step : v->stop;
+    return v;
+  }
   LASSERT(a, (a->cell[0]->type == LVAL_QEXPR), "Function 'tail' passed incorrect types!");
   LASSERT(a, (a->cell[0]->count != 0), "Function 'tail' passed {}!");
 
@@ -690,8 +2711,9 @@ lval* builtin_tail(lenv *e, lval* a) {
 
 // 組み込み関数list。
 lval* builtin_list(lenv *e, lval* a) {
-  // S式をリストに変換する。
+  // S式をリストに変換する。評価で要素が置き換わっているので、ハッシュ値のキャッシュは使えない。
   a->type = LVAL_QEXPR;
+  a->num = 0;
   return a;
 }
 
@@ -711,6 +2733,8 @@ lval* builtin_join(lenv* e, lval* a) {
   for (int i = 0; i < a->count; i++) {
     LASSERT(a, (a->cell[i]->type == LVAL_QEXPR), "Function 'join' passed incorrect type.");
   }
+  // 引数がなければ空のリスト。
+  if (a->count == 0) { lval_del(a); return lval_qexpr(); }
 
   lval* x = lval_pop(a, 0);
   
@@ -722,6 +2746,9 @@ lval* builtin_join(lenv* e, lval* a) {
   return x;
 }
 
+void lfold_forbid(lenv* e, char* sym);
+lval* lfold(lenv* e, lval* x);
+
 // 組み込みラムダ式。
 lval* builtin_lamda(lenv* e, lval* a) {
   LASSERT_NUM("\\", a, 2);
@@ -738,7 +2765,9 @@ lval* builtin_lamda(lenv* e, lval* a) {
   lval* body = lval_pop(a, 0);
   lval_del(a);
 
-  return lval_lambda(formals, body);
+  // 仮引数は呼び出した先の関数からも見える(動的スコープ)ので、同じ名前の定数は畳み込まない。
+  for (int i = 0; i < formals->count; i++) { lfold_forbid(e, formals->cell[i]->sym); }
+  return lval_lambda(formals, lfold(e, body));
 }
 
 // 組み込みロード関数。ファイル名を受け取り、ソースコードとして実行。
@@ -748,9 +2777,9 @@ lval* builtin_load(lenv* e, lval* a) {
 
   mpc_result_t r;
   // ファイル名からパースを行う。
-  if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
+  if (mpc_parse_contents(a->cell[0]->str, lenv_ctx(e)->Lispy, &r)) {
     // ファイルの内容から抽象構文機を取得。
-    lval* expr = lval_read(r.output);
+    lval* expr = lval_read(lenv_ctx(e), r.output, lname_intern(a->cell[0]->str)->str);
     mpc_ast_delete(r.output);
 
     // 式の数だけ評価を実行。
@@ -758,8 +2787,9 @@ lval* builtin_load(lenv* e, lval* a) {
       // ((式)(式)(式)...)というような構文木が生成されることを想定している。
       // トップレベルに式を書くと(print "Hello")というような構文木が生成されてしまい、
       // これを一つずつpopするので、評価値は<builtin> "hello"となってしまうことに注意。
-      lval* x = lval_eval(e, lval_pop(expr, 0));
-      if (x->type == LVAL_ERR) { lval_println(x); }
+      lval* x = lquota_eval(e, lfold(e, lval_pop(expr, 0)));
+      // エラーは起きた位置を付けて表示する。
+      if (x->type == LVAL_ERR) { lsrc_fprint(stdout, x->loc); lval_println(x); }
       lval_del(x);
     }
 
@@ -784,6 +2814,7 @@ lval* builtin_load(lenv* e, lval* a) {
 // オペランドのみが含まれたlvalとオペレータから、計算済みのlvalを返す。
 // (1 2), '+' => 3 
 lval* builtin_op(lenv* e, lval* a, char* op) {
+  LASSERT(a, (a->count > 0), "Function '%s' passed no arguments!", op);
   // オペランドが数値のみかチェック。
   for (int i = 0; i < a->count; i++) {
     if (a->cell[i]->type != LVAL_NUM) {
@@ -839,6 +2870,7 @@ lval* builtin_ord(lenv* e, lval *a, char* op) {
   if (strcmp(op, ">=") == 0) { r = (x->num >= y->num); }
   if (strcmp(op, "<=") == 0) { r = (x->num <= y->num); }
 
+  lval_del(x); lval_del(y);
   lval_del(a);
   return lval_num(r);
 }
@@ -850,6 +2882,7 @@ lval* builtin_cmp(lenv* e, lval* a, char* op) {
   int r;
   if (strcmp(op, "==") == 0) { r =  lval_eq(x, y); }
   if (strcmp(op, "!=") == 0) { r = !lval_eq(x, y); }
+  lval_del(x); lval_del(y);
   lval_del(a);
   return lval_num(r);
 }
@@ -868,7 +2901,22 @@ lval* builtin_eq(lenv* e, lval* a) { return builtin_cmp(e, a, "=="); }
 lval* builtin_ne(lenv* e, lval* a) { return builtin_cmp(e, a, "!="); }
 
 // 変数への値の代入。funcによって挙動を変える。
+int lpar_in_worker(void);
+void lfold_forbid(lenv* e, char* sym);
+
+// defや=で束縛する環境。defはグローバル環境。
+// =は現在の環境だが、ループの環境はループ変数だけを持つので、それ以外の名前は外側に束縛する。
+lenv* lenv_var_target(lenv* e, char* sym, char* func) {
+  if (strcmp(func, "def") == 0) {
+    while (e->par) { e = e->par; }
+    return e;
+  }
+  while (e->loop && e->par && !lhamt_get(e->root, lhash_str(sym), sym)) { e = e->par; }
+  return e;
+}
+
 lval* builtin_var(lenv* e, lval* a, char* func) {
+  LASSERT(a, (a->count > 0), "Function '%s' passed no arguments!", func);
   LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
 
   // 第1引数はシンボルのリスト。
@@ -885,11 +2933,31 @@ lval* builtin_var(lenv* e, lval* a, char* func) {
           "Function '%s' passed too many arguments for symbols. Got %i, Expected %i.",
           func, syms->count, a->count-1);
 
+  // ワーカーはグローバル環境を読むだけなので、書き換えは許さない。
+  LASSERT(a, !(lpar_in_worker() && strcmp(func, "def") == 0),
+          "Function 'def' cannot be used inside parallel workers.");
+
+  // 凍結した環境は書き換えられない。写しを作って、そちらに束縛する。
   for (int i = 0; i < syms->count; i++) {
+    lenv* target = lenv_var_target(e, syms->cell[i]->sym, func);
+    LASSERT(a, !target->frozen, "Function '%s' cannot modify a frozen environment.", func);
+  }
+
+  for (int i = 0; i < syms->count; i++) {
+    // 名前のない関数には、プロファイラのために束縛する名前を付ける。最初に束縛した関数の位置も覚える。
+    lval* v = a->cell[i+1];
+    if (v->type == LVAL_FUN && !v->name) {
+      v->name = lname_intern(syms->cell[i]->sym);
+      unsigned none = 0;
+      __atomic_compare_exchange_n(&v->name->loc, &none, v->loc, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
     // defはグローバル環境に、
     if (strcmp(func, "def") == 0) { lenv_def(e, syms->cell[i], a->cell[i+1]); }
-    // =はローカル環境に束縛。
-    if (strcmp(func, "=") == 0) { lenv_put(e, syms->cell[i], a->cell[i+1]); }
+    // =はローカル環境に束縛。束縛した名前は定数として畳み込まない。
+    if (strcmp(func, "=") == 0) {
+      lfold_forbid(e, syms->cell[i]->sym);
+      lenv_put(lenv_var_target(e, syms->cell[i]->sym, func), syms->cell[i], a->cell[i+1]);
+    }
   }
   lval_del(a);
   return lval_sexpr();
@@ -921,14 +2989,2170 @@ lval* builtin_if(lenv* e, lval* a) {
   return x;
 }
 
-// 組み込みprint関数。
-lval* builtin_print(lenv* e, lval* a) {
-  // スペースを挟んで、全ての引数をプリント。
-  for (int i = 0; i < a->count; i++) {
-    lval_print(a->cell[i]); putchar(' ');
+// リストをS式として評価する。元のリストは残したまま、コピーを評価する。
+// ループの本体のように、同じリストを何度も評価する場合に使う。
+lval* lval_eval_body(lenv* e, lval* q) {
+  lval* x = lval_copy(q);
+  x->type = LVAL_SEXPR;
+  return lval_eval(e, x);
+}
+
+// 組み込みwhile。(while {条件} {本体})
+// 再帰ではなくCのループで回すので、繰り返し回数によらずスタックを消費しない。
+lval* builtin_while(lenv* e, lval* a) {
+  LASSERT_NUM("while", a, 2);
+  LASSERT_TYPE("while", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("while", a, 1, LVAL_QEXPR);
+
+  while (1) {
+    lval* c = lval_eval_body(e, a->cell[0]);
+    if (c->type == LVAL_ERR) { lval_del(a); return c; }
+    if (c->type != LVAL_NUM) {
+      lval* err = lval_err("Function 'while' condition evaluated to incorrect type. Got %s, Expected %s.",
+                           ltype_name(c->type), ltype_name(LVAL_NUM));
+      lval_del(c); lval_del(a);
+      return err;
+    }
+    int cond = c->num != 0;
+    lval_del(c);
+    if (!cond) { break; }
+
+    // 本体を評価。エラーになったらループを中断してそのエラーを返す。
+    lval* x = lval_eval_body(e, a->cell[1]);
+    if (x->type == LVAL_ERR) { lval_del(a); return x; }
+    lval_del(x);
   }
 
-  // 改行し引数を削除。
+  lval_del(a);
+  return lval_sexpr();
+}
+
+// ループ変数を束縛する環境。ループごとに一度だけ作り、繰り返しの間は使い回す。
+// 呼び出し側の同名の変数を書き換えず、ループを抜けた後にループ変数が残ることもない。
+lenv* lenv_loop(lenv* e, lval* sym) {
+  lfold_forbid(e, sym->sym);
+  lenv* l = lenv_new();
+  l->par = e;
+  l->loop = 1;
+  return l;
+}
+
+// ループ変数に値を束縛し、本体を評価する。dotimes, for-eachで共通。lはlenv_loopで作った環境。
+lval* lval_loop_step(lenv* l, lval* sym, lval* val, lval* body) {
+  lenv_put(l, sym, val);
+  lval_del(val);
+  return lval_eval_body(l, body);
+}
+
+// 組み込みdotimes。(dotimes {i} n {本体}) 0からn-1までiを束縛して本体を評価。
+lval* builtin_dotimes(lenv* e, lval* a) {
+  LASSERT_NUM("dotimes", a, 3);
+  LASSERT_TYPE("dotimes", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("dotimes", a, 1, LVAL_NUM);
+  LASSERT_TYPE("dotimes", a, 2, LVAL_QEXPR);
+  LASSERT(a, (a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM),
+          "Function 'dotimes' expects single symbol for loop variable.");
+
+  lval* sym = a->cell[0]->cell[0];
+  long n = a->cell[1]->num;
+  lenv* l = lenv_loop(e, sym);
+  for (long i = 0; i < n; i++) {
+    lval* x = lval_loop_step(l, sym, lval_num(i), a->cell[2]);
+    if (x->type == LVAL_ERR) { lenv_del(l); lval_del(a); return x; }
+    lval_del(x);
+  }
+
+  lenv_del(l);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+// 列(リスト、範囲、パイプライン)の要素を先頭から一つずつ取り出すためのイテレータ。
+// 範囲は要素を作りながら進むので、全体がメモリ上に作られることはない。
+// パイプラインの場合は、元の列から取り出した要素を各段に順に通す。
+typedef struct {
+  lenv* env; // 列を消費する側の環境。
+  lval* own; // イテレータが所有する列。破棄時に解放する。
+  lval* src; // 要素を取り出す元の列(リストまたは範囲)。
+  long i; // 次に取り出す要素の位置。
+  long n; // 要素数。
+  long* left; // take, drop段の残り数(パイプラインの場合)。
+  int done; // takeで打ち切られたかどうか。
+} liter;
+
+// 列かどうか。
+int lval_is_seq(lval* v) {
+  return v->type == LVAL_QEXPR || v->type == LVAL_RANGE || v->type == LVAL_SEQ
+    || v->type == LVAL_ARRAY || v->type == LVAL_MAP;
+}
+
+// イテレータの初期化。srcの所有権はイテレータに移る。
+void liter_init(liter* it, lenv* e, lval* src) {
+  it->env = e;
+  it->own = src;
+  it->src = (src->type == LVAL_SEQ) ? src->cell[0] : src;
+  it->i = 0;
+  it->n = (it->src->type == LVAL_RANGE) ? lval_range_len(it->src)
+    : (it->src->type == LVAL_MAP) ? it->src->map->cap : it->src->count;
+  it->left = NULL;
+  it->done = 0;
+
+  if (src->type == LVAL_SEQ) {
+    it->left = malloc(sizeof(long) * src->count);
+    for (int k = 1; k < src->count; k++) {
+      lval* st = src->cell[k];
+      it->left[k] = (st->cell[0]->num == LSTAGE_TAKE || st->cell[0]->num == LSTAGE_DROP) ? st->cell[1]->num : 0;
+    }
+  }
+}
+
+// 元の列から次の要素を取り出す。
+// リストの要素はコピーせずに抜き取るので、要素ごとの複製は発生しない。
+lval* liter_next_src(liter* it) {
+  if (it->i >= it->n) { return NULL; }
+  long i = it->i++;
+  if (it->src->type == LVAL_RANGE) { return lval_num(lval_range_nth(it->src, i)); }
+  if (it->src->type == LVAL_ARRAY) { return lval_num(it->src->arr[i]); }
+  // 辞書は{キー 値}の組を、空きスロットを飛ばしながら抜き取る。
+  if (it->src->type == LVAL_MAP) {
+    lmap* m = it->src->map;
+    while (!m->keys[i]) {
+      if (it->i >= it->n) { return NULL; }
+      i = it->i++;
+    }
+    lval* x = lval_add(lval_add(lval_qexpr(), m->keys[i]), m->vals[i]);
+    m->keys[i] = NULL;
+    return x;
+  }
+  lval* x = it->src->cell[i];
+  it->src->cell[i] = NULL;
+  it->src->num = 0;
+  return x;
+}
+
+lval* lval_apply(lenv* e, lval* f, lval* a);
+lval* lquota_err(lquota* q);
+
+// 次の要素を取り出す。要素がなければNULL。段の関数がエラーを返した場合はそのエラー。
+// 組み込み関数だけで回る走査も打ち切れるよう、要素ごとに評価の1段として数える。制限を超えたらそのエラー。
+lval* liter_next(liter* it) {
+  if (it->done) { return NULL; }
+  if (lquota_cur && !lquota_step(lquota_cur)) { return lquota_err(lquota_cur); }
+  if (it->own->type != LVAL_SEQ) { return liter_next_src(it); }
+
+  lval* x;
+ next:
+  while ((x = liter_next_src(it))) {
+    // 要素をパイプラインの各段に通す。途中で落とされたら次の要素へ。
+    for (int k = 1; k < it->own->count; k++) {
+      lval* st = it->own->cell[k];
+      lval* f = st->cell[1];
+      // 動的スコープなので、段の関数は段を作った環境で評価する。消費する側の環境では自由変数の意味が変わる。
+      lenv* se = st->env ? st->env : it->env;
+      switch (st->cell[0]->num) {
+      case LSTAGE_MAP:
+        x = lval_apply(se, f, lval_add(lval_sexpr(), x));
+        if (x->type == LVAL_ERR) { return x; }
+        break;
+      case LSTAGE_FILTER: {
+        lval* r = lval_apply(se, f, lval_add(lval_sexpr(), lval_copy(x)));
+        if (r->type == LVAL_ERR) { lval_del(x); return r; }
+        if (r->type != LVAL_NUM) {
+          lval* err = lval_err("Function 'filter' predicate returned incorrect type. Got %s, Expected %s.",
+                               ltype_name(r->type), ltype_name(LVAL_NUM));
+          lval_del(r); lval_del(x);
+          return err;
+        }
+        int keep = r->num != 0;
+        lval_del(r);
+        if (!keep) { lval_del(x); goto next; }
+        break;
+      }
+      case LSTAGE_DROP:
+        if (it->left[k] > 0) { it->left[k]--; lval_del(x); goto next; }
+        break;
+      case LSTAGE_TAKE:
+        // 取り終えたら以降の要素は一つも通らないので、走査自体を打ち切る。
+        if (it->left[k] == 0) { lval_del(x); it->done = 1; return NULL; }
+        it->left[k]--;
+        break;
+      }
+    }
+    return x;
+  }
+  return NULL;
+}
+
+// イテレータの破棄。まだ取り出されていない要素も解放する。
+void liter_del(liter* it) {
+  if (it->src->type == LVAL_QEXPR) {
+    // 取り出し済みの要素はすでに手放しているので、残りだけを解放する。
+    for (long i = it->i; i < it->src->count; i++) { lval_del(it->src->cell[i]); }
+    lheap_resize(it->src, -it->src->count);
+    it->src->count = 0;
+  }
+  free(it->left);
+  lval_del(it->own);
+}
+
+// 関数fに引数aを適用する。fは借用で、呼び出し後もそのまま使える。
+// lval_callはユーザー定義関数の仮引数を消費するので、コピーに対して呼び出す。
+// lval_evalを通らない呼び出しなので、ここで評価の1段として数える。
+lval* lval_apply(lenv* e, lval* f, lval* a) {
+  if (lquota_cur && !lquota_step(lquota_cur)) {
+    lval_del(a);
+    return lquota_err(lquota_cur);
+  }
+  if (f->builtin) {
+    LSTAT_ADD(LSTAT_CALL_BUILTIN, 1);
+    return f->builtin(e, a);
+  }
+  lval* g = lval_copy(f);
+  lval* r = lval_call(e, g, a);
+  lval_del(g);
+  return r;
+}
+
+// 組み込みfor-each。(for-each {x} 列 {本体}) 列の要素を順にxに束縛して本体を評価。
+lval* builtin_for_each(lenv* e, lval* a) {
+  LASSERT_NUM("for-each", a, 3);
+  LASSERT_TYPE("for-each", a, 0, LVAL_QEXPR);
+  LASSERT(a, lval_is_seq(a->cell[1]), "Function 'for-each' passed incorrect type for argument 1. Got %s, Expected %s.",
+          ltype_name(a->cell[1]->type), ltype_name(LVAL_QEXPR));
+  LASSERT_TYPE("for-each", a, 2, LVAL_QEXPR);
+  LASSERT(a, (a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM),
+          "Function 'for-each' expects single symbol for loop variable.");
+
+  lval* sym = a->cell[0]->cell[0];
+  liter it;
+  liter_init(&it, e, lval_pop(a, 1));
+  lenv* l = lenv_loop(e, sym);
+  lval* v;
+  while ((v = liter_next(&it))) {
+    if (v->type == LVAL_ERR) { lenv_del(l); liter_del(&it); lval_del(a); return v; }
+    lval* x = lval_loop_step(l, sym, v, a->cell[1]);
+    if (x->type == LVAL_ERR) { lenv_del(l); liter_del(&it); lval_del(a); return x; }
+    lval_del(x);
+  }
+
+  lenv_del(l);
+  liter_del(&it);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+////////////////////////////////////////
+// 定数の畳み込み
+////////////////////////////////////////
+
+// 関数を作るとき(\)とファイルのトップレベルの式を読み込んだとき(load)に、評価する部分の式を前もって計算する。
+// グローバル環境の数値、文字列、リストの変数と組み込み関数のうち、その後に再定義されたことも、仮引数や=、
+// ループ変数で束縛されたこともない名前(定数)は、その値に置き換える。動的スコープでは参照のたびに
+// 呼び出しの深さだけ環境をたどるので、深い再帰の中で演算子などを参照する関数ほど効果が大きい。純粋な組み込み関数(四則演算、比較、
+// リストの操作)の引数が全て値なら、呼び出しをその結果に置き換える。置き換えた値は元の式を覚えていて(lfold_ref)、
+// 表示では元の式を出力する。置き換えに使った名前が後で再定義されたり、局所的に束縛されたりすれば世代が進み、
+// それより前に置き換えた値は使えなくなり、コピーするときに新しい世代で置き換え直す(lfold_refold)。
+// 名前はハッシュ値のビットで覚える。衝突した名前は置き換えないだけなので、結果は変わらない。
+// 状態(lfold_state)はインタプリタごとに持つ。重ねたインタプリタ(lctx_new_layer)は土台の値も使うので、
+// 土台で置き換えに使った名前を束縛したら、土台で置き換えた値はそのインタプリタでは使わない。
+
+#define LFOLD_BITS 65536
+
+struct lfold_state {
+  unsigned long forbidden[LFOLD_BITS / 64]; // 置き換えられない名前
+  unsigned long used[LFOLD_BITS / 64]; // 置き換えに使った名前
+  long epoch; // 世代
+  int stale_under; // 土台で置き換えに使った名前を束縛した
+  lctx* ctx; // 状態を持つインタプリタ。破棄したらNULL。
+  long refs; // インタプリタと、この状態で置き換えた値の記録(lfold_ref)の数
+};
+
+static inline int lfold_test(unsigned long* bits, unsigned long h) {
+  return (__atomic_load_n(&bits[(h / 64) % (LFOLD_BITS / 64)], __ATOMIC_SEQ_CST) >> (h % 64)) & 1;
+}
+
+// ビットを立てる。既に立っていれば0。
+static inline int lfold_set(unsigned long* bits, unsigned long h) {
+  unsigned long* w = &bits[(h / 64) % (LFOLD_BITS / 64)];
+  unsigned long m = 1UL << (h % 64);
+  if (__atomic_load_n(w, __ATOMIC_RELAXED) & m) { return 0; }
+  return !(__atomic_fetch_or(w, m, __ATOMIC_SEQ_CST) & m);
+}
+
+// インタプリタcの畳み込みの状態。ワーカーからも使うので、最初に作るときは不可分に設定する。
+lfold_state* lfold_state_of(lctx* c) {
+  lfold_state* s = __atomic_load_n(&c->fold, __ATOMIC_ACQUIRE);
+  if (s) { return s; }
+  s = calloc(1, sizeof(lfold_state));
+  s->epoch = 1;
+  s->ctx = c;
+  s->refs = 1;
+  lfold_state* none = NULL;
+  if (!__atomic_compare_exchange_n(&c->fold, &none, s, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    free(s);
+    return none;
+  }
+  return s;
+}
+
+void lfold_state_release(lfold_state* s) {
+  if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) == 0) { free(s); }
+}
+
+// 環境eで評価しているインタプリタ。評価の途中なら、環境をたどらずにスレッドが覚えているものを使う。
+static inline lctx* lfold_ctx(lenv* e) { return lctx_cur ? lctx_cur : lenv_ctx(e); }
+
+// インタプリタcで名前を置き換えられないものにする。置き換えに使ったことのある名前なら、世代を進める。
+void lfold_forbid_in(lctx* c, char* sym) {
+  if (!c) { return; }
+  lfold_state* s = lfold_state_of(c);
+  unsigned long h = lhash_str(sym);
+  if (!lfold_set(s->forbidden, h)) { return; }
+  if (lfold_test(s->used, h)) { __atomic_add_fetch(&s->epoch, 1, __ATOMIC_SEQ_CST); }
+  for (lctx* u = c->under; u; u = u->under) {
+    lfold_state* us = __atomic_load_n(&u->fold, __ATOMIC_ACQUIRE);
+    if (us && lfold_test(us->used, h)) { __atomic_store_n(&s->stale_under, 1, __ATOMIC_SEQ_CST); }
+  }
+}
+
+// 環境eで評価している式が、名前を局所的に束縛する(仮引数、=、ループ変数)。
+void lfold_forbid(lenv* e, char* sym) { lfold_forbid_in(lfold_ctx(e), sym); }
+
+// インタプリタcで名前を置き換えに使う。c自身か土台で置き換えられない名前なら0。
+// 使ったことを記録してから確かめるので、同時にlfold_forbidされても、どちらかが必ず気付く。
+int lfold_use(lctx* c, char* sym) {
+  unsigned long h = lhash_str(sym);
+  lfold_set(lfold_state_of(c)->used, h);
+  for (; c; c = c->under) {
+    lfold_state* s = __atomic_load_n(&c->fold, __ATOMIC_ACQUIRE);
+    if (s && lfold_test(s->forbidden, h)) { return 0; }
+  }
+  return 1;
+}
+
+// グローバル環境eに名前symを束縛する前に呼ぶ。既に束縛があれば再定義。
+void lfold_define(lenv* e, char* sym) {
+  if (lhamt_get(e->root, lhash_str(sym), sym)) { lfold_forbid_in(e->ctx, sym); }
+}
+
+// 元の式orig、状態st、世代epochの記録を作る。origは消費される。
+lfold_ref* lfold_new(lval* orig, lfold_state* st, long epoch) {
+  lfold_ref* f = malloc(sizeof(lfold_ref));
+  f->orig = orig;
+  f->st = st;
+  __atomic_add_fetch(&st->refs, 1, __ATOMIC_RELAXED);
+  f->epoch = epoch;
+  f->next = NULL;
+  f->refs = 1;
+  return f;
+}
+
+// 記録の参照を増やす、減らす。最後の参照がなくなれば、元の式(共有の値でなければ)とともに解放する。
+// 関数の本体は呼び出しのたびに(並列処理ではワーカーからも)コピーされるので、不可分操作で数える。
+lfold_ref* lfold_retain(lfold_ref* f) {
+  __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+  return f;
+}
+
+void lfold_release(lfold_ref* f) {
+  if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) != 0) { return; }
+  lval_del(f->orig);
+  if (f->next) { lval_del(f->next); }
+  lfold_state_release(f->st);
+  free(f);
+}
+
+// 置き換えた後に、置き換えたインタプリタで世代が進んだか。進んでいれば、どこでも二度と使えない。
+int lfold_dead(lfold_ref* f) { return f->epoch != __atomic_load_n(&f->st->epoch, __ATOMIC_SEQ_CST); }
+
+lval* lfold(lenv* e, lval* x);
+
+// 使えなくなった記録fの元の式を、置き換えたインタプリタの今の世代で置き換え直したもの。
+// 関数の本体は共有されていて書き換えられないので、置き換え直したものは記録に一度だけ作って覚え、
+// 本体のコピーが引き継ぐ。インタプリタが破棄されていれば元の式。
+lval* lfold_refold(lfold_ref* f) {
+  lval* r = __atomic_load_n(&f->next, __ATOMIC_ACQUIRE);
+  if (r) { return r; }
+  lctx* c = __atomic_load_n(&f->st->ctx, __ATOMIC_ACQUIRE);
+  if (!c) { return f->orig; }
+  r = lfold(c->env, lval_copy(f->orig));
+  lval* none = NULL;
+  if (!__atomic_compare_exchange_n(&f->next, &none, r, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    lval_del(r);
+    return none;
+  }
+  return r;
+}
+
+// 置き換えた値の記録fが、インタプリタcの評価で使えるか。置き換えたインタプリタか、それを土台に
+// 重ねたもので、世代が進んでおらず、重ねたものが土台で置き換えに使った名前を束縛していなければ使える。
+int lfold_valid(lctx* c, lfold_ref* f) {
+  for (; c; c = c->under) {
+    lfold_state* s = __atomic_load_n(&c->fold, __ATOMIC_ACQUIRE);
+    if (s == f->st) { return !lfold_dead(f); }
+    if (s && __atomic_load_n(&s->stale_under, __ATOMIC_SEQ_CST)) { return 0; }
+  }
+  return 0;
+}
+
+// 置き換えた値vを評価する。使えれば値のまま、使えなければ元の式を評価する。
+lval* lfold_eval(lenv* e, lval* v) {
+  lfold_ref* f = v->fold;
+  v->fold = NULL;
+  if (lfold_valid(lfold_ctx(e), f)) { lfold_release(f); return v; }
+  lval* x = lval_copy(f->orig);
+  x->loc = v->loc;
+  lfold_release(f);
+  lval_del(v);
+  return lval_eval(e, x);
+}
+
+// 値vに元の式origを覚えさせる。vとorigは消費され、置き換える値を返す。
+// ハッシュコンスが有効なら元の式を表に登録して共有の値にし、無効なら置き換えた値とそのコピーだけが参照する。
+lval* lfold_mark(lenv* g, lval* v, lval* orig, long epoch) {
+  v->fold = lfold_new(lhcons_enabled() ? lhcons_intern(orig) : orig, g->ctx->fold, epoch);
+  return v;
+}
+
+// 置き換えた値を元の式に戻したコピー。
+lval* lfold_unfold(lval* x) {
+  if (x->fold) { return lval_copy(x->fold->orig); }
+  if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) { return lval_copy(x); }
+  lval* y = x->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+  y->loc = x->loc;
+  for (int i = 0; i < x->count; i++) { lval_add(y, lfold_unfold(x->cell[i])); }
+  return y;
+}
+
+lval* builtin_len(lenv* e, lval* a);
+lval* builtin_nth(lenv* e, lval* a);
+
+// 引数が値なら呼び出しを結果に置き換えてよい組み込み関数。
+int lfold_pure(lbuiltin fn) {
+  return fn == builtin_add || fn == builtin_sub || fn == builtin_mul || fn == builtin_div ||
+    fn == builtin_gt || fn == builtin_lt || fn == builtin_ge || fn == builtin_le ||
+    fn == builtin_eq || fn == builtin_ne || fn == builtin_list || fn == builtin_head ||
+    fn == builtin_tail || fn == builtin_join || fn == builtin_len || fn == builtin_nth;
+}
+
+// 組み込み関数fnのi番目の引数のQ式を、評価する式として扱うか。ifの分岐とループの条件、本体。
+int lfold_code_arg(lbuiltin fn, int i) {
+  if (fn == builtin_if) { return i == 2 || i == 3; }
+  if (fn == builtin_while) { return i == 1 || i == 2; }
+  if (fn == builtin_dotimes || fn == builtin_for_each) { return i == 3; }
+  return 0;
+}
+
+lval* lfold_expr(lenv* g, lval* x, long epoch);
+
+// 要素をS式として評価するリストxの、子要素を置き換える。先頭を組み込み関数に置き換えたら、その関数を返す。
+lbuiltin lfold_list(lenv* g, lval* x, long epoch) {
+  if (x->shared || x->count == 0) { return NULL; }
+  // 要素を書き換えるので、キャッシュした構造的なハッシュ値は捨てる。
+  x->num = 0;
+  // 要素が1つなら、それを評価した値。
+  if (x->count == 1) { x->cell[0] = lfold_expr(g, x->cell[0], epoch); return NULL; }
+  x->cell[0] = lfold_expr(g, x->cell[0], epoch);
+  lval* h = x->cell[0];
+  lbuiltin fn = h->fold && h->type == LVAL_FUN ? h->builtin : NULL;
+  for (int i = 1; i < x->count; i++) {
+    lval* y = x->cell[i];
+    if (y->type == LVAL_QEXPR) {
+      if (fn && lfold_code_arg(fn, i)) { lfold_list(g, y, epoch); }
+    } else {
+      x->cell[i] = lfold_expr(g, y, epoch);
+    }
+  }
+  return fn;
+}
+
+// 評価する式xを置き換えたものを返す。xは消費される。
+lval* lfold_expr(lenv* g, lval* x, long epoch) {
+  if (x->fold || x->shared) { return x; }
+  if (x->type == LVAL_SYM) {
+    // 定数の参照。
+    lhleaf* l = lhamt_get(g->root, lhash_str(x->sym), x->sym);
+    if (!l) { return x; }
+    lval* v = l->val;
+    if (v->type != LVAL_NUM && v->type != LVAL_STR && v->type != LVAL_QEXPR && !(v->type == LVAL_FUN && v->builtin)) {
+      return x;
+    }
+    if (v->type == LVAL_QEXPR && !lhcons_ok(v)) { return x; }
+    if (!lfold_use(g->ctx, x->sym)) { return x; }
+    lval* c = lval_copy(v);
+    c->loc = x->loc;
+    return lfold_mark(g, c, x, epoch);
+  }
+  if (x->type != LVAL_SEXPR) { return x; }
+  lbuiltin fn = lfold_list(g, x, epoch);
+
+  // 純粋な組み込み関数の、全て値の引数での呼び出し。
+  if (!fn || !lfold_pure(fn)) { return x; }
+  for (int i = 1; i < x->count; i++) {
+    int t = x->cell[i]->type;
+    if (t != LVAL_NUM && t != LVAL_STR && t != LVAL_QEXPR) { return x; }
+  }
+  lval* orig = lfold_unfold(x);
+  if (!lhcons_ok(orig)) { lval_del(orig); return x; }
+  lval* a = lval_sexpr();
+  for (int i = 1; i < x->count; i++) {
+    lval* y = lval_copy(x->cell[i]);
+    if (y->fold) { lfold_release(y->fold); y->fold = NULL; }
+    lval_add(a, y);
+  }
+  lval* r = fn(g, a);
+  // エラーは評価するときに起こす。評価すると別の値になるもの(nthで取り出したシンボルなど)も置き換えない。
+  if (r->type != LVAL_NUM && r->type != LVAL_STR && r->type != LVAL_QEXPR) { lval_del(r); lval_del(orig); return x; }
+  r->loc = x->loc;
+  lval_del(x);
+  return lfold_mark(g, r, orig, epoch);
+}
+
+// 関数の本体やトップレベルの式xを、環境eのグローバル環境で畳み込む。本体(Q式)は要素を、S式は式全体を置き換える。
+lval* lfold(lenv* e, lval* x) {
+  while (e->par) { e = e->par; }
+  if (!e->ctx) { return x; }
+  // 世代は置き換える前に読む。置き換えの途中で進めば、置き換えた値は使われない。
+  long epoch = __atomic_load_n(&lfold_state_of(e->ctx)->epoch, __ATOMIC_SEQ_CST);
+  if (x->type == LVAL_QEXPR) { lfold_list(e, x, epoch); return x; }
+  return lfold_expr(e, x, epoch);
+}
+
+////////////////////////////////////////
+// JITコンパイラ
+////////////////////////////////////////
+
+// 有効にすると(--jit、または環境変数LISPY_JIT)、名前を付けた関数の呼び出しを名前ごとに数え、
+// LJIT_HOT回ごとに、まだコンパイルしていなければx86-64の機械語にコンパイルする。
+// 対象は仮引数と整数の定数、四則演算と比較、if、自分自身とコンパイル済みの関数の呼び出しだけからなる関数で、
+// 演算と比較はその場に展開する。機械語は整数の引数をレジスタで受け取り、整数を返す。
+// 結果の値の確保と、エラーの場合のインタプリタへの切り替えは、実行時の側(ljit_run, ljit_bail)が行う。
+// 機械語には副作用がないので、想定と違うこと(数値でない引数、0除算)が起きたら、その呼び出しを打ち切って
+// インタプリタで最初から評価し直す(脱最適化)。機械語が仮定する名前の束縛(演算子や呼び出す関数)は
+// 呼び出しのたびに呼び出し元の環境で確かめ、再定義や動的スコープで変わっていれば同じくインタプリタで評価する。
+// 制限のある評価とプロファイル中は、段数や呼び出しを数えるためにインタプリタで評価する。
+
+#define LJIT_HOT 1000 // コンパイルを試みる呼び出し回数の間隔
+#define LJIT_MAX_ARGS 6 // レジスタで渡す引数の数の上限
+#define LJIT_MAX_BYTES (16L << 20) // 機械語の合計の大きさの上限
+
+typedef struct ljit ljit;
+
+// 機械語が仮定する名前の束縛。builtinがNULLでなければその組み込み関数、そうでなければfnをコンパイルした関数。
+typedef struct {
+  char* sym;
+  unsigned long hash;
+  lbuiltin builtin;
+  ljit* fn;
+} ljit_dep;
+
+// コンパイルした関数。再定義されても他のスレッドが実行中かもしれないので、機械語とともに解放しない。
+struct ljit {
+  long serial; // 最後に同じ定義だと確かめた関数の番号
+  lval* formals; // コンパイルした定義
+  lval* body;
+  int argc;
+  void* code; // 機械語。コンパイルできない関数はNULL。
+  int ndeps;
+  ljit_dep* deps;
+};
+
+enum { LJIT_OK, LJIT_LATER, LJIT_NEVER };
+
+static long ljit_functions, ljit_bytes, ljit_deopts;
+static pthread_mutex_t ljit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// JITコンパイラを有効にする。x86-64以外では何もしない。
+void ljit_start(void) {
+#ifdef LISPY_JIT_X86
+  __atomic_store_n(&ljit_on, 1, __ATOMIC_SEQ_CST);
+#endif
+}
+
+#ifdef LISPY_JIT_X86
+
+static inline void ljit_deopt(void) { __atomic_add_fetch(&ljit_deopts, 1, __ATOMIC_RELAXED); }
+
+// 関数fがjをコンパイルした定義と同じか。番号が違えば構造を比べ、同じなら番号を覚え直す。
+int ljit_same(ljit* j, lval* f) {
+  if (f->num && f->num == __atomic_load_n(&j->serial, __ATOMIC_RELAXED)) { return 1; }
+  if (!lval_eq(j->formals, f->formals) || !lval_eq(j->body, f->body)) { return 0; }
+  if (f->num) { __atomic_store_n(&j->serial, f->num, __ATOMIC_RELAXED); }
+  return 1;
+}
+
+// 環境eから見た名前の束縛。コピーせずに参照を返す。なければNULL。
+lval* ljit_lookup(lenv* e, char* sym, unsigned long h) {
+  for (; e; e = e->par) {
+    lhleaf* l = lhamt_get(e->root, h, sym);
+    if (l) { return l->val; }
+  }
+  return NULL;
+}
+
+// 環境eで、機械語が仮定する束縛が全て成り立っているか。
+int ljit_valid(ljit* j, lenv* e) {
+  for (int i = 0; i < j->ndeps; i++) {
+    ljit_dep* d = &j->deps[i];
+    lval* v = ljit_lookup(e, d->sym, d->hash);
+    if (!v || v->type != LVAL_FUN) { return 0; }
+    if (d->builtin ? v->builtin != d->builtin : (v->builtin || v->env->root || !ljit_same(d->fn, v))) { return 0; }
+  }
+  return 1;
+}
+
+void ljit_free(ljit* j) {
+  for (int i = 0; i < j->ndeps; i++) { free(j->deps[i].sym); }
+  free(j->deps);
+  lval_del(j->formals);
+  lval_del(j->body);
+  free(j);
+}
+
+// コンパイル中の状態。
+typedef struct {
+  unsigned char* code;
+  long n, cap;
+  lenv* e; // 名前を解決する環境
+  ljit* j; // コンパイルする関数
+  int fail; // コンパイルできなければLJIT_LATER(後でもう一度試す)かLJIT_NEVER
+  long* bails; // 脱最適化への分岐(rel32)の位置
+  int nbails;
+} ljit_cc;
+
+void ljit_emit(ljit_cc* c, const unsigned char* s, int n) {
+  if (c->n + n > c->cap) {
+    c->cap = (c->n + n) * 2;
+    c->code = realloc(c->code, c->cap);
+  }
+  memcpy(c->code + c->n, s, n);
+  c->n += n;
+}
+
+#define LJIT_EMIT(c, ...) \
+  do { static const unsigned char s_[] = { __VA_ARGS__ }; ljit_emit(c, s_, sizeof(s_)); } while (0)
+
+void ljit_emit64(ljit_cc* c, long x) { ljit_emit(c, (unsigned char*)&x, 8); }
+void ljit_emit32(ljit_cc* c, int x) { ljit_emit(c, (unsigned char*)&x, 4); }
+
+// posにあるrel32を、現在の位置への相対アドレスにする。
+void ljit_patch(ljit_cc* c, long pos) {
+  int rel = (int)(c->n - (pos + 4));
+  memcpy(c->code + pos, &rel, 4);
+}
+
+// 条件分岐(0F 8x rel32)で脱最適化へ飛ぶ。飛び先は関数の末尾で埋める。
+void ljit_emit_bail(ljit_cc* c, unsigned char cc) {
+  unsigned char s[6] = { 0x0F, cc, 0, 0, 0, 0 };
+  ljit_emit(c, s, 6);
+  c->bails = realloc(c->bails, sizeof(long) * (c->nbails + 1));
+  c->bails[c->nbails++] = c->n - 4;
+}
+
+// mov rax, imm
+void ljit_emit_imm(ljit_cc* c, long x) {
+  if (x >= INT_MIN && x <= INT_MAX) { LJIT_EMIT(c, 0x48, 0xC7, 0xC0); ljit_emit32(c, (int)x); }
+  else { LJIT_EMIT(c, 0x48, 0xB8); ljit_emit64(c, x); }
+}
+
+// 仮引数の位置。仮引数でなければ-1。
+int ljit_param(ljit_cc* c, char* sym) {
+  for (int i = 0; i < c->j->formals->count; i++) {
+    if (strcmp(c->j->formals->cell[i]->sym, sym) == 0) { return i; }
+  }
+  return -1;
+}
+
+// 機械語が仮定する束縛を加える。
+void ljit_dep_add(ljit_cc* c, char* sym, lbuiltin builtin, ljit* fn) {
+  ljit* j = c->j;
+  for (int i = 0; i < j->ndeps; i++) {
+    if (strcmp(j->deps[i].sym, sym) == 0) {
+      // 同じ名前に別の束縛を仮定する関数同士は組み合わせられない。
+      if (j->deps[i].builtin != builtin || j->deps[i].fn != fn) { c->fail = LJIT_LATER; }
+      return;
+    }
+  }
+  // 仮引数が隠す名前は、呼び出した先の関数からも仮引数に見える(動的スコープ)。
+  if (ljit_param(c, sym) >= 0) { c->fail = LJIT_NEVER; return; }
+  j->deps = realloc(j->deps, sizeof(ljit_dep) * (j->ndeps + 1));
+  ljit_dep* d = &j->deps[j->ndeps++];
+  d->sym = malloc(strlen(sym) + 1);
+  strcpy(d->sym, sym);
+  d->hash = lhash_str(sym);
+  d->builtin = builtin;
+  d->fn = fn;
+}
+
+void ljit_gen_list(ljit_cc* c, lval* x);
+
+// 式xを評価した値をraxに求める。
+void ljit_gen_expr(ljit_cc* c, lval* x) {
+  if (c->fail) { return; }
+  // 畳み込んだ値は後で無効になりうるので、元の式をコンパイルする。
+  if (x->fold) { x = x->fold->orig; }
+  switch (x->type) {
+  case LVAL_NUM: ljit_emit_imm(c, x->num); return;
+  case LVAL_SYM: {
+    int i = ljit_param(c, x->sym);
+    if (i < 0) { break; }
+    // mov rax, [rbp - 8(i+1)]
+    LJIT_EMIT(c, 0x48, 0x8B, 0x45);
+    unsigned char d = (unsigned char)(-8 * (i + 1));
+    ljit_emit(c, &d, 1);
+    return;
+  }
+  case LVAL_SEXPR: ljit_gen_list(c, x); return;
+  }
+  c->fail = LJIT_NEVER;
+}
+
+// 四則演算。左から順に畳み込む。
+void ljit_gen_arith(ljit_cc* c, lval* x, lbuiltin fn) {
+  ljit_gen_expr(c, x->cell[1]);
+  // (- x)は符号の反転。
+  if (x->count == 2 && fn == builtin_sub) { LJIT_EMIT(c, 0x48, 0xF7, 0xD8); return; }
+  for (int i = 2; i < x->count; i++) {
+    LJIT_EMIT(c, 0x50); // push rax
+    ljit_gen_expr(c, x->cell[i]);
+    LJIT_EMIT(c, 0x48, 0x89, 0xC1, 0x58); // mov rcx, rax; pop rax
+    if (fn == builtin_add) { LJIT_EMIT(c, 0x48, 0x01, 0xC8); }
+    if (fn == builtin_sub) { LJIT_EMIT(c, 0x48, 0x29, 0xC8); }
+    if (fn == builtin_mul) { LJIT_EMIT(c, 0x48, 0x0F, 0xAF, 0xC1); }
+    if (fn == builtin_div) {
+      // 0除算はインタプリタにエラーを作らせる。-1での除算はidivが例外になりうるので符号の反転にする。
+      LJIT_EMIT(c, 0x48, 0x85, 0xC9); // test rcx, rcx
+      ljit_emit_bail(c, 0x84); // je bail
+      LJIT_EMIT(c, 0x48, 0x83, 0xF9, 0xFF, 0x75, 0x05); // cmp rcx, -1; jne +5
+      LJIT_EMIT(c, 0x48, 0xF7, 0xD8, 0xEB, 0x05); // neg rax; jmp +5
+      LJIT_EMIT(c, 0x48, 0x99, 0x48, 0xF7, 0xF9); // cqo; idiv rcx
+    }
+  }
+}
+
+// 比較。結果は1か0。
+void ljit_gen_compare(ljit_cc* c, lval* x, unsigned char cc) {
+  ljit_gen_expr(c, x->cell[1]);
+  LJIT_EMIT(c, 0x50); // push rax
+  ljit_gen_expr(c, x->cell[2]);
+  LJIT_EMIT(c, 0x48, 0x89, 0xC1, 0x58, 0x48, 0x39, 0xC8); // mov rcx, rax; pop rax; cmp rax, rcx
+  unsigned char s[6] = { 0x0F, cc, 0xC0, 0x0F, 0xB6, 0xC0 }; // setcc al; movzx eax, al
+  ljit_emit(c, s, 6);
+}
+
+// (if 条件 {then} {else})
+void ljit_gen_if(ljit_cc* c, lval* x) {
+  ljit_gen_expr(c, x->cell[1]);
+  LJIT_EMIT(c, 0x48, 0x85, 0xC0, 0x0F, 0x84, 0, 0, 0, 0); // test rax, rax; je else
+  long to_else = c->n - 4;
+  ljit_gen_list(c, x->cell[2]);
+  LJIT_EMIT(c, 0xE9, 0, 0, 0, 0); // jmp end
+  long to_end = c->n - 4;
+  ljit_patch(c, to_else);
+  ljit_gen_list(c, x->cell[3]);
+  ljit_patch(c, to_end);
+}
+
+// 関数gの呼び出し。引数を順に求めてスタックに積み、レジスタに移して呼ぶ。
+void ljit_gen_call(ljit_cc* c, lval* x, ljit* g) {
+  static const unsigned char pops[LJIT_MAX_ARGS][2] = { // pop rdi, rsi, rdx, rcx, r8, r9
+    { 0x5F }, { 0x5E }, { 0x5A }, { 0x59 }, { 0x41, 0x58 }, { 0x41, 0x59 }
+  };
+  int n = x->count - 1;
+  for (int i = 0; i < n; i++) {
+    ljit_gen_expr(c, x->cell[i + 1]);
+    LJIT_EMIT(c, 0x50); // push rax
+  }
+  for (int i = n - 1; i >= 0; i--) { ljit_emit(c, pops[i], i < 4 ? 1 : 2); }
+  if (g == c->j) {
+    // 自分自身は先頭への相対呼び出し。
+    LJIT_EMIT(c, 0xE8);
+    ljit_emit32(c, (int)-(c->n + 4));
+  } else {
+    LJIT_EMIT(c, 0x48, 0xB8); // mov rax, code; call rax
+    ljit_emit64(c, (long)g->code);
+    LJIT_EMIT(c, 0xFF, 0xD0);
+  }
+}
+
+// 要素をS式として評価した値をraxに求める。要素が1つならその値、そうでなければ先頭の関数の呼び出し。
+void ljit_gen_list(ljit_cc* c, lval* x) {
+  if (c->fail) { return; }
+  if (x->count == 1) { ljit_gen_expr(c, x->cell[0]); return; }
+  lval* h = x->count ? x->cell[0] : NULL;
+  if (h && h->fold) { h = h->fold->orig; }
+  if (!h || h->type != LVAL_SYM || ljit_param(c, h->sym) >= 0) { c->fail = LJIT_NEVER; return; }
+  lval* v = ljit_lookup(c->e, h->sym, lhash_str(h->sym));
+  if (!v || v->type != LVAL_FUN) { c->fail = LJIT_NEVER; return; }
+  int n = x->count - 1;
+
+  if (v->builtin) {
+    lbuiltin fn = v->builtin;
+    if (fn == builtin_add || fn == builtin_sub || fn == builtin_mul || fn == builtin_div) {
+      ljit_gen_arith(c, x, fn);
+    } else if (n == 2 && fn == builtin_lt) { ljit_gen_compare(c, x, 0x9C);
+    } else if (n == 2 && fn == builtin_gt) { ljit_gen_compare(c, x, 0x9F);
+    } else if (n == 2 && fn == builtin_le) { ljit_gen_compare(c, x, 0x9E);
+    } else if (n == 2 && fn == builtin_ge) { ljit_gen_compare(c, x, 0x9D);
+    } else if (n == 2 && fn == builtin_eq) { ljit_gen_compare(c, x, 0x94);
+    } else if (n == 2 && fn == builtin_ne) { ljit_gen_compare(c, x, 0x95);
+    } else if (n == 3 && fn == builtin_if &&
+               x->cell[2]->type == LVAL_QEXPR && x->cell[3]->type == LVAL_QEXPR) {
+      ljit_gen_if(c, x);
+    } else {
+      c->fail = LJIT_NEVER; return;
+    }
+    ljit_dep_add(c, h->sym, fn, NULL);
+    return;
+  }
+
+  // ユーザー定義関数は、自分自身かコンパイル済みのものだけを直接呼び出す。
+  ljit* g = c->j;
+  if (!ljit_same(g, v)) {
+    g = v->name ? __atomic_load_n(&v->name->jit, __ATOMIC_ACQUIRE) : NULL;
+    if (!g || !ljit_same(g, v)) { c->fail = LJIT_LATER; return; }
+    if (!g->code) { c->fail = LJIT_NEVER; return; }
+  }
+  // 部分適用になる呼び出しは結果が関数になる。
+  if (v->env->root || g->argc != n) { c->fail = LJIT_NEVER; return; }
+  ljit_gen_call(c, x, g);
+  ljit_dep_add(c, h->sym, NULL, g);
+  if (g != c->j) {
+    for (int i = 0; i < g->ndeps; i++) { ljit_dep_add(c, g->deps[i].sym, g->deps[i].builtin, g->deps[i].fn); }
+  }
+}
+
+static __thread jmp_buf* ljit_jmp;
+
+// 機械語の実行を打ち切り、ljit_runに戻る。
+void ljit_bail(void) { longjmp(*ljit_jmp, 1); }
+
+// 関数jを機械語にコンパイルする。環境eで名前を解決する。
+int ljit_gen(ljit_cc* c, lenv* e, ljit* j) {
+  c->e = e;
+  c->j = j;
+  int argc = j->argc;
+  if (argc > LJIT_MAX_ARGS) { return LJIT_NEVER; }
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(j->formals->cell[i]->sym, "&") == 0) { return LJIT_NEVER; }
+  }
+
+  // push rbp; mov rbp, rsp; sub rsp, n。引数はフレームに置く。
+  static const unsigned char stores[LJIT_MAX_ARGS][3] = { // mov [rbp+d], rdi, rsi, rdx, rcx, r8, r9
+    { 0x48, 0x89, 0x7D }, { 0x48, 0x89, 0x75 }, { 0x48, 0x89, 0x55 },
+    { 0x48, 0x89, 0x4D }, { 0x4C, 0x89, 0x45 }, { 0x4C, 0x89, 0x4D }
+  };
+  LJIT_EMIT(c, 0x55, 0x48, 0x89, 0xE5, 0x48, 0x83, 0xEC);
+  unsigned char frame = (unsigned char)((argc * 8 + 15) & ~15);
+  ljit_emit(c, &frame, 1);
+  for (int i = 0; i < argc; i++) {
+    ljit_emit(c, stores[i], 3);
+    unsigned char d = (unsigned char)(-8 * (i + 1));
+    ljit_emit(c, &d, 1);
+  }
+
+  ljit_gen_list(c, j->body);
+  LJIT_EMIT(c, 0xC9, 0xC3); // leave; ret
+
+  // 脱最適化。スタックを揃えてljit_bailを呼ぶ(戻らない)。
+  if (c->nbails) {
+    for (int i = 0; i < c->nbails; i++) { ljit_patch(c, c->bails[i]); }
+    LJIT_EMIT(c, 0x48, 0x83, 0xE4, 0xF0, 0x48, 0xB8); // and rsp, -16; mov rax, ljit_bail; call rax
+    ljit_emit64(c, (long)ljit_bail);
+    LJIT_EMIT(c, 0xFF, 0xD0);
+  }
+  if (c->fail) { return c->fail; }
+  // 呼び出した先の関数が、この環境では別の束縛を仮定しているかもしれない。
+  if (!ljit_valid(j, e)) { return LJIT_LATER; }
+
+  long page = sysconf(_SC_PAGESIZE);
+  long size = (c->n + page - 1) / page * page;
+  if (ljit_bytes + size > LJIT_MAX_BYTES) { return LJIT_LATER; }
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) { return LJIT_LATER; }
+  memcpy(p, c->code, c->n);
+  if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0) { munmap(p, size); return LJIT_LATER; }
+  j->code = p;
+  ljit_functions++;
+  ljit_bytes += size;
+  return LJIT_OK;
+}
+
+// 関数fのコンパイルを試みる。できた関数、またはコンパイルできないことを名前に記録する。
+void ljit_compile(lenv* e, lval* f) {
+  pthread_mutex_lock(&ljit_lock);
+  lname* n = f->name;
+  ljit* old = n->jit;
+  // 他のスレッドが先にコンパイルしていれば、それを使う。
+  if (old && ljit_same(old, f) && (!old->code || ljit_valid(old, e))) {
+    pthread_mutex_unlock(&ljit_lock);
+    return;
+  }
+  ljit* j = calloc(1, sizeof(ljit));
+  j->serial = f->num;
+  j->formals = lval_copy(f->formals);
+  j->body = lval_copy(f->body);
+  j->argc = f->formals->count;
+
+  ljit_cc c;
+  memset(&c, 0, sizeof(c));
+  int r = ljit_gen(&c, e, j);
+  free(c.code);
+  free(c.bails);
+  if (r == LJIT_LATER) {
+    ljit_free(j);
+  } else {
+    __atomic_store_n(&n->jit, j, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&ljit_lock);
+}
+
+// 機械語で実行する。引数が数値でないか、実行を打ち切ったらNULL(aは消費しない)。
+lval* ljit_run(ljit* j, lval* a) {
+  long x[LJIT_MAX_ARGS] = { 0 };
+  for (int i = 0; i < a->count; i++) {
+    if (a->cell[i]->type != LVAL_NUM) { ljit_deopt(); return NULL; }
+    x[i] = a->cell[i]->num;
+  }
+  jmp_buf jb;
+  jmp_buf* prev = ljit_jmp;
+  ljit_jmp = &jb;
+  if (setjmp(jb)) {
+    ljit_jmp = prev;
+    ljit_deopt();
+    return NULL;
+  }
+  long (*code)(long, long, long, long, long, long) = (long (*)(long, long, long, long, long, long))j->code;
+  long r = code(x[0], x[1], x[2], x[3], x[4], x[5]);
+  ljit_jmp = prev;
+  lval_del(a);
+  return lval_num(r);
+}
+
+// 関数fを環境eで呼び出す。機械語で実行できなければNULLを返し、aは消費しない。
+lval* ljit_call(lenv* e, lval* f, lval* a) {
+  if (lquota_cur || __atomic_load_n(&lprof_on, __ATOMIC_RELAXED) > 0 || lheap_enabled()) { return NULL; }
+  // 部分適用した関数と、部分適用になる呼び出しは対象にしない。
+  if (f->env->root || a->count != f->formals->count) { return NULL; }
+  lname* n = f->name;
+  ljit* j = __atomic_load_n(&n->jit, __ATOMIC_ACQUIRE);
+  if (j && ljit_same(j, f)) {
+    if (!j->code) { return NULL; }
+    if (ljit_valid(j, e)) { return ljit_run(j, a); }
+    // 仮定した束縛が変わっていれば、数え直して今の束縛でコンパイルし直す。
+    ljit_deopt();
+  }
+  if (__atomic_add_fetch(&n->jit_calls, 1, __ATOMIC_RELAXED) % LJIT_HOT == 0) { ljit_compile(e, f); }
+  return NULL;
+}
+
+#else
+
+lval* ljit_call(lenv* e, lval* f, lval* a) { return NULL; }
+
+#endif
+
+////////////////////////////////////////
+// 範囲と列の操作
+////////////////////////////////////////
+
+// 組み込みrange。(range 終了値) (range 開始値 終了値) (range 開始値 終了値 増分)
+lval* builtin_range(lenv* e, lval* a) {
+  LASSERT(a, (a->count >= 1 && a->count <= 3),
+          "Function 'range' passed incorrect number of arguments. Got %i, Expected 1 to 3.", a->count);
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("range", a, i, LVAL_NUM);
+  }
+
+  long start = 0, stop, step = 1;
+  if (a->count == 1) {
+    stop = a->cell[0]->num;
+  } else {
+    start = a->cell[0]->num;
+    stop = a->cell[1]->num;
+  }
+  if (a->count == 3) { step = a->cell[2]->num; }
+  LASSERT(a, (step != 0), "Function 'range' passed zero step!");
+  LASSERT(a, (lval_range_ulen(start, stop, step) <= LONG_MAX), "Function 'range' passed too long range!");
+
+  lval_del(a);
+  return lval_range(start, stop, step);
+}
+
+// 列を遅延パイプラインにする。範囲やリストは、それを元の列とする段のないパイプラインになる。
+lval* lval_to_seq(lval* l) {
+  if (l->type == LVAL_SEQ) { return l; }
+  return lval_add(lval_seq(), l);
+}
+
+// パイプラインに段を追加する。関数を適用するmap, filter段は、作った環境eの写しを持つ。
+// eがNULLなら写さず、段の関数は列を消費する側の環境で評価する。
+lval* lval_seq_stage(lenv* e, lval* l, int kind, lval* arg) {
+  lval* st = lval_add(lval_add(lval_qexpr(), lval_num(kind)), arg);
+  if (e && (kind == LSTAGE_MAP || kind == LSTAGE_FILTER)) { st->env = lenv_snapshot_frames(e); }
+  return lval_add(lval_to_seq(l), st);
+}
+
+// 組み込みseq。(seq 列) リストや範囲を遅延パイプラインにする。
+// 以降のmap, filter, take, dropは中間リストを作らず、段として積まれるだけになる。
+lval* builtin_seq(lenv* e, lval* a) {
+  LASSERT_NUM("seq", a, 1);
+  LASSERT(a, lval_is_seq(a->cell[0]), "Function 'seq' passed incorrect type for argument 0. Got %s, Expected %s.",
+          ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+  return lval_to_seq(lval_take(a, 0));
+}
+
+// 組み込みcollect。(collect 列) 列の全要素を一度の走査でリストにする。
+lval* builtin_collect(lenv* e, lval* a) {
+  LASSERT_NUM("collect", a, 1);
+  LASSERT(a, lval_is_seq(a->cell[0]), "Function 'collect' passed incorrect type for argument 0. Got %s, Expected %s.",
+          ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+
+  liter it;
+  liter_init(&it, e, lval_pop(a, 0));
+  lval* r = lval_qexpr();
+  lval* v;
+  while ((v = liter_next(&it))) {
+    if (v->type == LVAL_ERR) { lval_del(r); r = v; break; }
+    lval_add(r, v);
+  }
+
+  liter_del(&it);
+  lval_del(a);
+  return r;
+}
+
+// 組み込みmap。(map f 列) 各要素にfを適用したリスト。
+// 範囲やパイプラインに対しては、計算せずに段を積んだパイプラインを返す。
+lval* builtin_map(lenv* e, lval* a) {
+  LASSERT_NUM("map", a, 2);
+  LASSERT_TYPE("map", a, 0, LVAL_FUN);
+  LASSERT(a, lval_is_seq(a->cell[1]), "Function 'map' passed incorrect type for argument 1. Got %s, Expected %s.",
+          ltype_name(a->cell[1]->type), ltype_name(LVAL_QEXPR));
+
+  if (a->cell[1]->type != LVAL_QEXPR) {
+    lval* f = lval_pop(a, 0);
+    return lval_seq_stage(e, lval_take(a, 0), LSTAGE_MAP, f);
+  }
+
+  lval* f = a->cell[0];
+  liter it;
+  liter_init(&it, e, lval_pop(a, 1));
+  lval* r = lval_qexpr();
+  lval* v;
+  while ((v = liter_next(&it))) {
+    if (v->type == LVAL_ERR) { lval_del(r); r = v; break; }
+    lval* x = lval_apply(e, f, lval_add(lval_sexpr(), v));
+    if (x->type == LVAL_ERR) { lval_del(r); r = x; break; }
+    lval_add(r, x);
+  }
+
+  liter_del(&it);
+  lval_del(a);
+  return r;
+}
+
+// 組み込みfilter。(filter f 列) fが真となる要素だけのリスト。
+// 範囲やパイプラインに対しては、計算せずに段を積んだパイプラインを返す。
+lval* builtin_filter(lenv* e, lval* a) {
+  LASSERT_NUM("filter", a, 2);
+  LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+  LASSERT(a, lval_is_seq(a->cell[1]), "Function 'filter' passed incorrect type for argument 1. Got %s, Expected %s.",
+          ltype_name(a->cell[1]->type), ltype_name(LVAL_QEXPR));
+
+  if (a->cell[1]->type != LVAL_QEXPR) {
+    lval* f = lval_pop(a, 0);
+    return lval_seq_stage(e, lval_take(a, 0), LSTAGE_FILTER, f);
+  }
+
+  // リストの場合も、filter段一つのパイプラインとして一度に走査する。ここで消費するので、環境は写さない。
+  lval* f = lval_pop(a, 0);
+  lval* l = lval_seq_stage(NULL, lval_take(a, 0), LSTAGE_FILTER, f);
+  return builtin_collect(e, lval_add(lval_sexpr(), l));
+}
+
+// 組み込みfold。(fold f 初期値 列) 左畳み込み。
+// 範囲やパイプラインに対しては、要素を一つずつ流すので定数メモリで動く。
+lval* builtin_fold(lenv* e, lval* a) {
+  LASSERT_NUM("fold", a, 3);
+  LASSERT_TYPE("fold", a, 0, LVAL_FUN);
+  LASSERT(a, lval_is_seq(a->cell[2]), "Function 'fold' passed incorrect type for argument 2. Got %s, Expected %s.",
+          ltype_name(a->cell[2]->type), ltype_name(LVAL_QEXPR));
+
+  liter it;
+  liter_init(&it, e, lval_pop(a, 2));
+  lval* acc = lval_pop(a, 1);
+  lval* f = a->cell[0];
+  lval* v;
+  while ((v = liter_next(&it))) {
+    if (v->type == LVAL_ERR) { lval_del(acc); acc = v; break; }
+    acc = lval_apply(e, f, lval_add(lval_add(lval_sexpr(), acc), v));
+    if (acc->type == LVAL_ERR) { break; }
+  }
+
+  liter_del(&it);
+  lval_del(a);
+  return acc;
+}
+
+// take, dropの引数チェック。
+#define LASSERT_COUNT_SEQ(func, a)                                                  \
+  LASSERT_NUM(func, a, 2);                                                          \
+  LASSERT_TYPE(func, a, 0, LVAL_NUM);                                               \
+  LASSERT(a, (a->cell[0]->num >= 0), "Function '%s' passed negative count!", func); \
+  LASSERT(a, lval_is_seq(a->cell[1]) && a->cell[1]->type != LVAL_MAP,                               \
+          "Function '%s' passed incorrect type for argument 1. Got %s, Expected %s.",                \
+          func, ltype_name(a->cell[1]->type), ltype_name(LVAL_QEXPR));
+
+// 組み込みtake。(take n 列) 先頭n個。範囲は範囲のまま、パイプラインには段を積む。
+lval* builtin_take(lenv* e, lval* a) {
+  LASSERT_COUNT_SEQ("take", a);
+
+  long n = a->cell[0]->num;
+  if (a->cell[1]->type == LVAL_SEQ) {
+    lval* k = lval_pop(a, 0);
+    return lval_seq_stage(e, lval_take(a, 0), LSTAGE_TAKE, k);
+  }
+
+  lval* l = lval_take(a, 1);
+  if (l->type == LVAL_RANGE) {
+    if (n < lval_range_len(l)) { l->stop = lval_range_nth(l, n); }
+    return l;
+  }
+  if (l->type == LVAL_ARRAY) {
+    if (n < l->count) { lheap_resize(l, n - l->count); l->count = n; }
+    return l;
+  }
+  while (l->count > n) { lval_del(lval_pop(l, l->count-1)); }
+  return l;
+}
+
+// 組み込みdrop。(drop n 列) 先頭n個を除いた残り。範囲は範囲のまま、パイプラインには段を積む。
+lval* builtin_drop(lenv* e, lval* a) {
+  LASSERT_COUNT_SEQ("drop", a);
+
+  long n = a->cell[0]->num;
+  if (a->cell[1]->type == LVAL_SEQ) {
+    lval* k = lval_pop(a, 0);
+    return lval_seq_stage(e, lval_take(a, 0), LSTAGE_DROP, k);
+  }
+
+  lval* l = lval_take(a, 1);
+  if (l->type == LVAL_RANGE) {
+    // 全部落とすときは、最後の要素の次がlongに収まらないことがあるので終了値にする。
+    l->num = n < lval_range_len(l) ? lval_range_nth(l, n) : l->stop;
+    return l;
+  }
+  if (n > l->count) { n = l->count; }
+  if (l->type == LVAL_ARRAY) {
+    memmove(l->arr, l->arr + n, sizeof(long) * (l->count-n));
+    l->count -= n;
+    lheap_resize(l, -n);
+    return l;
+  }
+  for (long i = 0; i < n; i++) { lval_del(l->cell[i]); }
+  memmove(&l->cell[0], &l->cell[n], sizeof(lval*) * (l->count-n));
+  l->count -= n;
+  l->num = 0;
+  lheap_resize(l, -n);
+  return l;
+}
+
+// 組み込みlen。(len 列) 要素数。パイプラインは走査して数える。
+lval* builtin_len(lenv* e, lval* a) {
+  LASSERT_NUM("len", a, 1);
+  LASSERT(a, lval_is_seq(a->cell[0]), "Function 'len' passed incorrect type for argument 0. Got %s, Expected %s.",
+          ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+
+  lval* l = a->cell[0];
+  if (l->type != LVAL_SEQ) {
+    long n = (l->type == LVAL_RANGE) ? lval_range_len(l)
+      : (l->type == LVAL_MAP) ? l->map->count : l->count;
+    lval_del(a);
+    return lval_num(n);
+  }
+
+  liter it;
+  liter_init(&it, e, lval_pop(a, 0));
+  long n = 0;
+  lval* v;
+  lval* r = NULL;
+  while ((v = liter_next(&it))) {
+    if (v->type == LVAL_ERR) { r = v; break; }
+    lval_del(v);
+    n++;
+  }
+
+  liter_del(&it);
+  lval_del(a);
+  return r ? r : lval_num(n);
+}
+
+// 組み込みnth。(nth n 列) n番目の要素。
+lval* builtin_nth(lenv* e, lval* a) {
+  LASSERT_NUM("nth", a, 2);
+  LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+  LASSERT(a, lval_is_seq(a->cell[1]) && a->cell[1]->type != LVAL_MAP,
+          "Function 'nth' passed incorrect type for argument 1. Got %s, Expected %s.",
+          ltype_name(a->cell[1]->type), ltype_name(LVAL_QEXPR));
+
+  long n = a->cell[0]->num;
+  lval* l = a->cell[1];
+
+  // パイプラインはn番目まで走査する。
+  if (l->type == LVAL_SEQ) {
+    LASSERT(a, (n >= 0), "Function 'nth' index out of range. Got %li.", n);
+    liter it;
+    liter_init(&it, e, lval_pop(a, 1));
+    lval* v;
+    long i = 0;
+    while ((v = liter_next(&it)) && v->type != LVAL_ERR && i < n) { lval_del(v); i++; }
+    liter_del(&it);
+    lval_del(a);
+    return v ? v : lval_err("Function 'nth' index out of range. Got %li, Length %li.", n, i);
+  }
+
+  long len = (l->type == LVAL_RANGE) ? lval_range_len(l) : l->count;
+  LASSERT(a, (n >= 0 && n < len), "Function 'nth' index out of range. Got %li, Length %li.", n, len);
+
+  if (l->type == LVAL_RANGE || l->type == LVAL_ARRAY) {
+    lval* x = lval_num(l->type == LVAL_RANGE ? lval_range_nth(l, n) : l->arr[n]);
+    lval_del(a);
+    return x;
+  }
+  lval* x = lval_pop(l, n);
+  lval_del(a);
+  return x;
+}
+
+////////////////////////////////////////
+// 数値配列
+////////////////////////////////////////
+
+// 要素ごとの演算の種類。
+enum { LAOP_ADD, LAOP_SUB, LAOP_MUL, LAOP_DIV, LAOP_EQ, LAOP_LT, LAOP_GT, LAOP_LE, LAOP_GE };
+// 畳み込みの種類。
+enum { LARED_SUM, LARED_MIN, LARED_MAX, LARED_DOT };
+
+// 要素ごとの演算(スカラー版)。ysが0の場合、yは全要素に共通の1つの値。
+// 除算の0チェックは呼び出し側で済ませておくこと。
+void lakernel_binop_scalar(int op, long* r, const long* x, const long* y, long n, int ys) {
+  switch (op) {
+  case LAOP_ADD: for (long i = 0; i < n; i++) { r[i] = x[i] + y[i*ys]; } break;
+  case LAOP_SUB: for (long i = 0; i < n; i++) { r[i] = x[i] - y[i*ys]; } break;
+  case LAOP_MUL: for (long i = 0; i < n; i++) { r[i] = x[i] * y[i*ys]; } break;
+  case LAOP_DIV: for (long i = 0; i < n; i++) { r[i] = x[i] / y[i*ys]; } break;
+  case LAOP_EQ:  for (long i = 0; i < n; i++) { r[i] = x[i] == y[i*ys]; } break;
+  case LAOP_LT:  for (long i = 0; i < n; i++) { r[i] = x[i] <  y[i*ys]; } break;
+  case LAOP_GT:  for (long i = 0; i < n; i++) { r[i] = x[i] >  y[i*ys]; } break;
+  case LAOP_LE:  for (long i = 0; i < n; i++) { r[i] = x[i] <= y[i*ys]; } break;
+  case LAOP_GE:  for (long i = 0; i < n; i++) { r[i] = x[i] >= y[i*ys]; } break;
+  }
+}
+
+// 畳み込み(スカラー版)。空の配列は呼び出し側で弾いておくこと。
+long lakernel_reduce_scalar(int op, const long* x, const long* y, long n) {
+  long acc = (op == LARED_MIN || op == LARED_MAX) ? x[0] : 0;
+  switch (op) {
+  case LARED_SUM: for (long i = 0; i < n; i++) { acc += x[i]; } break;
+  case LARED_MIN: for (long i = 1; i < n; i++) { if (x[i] < acc) { acc = x[i]; } } break;
+  case LARED_MAX: for (long i = 1; i < n; i++) { if (x[i] > acc) { acc = x[i]; } } break;
+  case LARED_DOT: for (long i = 0; i < n; i++) { acc += x[i] * y[i]; } break;
+  }
+  return acc;
+}
+
+#ifdef LISPY_SIMD_X86
+
+// AVX2には64bit整数の乗算(下位64bit)がないので、32bitの乗算を組み合わせて求める。
+// (a_hi*2^32 + a_lo) * (b_hi*2^32 + b_lo) の下位64bit = a_lo*b_lo + ((a_hi*b_lo + a_lo*b_hi) << 32)
+__attribute__((target("avx2")))
+static inline __m256i lakernel_mul_epi64_avx2(__m256i a, __m256i b) {
+  __m256i lo = _mm256_mul_epu32(a, b);
+  __m256i ahi = _mm256_srli_epi64(a, 32);
+  __m256i bhi = _mm256_srli_epi64(b, 32);
+  __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(ahi, b), _mm256_mul_epu32(a, bhi));
+  return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+// 要素ごとの演算(AVX2版)。4要素ずつ処理し、端数はスカラー版に任せる。除算はスカラー版。
+__attribute__((target("avx2")))
+void lakernel_binop_avx2(int op, long* r, const long* x, const long* y, long n, int ys) {
+  if (op == LAOP_DIV) { lakernel_binop_scalar(op, r, x, y, n, ys); return; }
+
+  const __m256i one = _mm256_set1_epi64x(1);
+  __m256i vy = _mm256_set1_epi64x(y[0]);
+  long i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i vx = _mm256_loadu_si256((const __m256i*)(x + i));
+    if (ys) { vy = _mm256_loadu_si256((const __m256i*)(y + i)); }
+    __m256i v;
+    switch (op) {
+    case LAOP_ADD: v = _mm256_add_epi64(vx, vy); break;
+    case LAOP_SUB: v = _mm256_sub_epi64(vx, vy); break;
+    case LAOP_MUL: v = lakernel_mul_epi64_avx2(vx, vy); break;
+    // 比較結果は全ビット1なので、1との論理積で0/1にする。
+    case LAOP_EQ: v = _mm256_and_si256(_mm256_cmpeq_epi64(vx, vy), one); break;
+    case LAOP_GT: v = _mm256_and_si256(_mm256_cmpgt_epi64(vx, vy), one); break;
+    case LAOP_LT: v = _mm256_and_si256(_mm256_cmpgt_epi64(vy, vx), one); break;
+    case LAOP_LE: v = _mm256_andnot_si256(_mm256_cmpgt_epi64(vx, vy), one); break;
+    case LAOP_GE: v = _mm256_andnot_si256(_mm256_cmpgt_epi64(vy, vx), one); break;
+    default: v = vx; break;
+    }
+    _mm256_storeu_si256((__m256i*)(r + i), v);
+  }
+  lakernel_binop_scalar(op, r + i, x + i, ys ? y + i : y, n - i, ys);
+}
+
+// 畳み込み(AVX2版)。
+__attribute__((target("avx2")))
+long lakernel_reduce_avx2(int op, const long* x, const long* y, long n) {
+  if (n < 8) { return lakernel_reduce_scalar(op, x, y, n); }
+
+  __m256i acc = (op == LARED_MIN || op == LARED_MAX)
+    ? _mm256_loadu_si256((const __m256i*)x) : _mm256_setzero_si256();
+  long i = (op == LARED_MIN || op == LARED_MAX) ? 4 : 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i vx = _mm256_loadu_si256((const __m256i*)(x + i));
+    switch (op) {
+    case LARED_SUM: acc = _mm256_add_epi64(acc, vx); break;
+    case LARED_MIN: acc = _mm256_blendv_epi8(acc, vx, _mm256_cmpgt_epi64(acc, vx)); break;
+    case LARED_MAX: acc = _mm256_blendv_epi8(acc, vx, _mm256_cmpgt_epi64(vx, acc)); break;
+    case LARED_DOT: {
+      __m256i vy = _mm256_loadu_si256((const __m256i*)(y + i));
+      acc = _mm256_add_epi64(acc, lakernel_mul_epi64_avx2(vx, vy));
+      break;
+    }
+    }
+  }
+
+  // レーンの値と端数をまとめる。
+  long lanes[4];
+  _mm256_storeu_si256((__m256i*)lanes, acc);
+  long r = lakernel_reduce_scalar(op == LARED_DOT ? LARED_SUM : op, lanes, NULL, 4);
+  if (i < n) {
+    long rest = lakernel_reduce_scalar(op, x + i, y ? y + i : NULL, n - i);
+    switch (op) {
+    case LARED_SUM: case LARED_DOT: r += rest; break;
+    case LARED_MIN: if (rest < r) { r = rest; } break;
+    case LARED_MAX: if (rest > r) { r = rest; } break;
+    }
+  }
+  return r;
+}
+
+// 加算、減算(SSE2版)。SSE2はx86-64で必ず使えるので、AVX2がない場合にこちらを使う。
+void lakernel_binop_sse2(int op, long* r, const long* x, const long* y, long n, int ys) {
+  if (op != LAOP_ADD && op != LAOP_SUB) { lakernel_binop_scalar(op, r, x, y, n, ys); return; }
+
+  __m128i vy = _mm_set1_epi64x(y[0]);
+  long i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i vx = _mm_loadu_si128((const __m128i*)(x + i));
+    if (ys) { vy = _mm_loadu_si128((const __m128i*)(y + i)); }
+    __m128i v = (op == LAOP_ADD) ? _mm_add_epi64(vx, vy) : _mm_sub_epi64(vx, vy);
+    _mm_storeu_si128((__m128i*)(r + i), v);
+  }
+  lakernel_binop_scalar(op, r + i, x + i, ys ? y + i : y, n - i, ys);
+}
+
+// 実行中のCPUがAVX2を使えるかどうか。一度だけ調べる。
+int lakernel_has_avx2(void) {
+  static int has = -1;
+  int h = __atomic_load_n(&has, __ATOMIC_RELAXED);
+  if (h < 0) {
+    __builtin_cpu_init();
+    h = __builtin_cpu_supports("avx2") ? 1 : 0;
+    __atomic_store_n(&has, h, __ATOMIC_RELAXED);
+  }
+  return h;
+}
+
+#endif
+
+// 要素ごとの演算。使える命令セットに応じて実装を選ぶ。
+void lakernel_binop(int op, long* r, const long* x, const long* y, long n, int ys) {
+#ifdef LISPY_SIMD_X86
+  if (lakernel_has_avx2()) { lakernel_binop_avx2(op, r, x, y, n, ys); return; }
+  lakernel_binop_sse2(op, r, x, y, n, ys);
+#else
+  lakernel_binop_scalar(op, r, x, y, n, ys);
+#endif
+}
+
+// 畳み込み。使える命令セットに応じて実装を選ぶ。
+long lakernel_reduce(int op, const long* x, const long* y, long n) {
+#ifdef LISPY_SIMD_X86
+  if (lakernel_has_avx2()) { return lakernel_reduce_avx2(op, x, y, n); }
+#endif
+  return lakernel_reduce_scalar(op, x, y, n);
+}
+
+// 組み込みarray。(array 列) 数値のリストや範囲から数値配列を作る。
+lval* builtin_array(lenv* e, lval* a) {
+  LASSERT_NUM("array", a, 1);
+  lval* l = a->cell[0];
+  LASSERT(a, (l->type == LVAL_QEXPR || l->type == LVAL_RANGE || l->type == LVAL_ARRAY),
+          "Function 'array' passed incorrect type for argument 0. Got %s, Expected %s.",
+          ltype_name(l->type), ltype_name(LVAL_QEXPR));
+
+  if (l->type == LVAL_ARRAY) { return lval_take(a, 0); }
+
+  if (l->type == LVAL_RANGE) {
+    long n = lval_range_len(l);
+    lval* r = lval_array(n);
+    if (r->type == LVAL_ERR) { lval_del(a); return r; }
+    for (long i = 0; i < n; i++) { r->arr[i] = lval_range_nth(l, i); }
+    lval_del(a);
+    return r;
+  }
+
+  for (int i = 0; i < l->count; i++) {
+    LASSERT(a, (l->cell[i]->type == LVAL_NUM),
+            "Function 'array' passed non-number element. Got %s, Expected %s.",
+            ltype_name(l->cell[i]->type), ltype_name(LVAL_NUM));
+  }
+  lval* r = lval_array(l->count);
+  if (r->type == LVAL_ERR) { lval_del(a); return r; }
+  for (int i = 0; i < l->count; i++) { r->arr[i] = l->cell[i]->num; }
+  lval_del(a);
+  return r;
+}
+
+// 組み込みarray-list。(array-list 配列) 数値配列をリストに戻す。
+lval* builtin_array_list(lenv* e, lval* a) {
+  LASSERT_NUM("array-list", a, 1);
+  LASSERT_TYPE("array-list", a, 0, LVAL_ARRAY);
+
+  lval* x = a->cell[0];
+  lval* r = lval_qexpr();
+  r->count = x->count;
+  r->cell = malloc(sizeof(lval*) * x->count);
+  lheap_resize(r, r->count);
+  for (int i = 0; i < x->count; i++) { r->cell[i] = lval_num(x->arr[i]); }
+  lval_del(a);
+  return r;
+}
+
+// 配列同士、または配列と数値の要素ごとの演算。比較は0/1のマスク配列を返す。
+lval* builtin_aop(lenv* e, lval* a, char* func, int op) {
+  LASSERT_NUM(func, a, 2);
+  lval* x = a->cell[0];
+  lval* y = a->cell[1];
+  LASSERT(a, (x->type == LVAL_ARRAY), "Function '%s' passed incorrect type for argument 0. Got %s, Expected %s.",
+          func, ltype_name(x->type), ltype_name(LVAL_ARRAY));
+  LASSERT(a, (y->type == LVAL_ARRAY || y->type == LVAL_NUM),
+          "Function '%s' passed incorrect type for argument 1. Got %s, Expected %s.",
+          func, ltype_name(y->type), ltype_name(LVAL_ARRAY));
+  LASSERT(a, (y->type == LVAL_NUM || x->count == y->count),
+          "Function '%s' passed arrays of different length. Got %i and %i.", func, x->count, y->count);
+
+  // 数値の場合は全要素に同じ値を使う。
+  const long* yv = (y->type == LVAL_ARRAY) ? y->arr : &y->num;
+  int ys = (y->type == LVAL_ARRAY);
+  if (op == LAOP_DIV) {
+    for (long i = 0; i < (ys ? y->count : 1); i++) {
+      LASSERT(a, (yv[i] != 0), "Division By Zero!");
+    }
+  }
+
+  // 結果は第1引数の領域に上書きする。
+  lakernel_binop(op, x->arr, x->arr, yv, x->count, ys);
+  return lval_take(a, 0);
+}
+
+lval* builtin_aadd(lenv* e, lval* a) { return builtin_aop(e, a, "a+", LAOP_ADD); }
+lval* builtin_asub(lenv* e, lval* a) { return builtin_aop(e, a, "a-", LAOP_SUB); }
+lval* builtin_amul(lenv* e, lval* a) { return builtin_aop(e, a, "a*", LAOP_MUL); }
+lval* builtin_adiv(lenv* e, lval* a) { return builtin_aop(e, a, "a/", LAOP_DIV); }
+lval* builtin_aeq(lenv* e, lval* a) { return builtin_aop(e, a, "a==", LAOP_EQ); }
+lval* builtin_alt(lenv* e, lval* a) { return builtin_aop(e, a, "a<", LAOP_LT); }
+lval* builtin_agt(lenv* e, lval* a) { return builtin_aop(e, a, "a>", LAOP_GT); }
+lval* builtin_ale(lenv* e, lval* a) { return builtin_aop(e, a, "a<=", LAOP_LE); }
+lval* builtin_age(lenv* e, lval* a) { return builtin_aop(e, a, "a>=", LAOP_GE); }
+
+// 配列の畳み込み。dotは同じ長さの配列を2つ取る。
+lval* builtin_ared(lenv* e, lval* a, char* func, int op) {
+  int args = (op == LARED_DOT) ? 2 : 1;
+  LASSERT_NUM(func, a, args);
+  for (int i = 0; i < args; i++) {
+    LASSERT(a, (a->cell[i]->type == LVAL_ARRAY), "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.",
+            func, i, ltype_name(a->cell[i]->type), ltype_name(LVAL_ARRAY));
+  }
+  lval* x = a->cell[0];
+  lval* y = (op == LARED_DOT) ? a->cell[1] : NULL;
+  LASSERT(a, (!y || x->count == y->count),
+          "Function '%s' passed arrays of different length. Got %i and %i.", func, x->count, y ? y->count : 0);
+  LASSERT(a, (x->count > 0 || op == LARED_SUM || op == LARED_DOT), "Function '%s' passed empty array!", func);
+
+  long r = x->count ? lakernel_reduce(op, x->arr, y ? y->arr : NULL, x->count) : 0;
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval* builtin_asum(lenv* e, lval* a) { return builtin_ared(e, a, "asum", LARED_SUM); }
+lval* builtin_amin(lenv* e, lval* a) { return builtin_ared(e, a, "amin", LARED_MIN); }
+lval* builtin_amax(lenv* e, lval* a) { return builtin_ared(e, a, "amax", LARED_MAX); }
+lval* builtin_adot(lenv* e, lval* a) { return builtin_ared(e, a, "adot", LARED_DOT); }
+
+// 組み込みaslice。(aslice 配列 開始 終了) 開始から終了の手前までの部分配列。
+lval* builtin_aslice(lenv* e, lval* a) {
+  LASSERT_NUM("aslice", a, 3);
+  LASSERT_TYPE("aslice", a, 0, LVAL_ARRAY);
+  LASSERT_TYPE("aslice", a, 1, LVAL_NUM);
+  LASSERT_TYPE("aslice", a, 2, LVAL_NUM);
+
+  lval* x = a->cell[0];
+  long from = a->cell[1]->num;
+  long to = a->cell[2]->num;
+  LASSERT(a, (0 <= from && from <= to && to <= x->count),
+          "Function 'aslice' passed invalid bounds. Got %li to %li, Length %i.", from, to, x->count);
+
+  memmove(x->arr, x->arr + from, sizeof(long) * (to - from));
+  lheap_resize(x, (to - from) - x->count);
+  x->count = to - from;
+  return lval_take(a, 0);
+}
+
+////////////////////////////////////////
+// 辞書の組み込み関数
+////////////////////////////////////////
+
+// 辞書のキーとして使えるか確認する。
+#define LASSERT_KEY(func, a, i)                                                        \
+  LASSERT(a, lval_hashable(a->cell[i]),                                                \
+          "Function '%s' passed unhashable key. Got %s, Expected Number, String, Symbol or Q-Expression.", \
+          func, ltype_name(a->cell[i]->type))
+
+// 組み込みdict。(dict キー 値 キー 値 ...) 辞書の作成。
+lval* builtin_dict(lenv* e, lval* a) {
+  LASSERT(a, (a->count % 2 == 0), "Function 'dict' passed odd number of arguments. Got %i.", a->count);
+  for (int i = 0; i < a->count; i += 2) { LASSERT_KEY("dict", a, i); }
+
+  lval* m = lval_map();
+  while (a->count) {
+    lval* k = lval_pop(a, 0);
+    lmap_put(m->map, k, lval_pop(a, 0));
+  }
+  lval_del(a);
+  return m;
+}
+
+// 組み込みdict-set。(dict-set 辞書 キー 値) キーを登録した辞書を返す。
+lval* builtin_dict_set(lenv* e, lval* a) {
+  LASSERT_NUM("dict-set", a, 3);
+  LASSERT_TYPE("dict-set", a, 0, LVAL_MAP);
+  LASSERT_KEY("dict-set", a, 1);
+
+  lval* v = lval_pop(a, 2);
+  lval* k = lval_pop(a, 1);
+  lval* m = lval_take(a, 0);
+  lmap_put(m->map, k, v);
+  return m;
+}
+
+// 組み込みdict-get。(dict-get 辞書 キー [既定値]) キーに対応する値。
+// キーがなければ既定値、既定値もなければエラー。
+lval* builtin_dict_get(lenv* e, lval* a) {
+  LASSERT(a, (a->count == 2 || a->count == 3),
+          "Function 'dict-get' passed incorrect number of arguments. Got %i, Expected 2 or 3.", a->count);
+  LASSERT_TYPE("dict-get", a, 0, LVAL_MAP);
+  LASSERT_KEY("dict-get", a, 1);
+
+  lval* v = lmap_get(a->cell[0]->map, a->cell[1]);
+  if (v) {
+    v = lval_copy(v);
+  } else if (a->count == 3) {
+    v = lval_pop(a, 2);
+  } else {
+    v = lval_err("Function 'dict-get' key not found.");
+  }
+  lval_del(a);
+  return v;
+}
+
+// 組み込みdict-has。(dict-has 辞書 キー) キーが登録されているか。
+lval* builtin_dict_has(lenv* e, lval* a) {
+  LASSERT_NUM("dict-has", a, 2);
+  LASSERT_TYPE("dict-has", a, 0, LVAL_MAP);
+  LASSERT_KEY("dict-has", a, 1);
+
+  int r = lmap_get(a->cell[0]->map, a->cell[1]) != NULL;
+  lval_del(a);
+  return lval_num(r);
+}
+
+// 組み込みdict-del。(dict-del 辞書 キー) キーを取り除いた辞書を返す。
+lval* builtin_dict_del(lenv* e, lval* a) {
+  LASSERT_NUM("dict-del", a, 2);
+  LASSERT_TYPE("dict-del", a, 0, LVAL_MAP);
+  LASSERT_KEY("dict-del", a, 1);
+
+  lval* k = lval_pop(a, 1);
+  lval* m = lval_take(a, 0);
+  lmap_remove(m->map, k);
+  lval_del(k);
+  return m;
+}
+
+// 辞書のキーまたは値をリストにする。
+lval* builtin_dict_items(lenv* e, lval* a, char* func, int keys) {
+  LASSERT_NUM(func, a, 1);
+  LASSERT_TYPE(func, a, 0, LVAL_MAP);
+
+  lmap* m = a->cell[0]->map;
+  lval* r = lval_qexpr();
+  for (int i = 0; i < m->cap; i++) {
+    if (m->keys[i]) { lval_add(r, lval_copy(keys ? m->keys[i] : m->vals[i])); }
+  }
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_dict_keys(lenv* e, lval* a) { return builtin_dict_items(e, a, "dict-keys", 1); }
+lval* builtin_dict_vals(lenv* e, lval* a) { return builtin_dict_items(e, a, "dict-vals", 0); }
+
+////////////////////////////////////////
+// 並列処理
+////////////////////////////////////////
+
+// pmap, pfilter, preduceは、列をいくつかの塊に分けて固定数のワーカースレッドで評価する。
+// ワーカーは呼び出し元の環境を親とする自分専用の環境で評価し、結果は元の順序で組み立てる。
+// 全ての塊が終わるまで呼び出し元は先に進まないので、ワーカーから見た環境は読み取り専用になる。
+//
+// futureは式1つを仕事としてスケジューラに渡し、touchで値を待つ。呼び出し元は先に進むので、
+// futureは作成時点の環境の写しで評価する。
+// 仕事はワーカーごとの両端キューに積まれ、手の空いたスレッドは他のキューから盗んで実行する。
+
+// 並列処理の種類。
+enum { LPAR_MAP, LPAR_FILTER, LPAR_REDUCE };
+
+// スケジューラに渡す仕事。並列map等の塊やfutureはこれを先頭に持ち、runで実行される。
+typedef struct ltask {
+  void (*run)(struct ltask*);
+} ltask;
+
+// 仕事の両端キュー。持ち主は末尾に積んで末尾から取り(LIFO)、他のスレッドは先頭から盗む(FIFO)。
+// 分割統治では先頭側に大きな仕事が残るので、盗む側は一度に多くの仕事を持っていける。
+typedef struct {
+  ltask** buf; // 環状バッファ。大きさは2の冪。
+  long cap;
+  long top; // 先頭(盗まれる側)
+  long bottom; // 末尾(持ち主の側)
+  pthread_mutex_t lock;
+} ldeque;
+
+// ワーカー数の上限。
+#define LPOOL_MAX 256
+
+// ワーカースレッド。
+typedef struct {
+  lpool* pool;
+  int id; // 自分の両端キューの番号
+  pthread_t thread;
+} lworker;
+
+// インタプリタごとのワーカースレッドの集まり。
+struct lpool {
+  int n; // スレッド数
+  lworker* workers;
+  ldeque* deques; // ワーカーごとの両端キュー。n番目はワーカー以外のスレッドが共用する。
+  int pending; // キューに積まれている仕事の数
+  int sleeping; // 仕事を待って眠っているスレッドの数
+  int stop; // 終了の指示。残った仕事を片付けてからワーカーを終える。
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+};
+
+// 現在のスレッドがワーカーかどうか。
+static __thread int lpar_worker = 0;
+// 現在のスレッドがワーカーとして属するスレッドの集まりと、その中での番号。
+static __thread lpool* lsched_pool = NULL;
+static __thread int lsched_self = -1;
+// 現在のスレッドで実行中の仕事の深さと、一番内側の仕事を始めたときの自分のキューの末尾。
+static __thread int lsched_depth = 0;
+static __thread long lsched_mark = 0;
+
+int lpar_in_worker(void) { return lpar_worker; }
+
+void ldeque_push(ldeque* d, ltask* t) {
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom - d->top == d->cap) {
+    ltask** buf = malloc(sizeof(ltask*) * d->cap * 2);
+    for (long i = d->top; i < d->bottom; i++) { buf[i & (d->cap*2 - 1)] = d->buf[i & (d->cap - 1)]; }
+    free(d->buf);
+    d->buf = buf;
+    d->cap *= 2;
+  }
+  d->buf[d->bottom++ & (d->cap - 1)] = t;
+  pthread_mutex_unlock(&d->lock);
+}
+
+// 末尾から取り出す(持ち主用)。位置mark以降に積んだものだけを対象にする。
+ltask* ldeque_pop(ldeque* d, long mark) {
+  ltask* t = NULL;
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom > d->top && d->bottom > mark) { t = d->buf[--d->bottom & (d->cap - 1)]; }
+  pthread_mutex_unlock(&d->lock);
+  return t;
+}
+
+// 先頭から盗む(他のスレッド用)。
+ltask* ldeque_steal(ldeque* d) {
+  ltask* t = NULL;
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom > d->top) { t = d->buf[d->top++ & (d->cap - 1)]; }
+  pthread_mutex_unlock(&d->lock);
+  return t;
+}
+
+// 眠っているスレッドがあれば起こす。仕事を積んだときと、待たれている仕事が終わったときに呼ぶ。
+// 待つ側はsleepingを増やしてから条件を確かめるので、どちらかが必ず相手の変更を見る。
+void lsched_notify(lpool* p) {
+  if (__atomic_load_n(&p->sleeping, __ATOMIC_SEQ_CST) == 0) { return; }
+  pthread_mutex_lock(&p->lock);
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+}
+
+// 現在のスレッドが使う両端キューの番号。
+int lsched_index(lpool* p) { return lsched_pool == p ? lsched_self : p->n; }
+
+ldeque* lsched_own(lpool* p) { return &p->deques[lsched_index(p)]; }
+
+// 仕事を実行する。実行中の深さと、自分のキューのどこから先がこの仕事の子孫かを記録しておく。
+void lsched_run(lpool* p, ltask* t) {
+  int depth = lsched_depth;
+  long mark = lsched_mark;
+  lsched_depth++;
+  lsched_mark = lsched_own(p)->bottom;
+  t->run(t);
+  lsched_depth = depth;
+  lsched_mark = mark;
+}
+
+// 実行できる仕事を1つ取る。
+// 仕事の途中で待っている場合は、自分のキューにあるその仕事の子孫だけを対象にする。
+// 無関係な仕事を上に積むと、それが下で実行中のfutureを待って進まなくなることがあるため。
+// 仕事の外で待っている場合(アイドルなワーカーや、トップレベルの呼び出し元)は他のキューから盗む。
+ltask* lsched_take(lpool* p) {
+  int self = lsched_index(p);
+  ltask* t = ldeque_pop(&p->deques[self], lsched_mark);
+  for (int i = 1; !t && lsched_depth == 0 && i <= p->n; i++) {
+    t = ldeque_steal(&p->deques[(self + i) % (p->n + 1)]);
+  }
+  if (t) { __atomic_sub_fetch(&p->pending, 1, __ATOMIC_SEQ_CST); }
+  return t;
+}
+
+// done(arg)が真になるまで待つ。待つ間は眠らずに実行できる仕事を実行し、なくなったときだけ眠る。
+void lsched_wait(lpool* p, int (*done)(void*), void* arg) {
+  while (!done(arg)) {
+    ltask* t = lsched_take(p);
+    if (t) { lsched_run(p, t); continue; }
+
+    // 仕事の途中では他のキューの仕事は取らないので、積まれている仕事の数によらず眠る。
+    pthread_mutex_lock(&p->lock);
+    __atomic_add_fetch(&p->sleeping, 1, __ATOMIC_SEQ_CST);
+    if ((lsched_depth > 0 || __atomic_load_n(&p->pending, __ATOMIC_SEQ_CST) == 0) && !done(arg)) {
+      pthread_cond_wait(&p->wake, &p->lock);
+    }
+    __atomic_sub_fetch(&p->sleeping, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+// 終了が指示され、残った仕事もなくなったか。
+int lpool_stopped(void* p) {
+  return __atomic_load_n(&((lpool*)p)->stop, __ATOMIC_SEQ_CST) &&
+    __atomic_load_n(&((lpool*)p)->pending, __ATOMIC_SEQ_CST) == 0;
+}
+
+// ワーカースレッドの本体。終了が指示されるまで仕事を取っては実行する。
+void* lpool_main(void* arg) {
+  lworker* w = arg;
+  // 起動したスレッドの数が決まるまで待つ。
+  pthread_mutex_lock(&w->pool->lock);
+  pthread_mutex_unlock(&w->pool->lock);
+  lstats_register();
+  lpar_worker = 1;
+  lsched_pool = w->pool;
+  lsched_self = w->id;
+  lsched_wait(w->pool, lpool_stopped, w->pool);
+  return NULL;
+}
+
+// ワーカー数。環境変数LISPY_THREADSがあればそれを、なければCPUの数を使う。
+int lpool_size(void) {
+  char* s = getenv("LISPY_THREADS");
+  long n = s ? strtol(s, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1) { return 1; }
+  return n < LPOOL_MAX ? (int)n : LPOOL_MAX;
+}
+
+// インタプリタのワーカースレッドを起動する(初回のみ)。2回目以降はロックを取らない。
+lpool* lpool_get(lctx* c) {
+  lpool* p = __atomic_load_n(&c->pool, __ATOMIC_ACQUIRE);
+  if (p) { return p; }
+  pthread_mutex_lock(&c->lock);
+  if (!c->pool) {
+    size_t n = (size_t)lpool_size();
+    p = malloc(sizeof(lpool));
+    p->pending = p->sleeping = p->stop = 0;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    p->deques = malloc(sizeof(ldeque) * (n + 1));
+    for (size_t i = 0; i <= n; i++) {
+      p->deques[i].cap = 64;
+      p->deques[i].buf = malloc(sizeof(ltask*) * 64);
+      p->deques[i].top = p->deques[i].bottom = 0;
+      pthread_mutex_init(&p->deques[i].lock, NULL);
+    }
+    p->workers = malloc(sizeof(lworker) * n);
+    // 起動できたスレッドの数をスレッド数にする。ワーカーはp->lockを取ってから始めるので、決まったp->nを見る。
+    // 1つも起動できなければ、呼び出し元が自分のキューの仕事を実行する。
+    pthread_mutex_lock(&p->lock);
+    int k = 0;
+    while (k < (int)n) {
+      p->workers[k].pool = p;
+      p->workers[k].id = k;
+      if (pthread_create(&p->workers[k].thread, NULL, lpool_main, &p->workers[k]) != 0) { break; }
+      k++;
+    }
+    for (int i = k + 1; i <= (int)n; i++) {
+      free(p->deques[i].buf);
+      pthread_mutex_destroy(&p->deques[i].lock);
+    }
+    p->n = k;
+    pthread_mutex_unlock(&p->lock);
+    __atomic_store_n(&c->pool, p, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&c->lock);
+  return c->pool;
+}
+
+// ワーカースレッドを終了させて破棄する。キューに残った仕事は、終了前にワーカーが実行する。
+void lpool_del(lpool* p) {
+  __atomic_store_n(&p->stop, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&p->lock);
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+  for (int i = 0; i < p->n; i++) { pthread_join(p->workers[i].thread, NULL); }
+
+  for (int i = 0; i <= p->n; i++) {
+    free(p->deques[i].buf);
+    pthread_mutex_destroy(&p->deques[i].lock);
+  }
+  free(p->deques);
+  free(p->workers);
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->wake);
+  free(p);
+}
+
+// 仕事を現在のスレッドのキューに積む。
+void lsched_spawn(lpool* p, ltask* t) {
+  ldeque_push(lsched_own(p), t);
+  __atomic_add_fetch(&p->pending, 1, __ATOMIC_SEQ_CST);
+  lsched_notify(p);
+}
+
+struct lpar_job;
+
+// ワーカーに渡す仕事。要素の範囲[from, to)を一つのワーカーが処理する。
+typedef struct lpar_task {
+  ltask task;
+  struct lpar_job* job;
+  long from, to;
+} lpar_task;
+
+// 一回の並列呼び出し全体。
+typedef struct lpar_job {
+  lpool* pool;
+  int kind;
+  lenv* env; // 呼び出し元の環境
+  lval* f; // 適用する関数。ワーカー間で共有し、読むだけ。
+  lval** items; // 入力の要素
+  lval** out; // 結果。mapは各要素、filterは判定結果、reduceは塊ごとの畳み込み結果。
+  long left; // 終わっていない仕事の数
+  lquota* quota; // 呼び出し元の評価に課されている制限
+  lctx* ctx; // 呼び出し元が評価しているインタプリタ(lctx_cur)
+  unsigned loc; // 呼び出し元の式の位置。ワーカーで起きたエラーもこの位置を持つ。
+} lpar_job;
+
+// 1つの仕事を実行する。
+void lpar_run(ltask* task) {
+  lpar_task* t = (lpar_task*)task;
+  lpar_job* j = t->job;
+
+  // 呼び出し元のスレッドで順に処理する場合も、ワーカーと同じ制約で評価する。
+  int was_worker = lpar_worker;
+  lpar_worker = 1;
+  lquota* prev = lquota_cur;
+  lquota_cur = j->quota;
+  lctx* pc = lctx_cur;
+  lctx_cur = j->ctx;
+  unsigned loc = lsrc_cur;
+  lsrc_cur = j->loc;
+
+  // ワーカー専用の環境。=による束縛などはここに閉じる。
+  lenv* we = lenv_new();
+  we->par = j->env;
+
+  if (j->kind == LPAR_MAP || j->kind == LPAR_FILTER) {
+    for (long i = t->from; i < t->to; i++) {
+      lval* x = (j->kind == LPAR_MAP) ? j->items[i] : lval_copy(j->items[i]);
+      if (j->kind == LPAR_MAP) { j->items[i] = NULL; }
+      j->out[i] = lval_apply(we, j->f, lval_add(lval_sexpr(), x));
+    }
+  } else {
+    // 塊の先頭要素から畳み込む。
+    lval* acc = j->items[t->from];
+    j->items[t->from] = NULL;
+    for (long i = t->from + 1; i < t->to && acc->type != LVAL_ERR; i++) {
+      acc = lval_apply(we, j->f, lval_add(lval_add(lval_sexpr(), acc), j->items[i]));
+      j->items[i] = NULL;
+    }
+    j->out[t->from] = acc;
+  }
+
+  lenv_del(we);
+  lpar_worker = was_worker;
+  lquota_cur = prev;
+  lctx_cur = pc;
+  lsrc_cur = loc;
+
+  if (__atomic_sub_fetch(&j->left, 1, __ATOMIC_SEQ_CST) == 0) { lsched_notify(j->pool); }
+}
+
+int lpar_done(void* j) { return __atomic_load_n(&((lpar_job*)j)->left, __ATOMIC_SEQ_CST) == 0; }
+
+// 要素を塊に分けて並列に処理し、全て終わるまで待つ。
+// 待つ間は呼び出し元のスレッドも仕事を実行するので、ワーカーの中から入れ子で呼んでもよい。
+void lpar_exec(lpar_job* j, long n) {
+  if (n == 0) { return; }
+
+  lpool* p = j->pool;
+  long chunks = p->n <= 1 ? 1 : p->n * 4;
+  if (j->kind == LPAR_REDUCE && chunks > n) { chunks = n; }
+  long size = (n + chunks - 1) / chunks;
+  chunks = (n + size - 1) / size;
+
+  lpar_task* tasks = malloc(sizeof(lpar_task) * chunks);
+  j->left = chunks;
+  for (long c = 0; c < chunks; c++) {
+    tasks[c].task.run = lpar_run;
+    tasks[c].job = j;
+    tasks[c].from = c * size;
+    tasks[c].to = (c + 1) * size < n ? (c + 1) * size : n;
+  }
+
+  if (chunks == 1) {
+    lsched_run(p, &tasks[0].task);
+  } else {
+    for (long c = 0; c < chunks; c++) { lsched_spawn(p, &tasks[c].task); }
+    lsched_wait(p, lpar_done, j);
+  }
+  free(tasks);
+}
+
+// 列の全要素を配列に取り出す。範囲やパイプラインの評価はここで(呼び出し元のスレッドで)済ませる。
+lval* lpar_items(lenv* e, lval* l, lval*** items, long* n) {
+  liter it;
+  liter_init(&it, e, l);
+  long cap = 16;
+  *items = malloc(sizeof(lval*) * cap);
+  *n = 0;
+  lval* v;
+  while ((v = liter_next(&it))) {
+    if (v->type == LVAL_ERR) {
+      for (long i = 0; i < *n; i++) { lval_del((*items)[i]); }
+      free(*items);
+      liter_del(&it);
+      return v;
+    }
+    if (*n == cap) { cap *= 2; *items = realloc(*items, sizeof(lval*) * cap); }
+    (*items)[(*n)++] = v;
+  }
+  liter_del(&it);
+  return NULL;
+}
+
+// 並列版のmap, filter, reduceの共通部分。
+lval* builtin_par(lenv* e, lval* a, char* func, int kind) {
+  int args = (kind == LPAR_REDUCE) ? 3 : 2;
+  LASSERT_NUM(func, a, args);
+  LASSERT_TYPE(func, a, 0, LVAL_FUN);
+  LASSERT(a, lval_is_seq(a->cell[args-1]), "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.",
+          func, args-1, ltype_name(a->cell[args-1]->type), ltype_name(LVAL_QEXPR));
+
+  lpar_job j;
+  long n;
+  lval* err = lpar_items(e, lval_pop(a, args-1), &j.items, &n);
+  if (err) { lval_del(a); return err; }
+
+  j.pool = lpool_get(lenv_ctx(e));
+  j.kind = kind;
+  j.env = e;
+  j.f = a->cell[0];
+  j.out = calloc(n ? n : 1, sizeof(lval*));
+  j.quota = lquota_cur;
+  j.ctx = lctx_cur;
+  j.loc = lsrc_cur;
+  lpar_exec(&j, n);
+
+  // 結果を元の順序で組み立てる。エラーがあれば、先頭に近いものを返す。
+  lval* r = (kind == LPAR_REDUCE) ? lval_pop(a, 1) : lval_qexpr();
+  for (long i = 0; i < n; i++) {
+    lval* x = j.out[i];
+    if (!x) { continue; }
+    if (r->type == LVAL_ERR) {
+      lval_del(x);
+    } else if (x->type == LVAL_ERR) {
+      lval_del(r); r = x;
+    } else if (kind == LPAR_MAP) {
+      lval_add(r, x);
+    } else if (kind == LPAR_FILTER) {
+      if (x->type != LVAL_NUM) {
+        lval_del(r);
+        r = lval_err("Function 'pfilter' predicate returned incorrect type. Got %s, Expected %s.",
+                     ltype_name(x->type), ltype_name(LVAL_NUM));
+      } else if (x->num) {
+        lval_add(r, j.items[i]);
+        j.items[i] = NULL;
+      }
+      lval_del(x);
+    } else {
+      // 塊ごとの結果を初期値から順に畳み込む。
+      r = lval_apply(e, j.f, lval_add(lval_add(lval_sexpr(), r), x));
+    }
+  }
+
+  for (long i = 0; i < n; i++) {
+    if (j.items[i]) { lval_del(j.items[i]); }
+  }
+  free(j.items);
+  free(j.out);
+  lval_del(a);
+  return r;
+}
+
+// 組み込みpmap。(pmap f 列) 要素へのfの適用をワーカーで並列に行う。結果の順序は元の列と同じ。
+lval* builtin_pmap(lenv* e, lval* a) { return builtin_par(e, a, "pmap", LPAR_MAP); }
+// 組み込みpfilter。(pfilter f 列) 述語の評価をワーカーで並列に行う。
+lval* builtin_pfilter(lenv* e, lval* a) { return builtin_par(e, a, "pfilter", LPAR_FILTER); }
+// 組み込みpreduce。(preduce f 初期値 列) 塊ごとに並列に畳み込み、その結果を初期値から順に畳み込む。
+// 塊の分け方によらず同じ結果になるよう、fは結合的であること。
+lval* builtin_preduce(lenv* e, lval* a) { return builtin_par(e, a, "preduce", LPAR_REDUCE); }
+
+// futureの状態。
+enum { LFUT_PENDING, LFUT_RUNNING, LFUT_DONE };
+
+// future。そのlvalのコピー同士と、スケジューラのキューとで共有し、参照数で解放する。
+struct lfut {
+  ltask task;
+  lpool* pool; // 評価を任せたワーカーの集まり
+  int refs;
+  int state;
+  lenv* env; // 作成時点の環境の写し。評価が終わったら解放する。
+  lval* expr; // 評価する式(リスト)
+  lval* val; // 評価結果
+  lquota* quota; // 作成した評価に課されていた制限
+  lctx* ctx; // 作成した評価のインタプリタ(lctx_cur)
+};
+
+void lfut_retain(lfut* f) { lref_inc(&f->refs); }
+
+void lfut_release(lfut* f) {
+  if (lref_dec(&f->refs) > 0) { return; }
+  lenv_snapshot_del(f->env);
+  if (f->expr) { lval_del(f->expr); }
+  if (f->val) { lval_del(f->val); }
+  free(f);
+}
+
+int lfut_done(void* f) { return __atomic_load_n(&((lfut*)f)->state, __ATOMIC_SEQ_CST) == LFUT_DONE; }
+
+// まだ誰も評価していなければ、このスレッドで評価する。
+// キューから取り出されたときと、touchで待つ側が先に取りかかったときの両方から呼ばれる。
+void lfut_run(ltask* t) {
+  lfut* f = (lfut*)t;
+  int pending = LFUT_PENDING;
+  if (__atomic_compare_exchange_n(&f->state, &pending, LFUT_RUNNING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    int was_worker = lpar_worker;
+    lpar_worker = 1;
+    lquota* prev = lquota_cur;
+    lquota_cur = f->quota;
+    lctx* pc = lctx_cur;
+    lctx_cur = f->ctx;
+    unsigned loc = lsrc_cur;
+    lsrc_cur = f->expr->loc;
+    lenv* we = lenv_new();
+    we->par = f->env;
+    f->val = lval_eval_body(we, f->expr);
+    lenv_del(we);
+    lpar_worker = was_worker;
+    lquota_cur = prev;
+    lctx_cur = pc;
+    lsrc_cur = loc;
+
+    lenv_snapshot_del(f->env);
+    lval_del(f->expr);
+    f->env = NULL;
+    f->expr = NULL;
+    __atomic_store_n(&f->state, LFUT_DONE, __ATOMIC_SEQ_CST);
+    lsched_notify(f->pool);
+  }
+  lfut_release(f);
+}
+
+// 組み込みfuture。(future {式}) 式の評価をスケジューラに任せ、すぐにfutureを返す。
+// 式は作成時点の環境の写しで評価するので、その後のdefや=の影響を受けない。
+lval* builtin_future(lenv* e, lval* a) {
+  LASSERT_NUM("future", a, 1);
+  LASSERT_TYPE("future", a, 0, LVAL_QEXPR);
+
+  lfut* f = malloc(sizeof(lfut));
+  f->task.run = lfut_run;
+  f->pool = lpool_get(lenv_ctx(e));
+  f->refs = 2; // 返すlvalと、キューの分。
+  f->state = LFUT_PENDING;
+  f->env = lenv_snapshot(e);
+  f->expr = lval_take(a, 0);
+  f->val = NULL;
+  f->quota = lquota_cur;
+  f->ctx = lctx_cur;
+  lsched_spawn(f->pool, &f->task);
+  return lval_future(f);
+}
+
+// 組み込みtouch。(touch f) futureの値を返す。まだ評価されていなければこのスレッドで評価し、
+// 他のスレッドが評価中であれば、終わるまで実行できる仕事を手伝う。
+lval* builtin_touch(lenv* e, lval* a) {
+  LASSERT_NUM("touch", a, 1);
+  LASSERT_TYPE("touch", a, 0, LVAL_FUTURE);
+
+  lfut* f = a->cell[0]->fut;
+  lpool* p = f->pool;
+  if (__atomic_load_n(&f->state, __ATOMIC_SEQ_CST) == LFUT_PENDING) {
+    lfut_retain(f);
+    lsched_run(p, &f->task);
+  }
+  lsched_wait(p, lfut_done, f);
+
+  lval* r = lval_copy(f->val);
+  lval_del(a);
+  return r;
+}
+
+// 組み込みprint関数。
+lval* builtin_print(lenv* e, lval* a) {
+  // スペースを挟んで、全ての引数をプリント。
+  for (int i = 0; i < a->count; i++) {
+    lval_print(a->cell[i]); putchar(' ');
+  }
+
+  // 改行し引数を削除。
   putchar('\n');
   lval_del(a);
 
@@ -948,14 +5172,244 @@ lval* builtin_error(lenv* e, lval* a) {
   return err;
 }
 
-// 組み込み関数を環境に束縛。
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+// 組み込みprofile。(profile {式}) または (profile {式} "ファイル")
+// 式をプロファイルしながら評価してその値を返し、関数ごとの割合を標準エラー出力に表示する。
+// ファイルを指定すると、フレームグラフ用の折り畳んだスタックをそこに書く。
+lval* builtin_profile(lenv* e, lval* a) {
+  LASSERT(a, (a->count == 1 || a->count == 2),
+          "Function 'profile' passed incorrect number of arguments. Got %i, Expected 1 or 2.", a->count);
+  LASSERT_TYPE("profile", a, 0, LVAL_QEXPR);
+  if (a->count == 2) { LASSERT_TYPE("profile", a, 1, LVAL_STR); }
+  LASSERT(a, lprof_start(), "Function 'profile' cannot be used while another profile is running.");
+
+  lval* x = lval_eval_body(e, a->cell[0]);
+  if (!lprof_finish(stderr, a->count == 2 ? a->cell[1]->str : NULL)) {
+    lval_del(x);
+    x = lval_err("Function 'profile' could not write '%s'.", a->cell[1]->str);
+  }
+  lval_del(a);
+  return x;
+}
+
+// 組み込みstats。(stats) 実行時の統計の全スレッドの合計を{名前 値}のリストで返す。
+// allocとfreeは{型名 数}のリストで、型ごとの確保数と解放数。
+lval* builtin_stats(lenv* e, lval* a) {
+  LASSERT_NUM("stats", a, 0);
+  lval_del(a);
+  lstats t;
+  lstats_total(&t);
+
+  lval* r = lval_qexpr();
+  for (int i = 0; i < LSTAT_ALLOC; i++) {
+    lval_add(r, lval_add(lval_add(lval_qexpr(), lval_sym(lstat_names[i])), lval_num(t.n[i])));
+  }
+  lval* alloc = lval_qexpr();
+  lval* freed = lval_qexpr();
+  for (int i = 0; i < LVAL_NTYPES; i++) {
+    lval_add(alloc, lval_add(lval_add(lval_qexpr(), lval_sym(ltype_name(i))), lval_num(t.n[LSTAT_ALLOC + i])));
+    lval_add(freed, lval_add(lval_add(lval_qexpr(), lval_sym(ltype_name(i))), lval_num(t.n[LSTAT_FREE + i])));
+  }
+  lval_add(r, lval_add(lval_add(lval_qexpr(), lval_sym("alloc")), alloc));
+  lval_add(r, lval_add(lval_add(lval_qexpr(), lval_sym("free")), freed));
+  return r;
+}
+
+// 現在のスレッドのハードウェアカウンタ。開けなかったものは-1。
+#define LPERF_N 3
+
+static char* lperf_names[LPERF_N] = { "cycles", "instructions", "cache-misses" };
+
+// カウンタを開いて数え始める。使えなければ0。
+int lperf_start(int* fd) {
+  for (int i = 0; i < LPERF_N; i++) { fd[i] = -1; }
+#ifdef LISPY_PERF
+  static const unsigned long configs[LPERF_N] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+  };
+  int ok = 0;
+  for (int i = 0; i < LPERF_N; i++) {
+    struct perf_event_attr a;
+    memset(&a, 0, sizeof(a));
+    a.type = PERF_TYPE_HARDWARE;
+    a.size = sizeof(a);
+    a.config = configs[i];
+    a.exclude_kernel = 1;
+    a.exclude_hv = 1;
+    fd[i] = syscall(SYS_perf_event_open, &a, 0, -1, -1, 0);
+    if (fd[i] >= 0) { ioctl(fd[i], PERF_EVENT_IOC_RESET, 0); ok = 1; }
+  }
+  return ok;
+#else
+  return 0;
+#endif
+}
+
+// カウンタの値を読んで閉じる。
+void lperf_stop(int* fd, long* val) {
+  for (int i = 0; i < LPERF_N; i++) {
+    long long v = -1;
+    if (fd[i] >= 0) {
+      if (read(fd[i], &v, sizeof(v)) != sizeof(v)) { v = -1; }
+      close(fd[i]);
+    }
+    val[i] = v;
+  }
+}
+
+long ltime_nsec(clockid_t clock) {
+  struct timespec t;
+  clock_gettime(clock, &t);
+  return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+lval* lpair(char* name, long x) { return lval_add(lval_add(lval_qexpr(), lval_sym(name)), lval_num(x)); }
+
+// 組み込みtime。(time {式}) 式を評価し、{値 {{wall-ns 経過時間} {cpu-ns CPU時間} ...}}を返す。
+// CPU時間と確保、コピーの数はプロセス全体の差分なので、並列処理のワーカーの分も含む。
+// ハードウェアカウンタ(cycles, instructions, cache-misses)は使える場合だけ、評価したスレッドの分を加える。
+lval* builtin_time(lenv* e, lval* a) {
+  LASSERT_NUM("time", a, 1);
+  LASSERT_TYPE("time", a, 0, LVAL_QEXPR);
+
+  lstats s0, s1;
+  int fd[LPERF_N];
+  long hw[LPERF_N];
+  lstats_total(&s0);
+  int perf = lperf_start(fd);
+  long wall = ltime_nsec(CLOCK_MONOTONIC);
+  long cpu = ltime_nsec(CLOCK_PROCESS_CPUTIME_ID);
+
+  lval* x = lval_eval_body(e, a->cell[0]);
+
+  cpu = ltime_nsec(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+  wall = ltime_nsec(CLOCK_MONOTONIC) - wall;
+  lperf_stop(fd, hw);
+  lstats_total(&s1);
+  lval_del(a);
+  if (x->type == LVAL_ERR) { return x; }
+
+  long alloc = 0;
+  for (int i = 0; i < LVAL_NTYPES; i++) { alloc += s1.n[LSTAT_ALLOC + i] - s0.n[LSTAT_ALLOC + i]; }
+  lval* r = lval_qexpr();
+  lval_add(r, lpair("wall-ns", wall));
+  lval_add(r, lpair("cpu-ns", cpu));
+  lval_add(r, lpair("alloc", alloc));
+  lval_add(r, lpair("copy", s1.n[LSTAT_COPY] - s0.n[LSTAT_COPY]));
+  lval_add(r, lpair("copy-bytes", s1.n[LSTAT_COPY_BYTES] - s0.n[LSTAT_COPY_BYTES]));
+  for (int i = 0; perf && i < LPERF_N; i++) {
+    if (hw[i] >= 0) { lval_add(r, lpair(lperf_names[i], hw[i])); }
+  }
+  return lval_add(lval_add(lval_qexpr(), x), r);
+}
+
+// 組み込みheap。(heap) ヒーププロファイル中に、生きているオブジェクトを確保した関数ごとに
+// {関数名 バイト数 オブジェクト数}のリストで返す。多い順。
+lval* builtin_heap(lenv* e, lval* a) {
+  LASSERT_NUM("heap", a, 0);
+  LASSERT(a, lheap_enabled(), "Function 'heap' requires the heap profiler (--heap-profile).");
+  lval_del(a);
+
+  long n;
+  lname** sites = lheap_sites(&n);
+  lval* r = lval_qexpr();
+  for (long i = 0; i < n; i++) {
+    long c = 0;
+    for (int k = 0; k < LHEAP_KINDS; k++) { c += __atomic_load_n(&sites[i]->heap.count[k], __ATOMIC_RELAXED); }
+    lval* x = lval_add(lval_qexpr(), lval_sym(sites[i]->str));
+    lval_add(x, lval_num(__atomic_load_n(&sites[i]->heap.bytes, __ATOMIC_RELAXED)));
+    lval_add(r, lval_add(x, lval_num(c)));
+  }
+  free(sites);
+  return r;
+}
+
+// 組み込みmemo。(memo 関数 [上限]) 引数ごとの結果を覚える関数を返す。上限は覚えておく結果の数。
+// 再帰呼び出しにも効くように、(def {fib} (memo fib))のように同じ名前に束縛し直して使う。
+lval* builtin_memo(lenv* e, lval* a) {
+  LASSERT(a, (a->count == 1 || a->count == 2),
+          "Function 'memo' passed incorrect number of arguments. Got %i, Expected 1 or 2.", a->count);
+  LASSERT_TYPE("memo", a, 0, LVAL_FUN);
+  LASSERT(a, !a->cell[0]->builtin, "Function 'memo' cannot memoize a builtin function.");
+  long cap = LMEMO_CAP;
+  if (a->count == 2) {
+    LASSERT_TYPE("memo", a, 1, LVAL_NUM);
+    cap = a->cell[1]->num;
+    LASSERT(a, cap > 0, "Function 'memo' passed non-positive capacity %li.", cap);
+  }
+
+  lval* f = lval_pop(a, 0);
+  lval_del(a);
+  // メモ化した関数をもう一度memoに渡したら、新しい表で覚え直す。
+  if (f->memo) { lmemo_release(f->memo); }
+  f->memo = lmemo_new(cap);
+  return f;
+}
+
+// 組み込みmemo-stats。(memo-stats 関数) memoで作った関数の表の状態を{名前 値}のリストで返す。
+lval* builtin_memo_stats(lenv* e, lval* a) {
+  LASSERT_NUM("memo-stats", a, 1);
+  LASSERT_TYPE("memo-stats", a, 0, LVAL_FUN);
+  lmemo* m = a->cell[0]->memo;
+  LASSERT(a, m, "Function 'memo-stats' passed a function not made by 'memo'.");
+
+  pthread_mutex_lock(&m->lock);
+  lval* r = lval_qexpr();
+  lval_add(r, lpair("hits", m->hits));
+  lval_add(r, lpair("misses", m->misses));
+  lval_add(r, lpair("evictions", m->evictions));
+  lval_add(r, lpair("size", m->count));
+  lval_add(r, lpair("capacity", m->cap));
+  pthread_mutex_unlock(&m->lock);
+  lval_del(a);
+  return r;
+}
+
+// 組み込みhashcons。(hashcons) ハッシュコンスの表の状態を{名前 値}のリストで返す。
+// nodesは共有の値の数、bytesはその大きさ、hitsは登録済みの値にまとめた回数。
+lval* builtin_hashcons(lenv* e, lval* a) {
+  LASSERT_NUM("hashcons", a, 0);
+  LASSERT(a, lhcons_enabled(), "Function 'hashcons' requires hash-consing (--hashcons).");
+  lval_del(a);
+
+  pthread_mutex_lock(&lhcons_lock);
+  lval* r = lval_qexpr();
+  lval_add(r, lpair("nodes", lhcons_count));
+  lval_add(r, lpair("bytes", lhcons_bytes));
+  lval_add(r, lpair("hits", lhcons_hits));
+  pthread_mutex_unlock(&lhcons_lock);
+  return r;
+}
+
+// 組み込みjit。(jit) JITコンパイラの状態を{名前 値}のリストで返す。
+// functionsはコンパイルした関数の数、bytesは機械語の大きさ、deoptsはインタプリタで評価し直した回数。
+lval* builtin_jit(lenv* e, lval* a) {
+  LASSERT_NUM("jit", a, 0);
+  LASSERT(a, ljit_enabled(), "Function 'jit' requires the JIT compiler (--jit on x86-64).");
+  lval_del(a);
+
+  pthread_mutex_lock(&ljit_lock);
+  lval* r = lval_qexpr();
+  lval_add(r, lpair("functions", ljit_functions));
+  lval_add(r, lpair("bytes", ljit_bytes));
+  lval_add(r, lpair("deopts", __atomic_load_n(&ljit_deopts, __ATOMIC_RELAXED)));
+  pthread_mutex_unlock(&ljit_lock);
+  return r;
+}
+
+// 組み込み関数を環境に束縛。nullaryなら、要素が1つのS式でも引数なしで呼び出す。
+void lenv_bind_builtin(lenv* e, char* name, lbuiltin func, int nullary) {
+  lfold_define(e, name);
   lval* k = lval_sym(name);
   lval* v = lval_fun(func);
+  v->name = lname_intern(name);
+  v->num = nullary;
   lenv_put(e, k, v);
   lval_del(k); lval_del(v);
 }
 
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) { lenv_bind_builtin(e, name, func, 0); }
+void lenv_add_nullary(lenv* e, char* name, lbuiltin func) { lenv_bind_builtin(e, name, func, 1); }
+
 // 組み込み関数を初期化。
 void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "list", builtin_list);
@@ -985,6 +5439,62 @@ void lenv_add_builtins(lenv* e) {
 
   lenv_add_builtin(e, "if",  builtin_if);
 
+  lenv_add_builtin(e, "while",    builtin_while);
+  lenv_add_builtin(e, "dotimes",  builtin_dotimes);
+  lenv_add_builtin(e, "for-each", builtin_for_each);
+
+  lenv_add_builtin(e, "range",  builtin_range);
+  lenv_add_builtin(e, "seq",     builtin_seq);
+  lenv_add_builtin(e, "collect", builtin_collect);
+  lenv_add_builtin(e, "map",    builtin_map);
+  lenv_add_builtin(e, "filter", builtin_filter);
+  lenv_add_builtin(e, "fold",   builtin_fold);
+  lenv_add_builtin(e, "take",   builtin_take);
+  lenv_add_builtin(e, "drop",   builtin_drop);
+  lenv_add_builtin(e, "len",    builtin_len);
+  lenv_add_builtin(e, "nth",    builtin_nth);
+
+  lenv_add_builtin(e, "array",      builtin_array);
+  lenv_add_builtin(e, "array-list", builtin_array_list);
+  lenv_add_builtin(e, "a+",   builtin_aadd);
+  lenv_add_builtin(e, "a-",   builtin_asub);
+  lenv_add_builtin(e, "a*",   builtin_amul);
+  lenv_add_builtin(e, "a/",   builtin_adiv);
+  lenv_add_builtin(e, "a==",  builtin_aeq);
+  lenv_add_builtin(e, "a<",   builtin_alt);
+  lenv_add_builtin(e, "a>",   builtin_agt);
+  lenv_add_builtin(e, "a<=",  builtin_ale);
+  lenv_add_builtin(e, "a>=",  builtin_age);
+  lenv_add_builtin(e, "asum", builtin_asum);
+  lenv_add_builtin(e, "amin", builtin_amin);
+  lenv_add_builtin(e, "amax", builtin_amax);
+  lenv_add_builtin(e, "adot", builtin_adot);
+  lenv_add_builtin(e, "aslice", builtin_aslice);
+
+  lenv_add_nullary(e, "dict",      builtin_dict);
+  lenv_add_builtin(e, "dict-set",  builtin_dict_set);
+  lenv_add_builtin(e, "dict-get",  builtin_dict_get);
+  lenv_add_builtin(e, "dict-has",  builtin_dict_has);
+  lenv_add_builtin(e, "dict-del",  builtin_dict_del);
+  lenv_add_builtin(e, "dict-keys", builtin_dict_keys);
+  lenv_add_builtin(e, "dict-vals", builtin_dict_vals);
+
+  lenv_add_builtin(e, "pmap",    builtin_pmap);
+  lenv_add_builtin(e, "pfilter", builtin_pfilter);
+  lenv_add_builtin(e, "preduce", builtin_preduce);
+  lenv_add_builtin(e, "future",  builtin_future);
+  lenv_add_builtin(e, "touch",   builtin_touch);
+
+  lenv_add_builtin(e, "profile", builtin_profile);
+  lenv_add_nullary(e, "stats",   builtin_stats);
+  lenv_add_builtin(e, "time",    builtin_time);
+  lenv_add_nullary(e, "heap",    builtin_heap);
+
+  lenv_add_builtin(e, "memo",       builtin_memo);
+  lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
+  lenv_add_nullary(e, "hashcons",   builtin_hashcons);
+  lenv_add_nullary(e, "jit",        builtin_jit);
+
   lenv_add_builtin(e, "load",  builtin_load);
   lenv_add_builtin(e, "print", builtin_print);
   lenv_add_builtin(e, "error", builtin_error);
@@ -996,18 +5506,42 @@ lval* load_library(lenv* e) {
 }
 
 ////////////////////////////////////////
-// main
+// インタプリタ
 ////////////////////////////////////////
 
-int main(int argc, char** argv) {
-  Comment = mpc_new("comment");
-  Number =  mpc_new("number");
-  String =  mpc_new("string");
-  Symbol =  mpc_new("symbol");
-  Sexpr  =  mpc_new("sexpr");
-  Qexpr  =  mpc_new("qexpr");
-  Expr   =  mpc_new("expr");
-  Lispy  =  mpc_new("lispy");
+// パーサーを用意し、envをグローバル環境とするインタプリタを作る。
+// baseがあればそのパーサーを共有し、なければ文法から作る。
+lctx* lctx_make(lenv* env, lctx* base) {
+  lstats_register();
+  lctx* c = malloc(sizeof(lctx));
+  c->base = base;
+  c->env = env;
+  c->env->ctx = c;
+  c->under = NULL;
+  c->pool = NULL;
+  c->fold = NULL;
+  pthread_mutex_init(&c->lock, NULL);
+  memset(&c->quota, 0, sizeof(lquota));
+  if (base) {
+    c->Comment = base->Comment;
+    c->Number = base->Number;
+    c->String = base->String;
+    c->Symbol = base->Symbol;
+    c->Sexpr = base->Sexpr;
+    c->Qexpr = base->Qexpr;
+    c->Expr = base->Expr;
+    c->Lispy = base->Lispy;
+    return c;
+  }
+
+  c->Comment = mpc_new("comment");
+  c->Number =  mpc_new("number");
+  c->String =  mpc_new("string");
+  c->Symbol =  mpc_new("symbol");
+  c->Sexpr  =  mpc_new("sexpr");
+  c->Qexpr  =  mpc_new("qexpr");
+  c->Expr   =  mpc_new("expr");
+  c->Lispy  =  mpc_new("lispy");
 
   // 字句解析の規則を設定。
   // 文字列はダブルクォートに囲まれた、バックスラッシュ+1文字、もしくはダブルクォート以外の全ての文字。
@@ -1023,17 +5557,379 @@ expr     : <comment> | <number> | <string>                              \
            | <symbol> | <sexpr> | <qexpr> ;                             \
 lispy    : /^/ <expr>* /$/ ;                                            \
 ",
-            Comment, Number, String, Symbol, Sexpr, Qexpr, Expr, Lispy);
+            c->Comment, c->Number, c->String, c->Symbol, c->Sexpr, c->Qexpr, c->Expr, c->Lispy);
+  return c;
+}
+
+// インタプリタの作成。グローバル環境を確保し、組み込み関数をロードする。
+lctx* lctx_new(void) {
+  // 定数の畳み込みが元の式を登録する表。
+  lhcons_init();
+  lctx* c = lctx_make(lenv_new(), NULL);
+  lenv_add_builtins(c->env);
+  lquota_set(c, lquota_getenv("LISPY_MAX_STEPS"), lquota_getenv("LISPY_MAX_DEPTH"), lquota_getenv("LISPY_MAX_BYTES"));
+  // 環境変数LISPY_HASHCONSが0以外なら、ハッシュコンスを有効にする(プロセス全体で共有)。
+  char* hc = getenv("LISPY_HASHCONS");
+  if (hc && strcmp(hc, "0") != 0) { lhcons_start(); }
+  // 環境変数LISPY_JITが0以外なら、JITコンパイラを有効にする(プロセス全体)。
+  char* jit = getenv("LISPY_JIT");
+  if (jit && strcmp(jit, "0") != 0) { ljit_start(); }
+  return c;
+}
+
+// 凍結したインタプリタbaseのグローバル環境の上に重ねたインタプリタ。
+// 変数表とパーサーを共有するので、baseのグローバル環境の大きさによらず定数時間で作れる。
+// baseは書き換えられないので、重ねたインタプリタは別々のスレッドからロックなしで使える。
+lctx* lctx_new_layer(lctx* base) {
+  // 土台が重ねたものでも、パーサーの持ち主を直接参照する。
+  lctx* c = lctx_make(lenv_copy(base->env), base->base ? base->base : base);
+  c->under = base;
+  lquota_set(c, base->quota.max_steps, base->quota.max_depth, base->quota.max_bytes);
+  return c;
+}
+
+// インタプリタの破棄。ワーカーを終了させてから、グローバル環境と自分で持つパーサーを解放する。
+void lctx_del(lctx* c) {
+  if (c->pool) { lpool_del(c->pool); }
+  // 残った置き換えた値が、このインタプリタで置き換え直さないようにする。
+  if (c->fold) { __atomic_store_n(&c->fold->ctx, NULL, __ATOMIC_RELEASE); }
+  lenv_del(c->env);
+  // 読み込んだ式の位置。
+  lsrc_drop(c);
+  if (!c->base) { mpc_cleanup(8, c->Comment, c->Number, c->String, c->Symbol, c->Sexpr, c->Qexpr, c->Expr, c->Lispy); }
+  pthread_mutex_destroy(&c->lock);
+  // 畳み込みの状態は、置き換えた値が残っていればその最後の記録と一緒に解放する。
+  if (c->fold) { lfold_state_release(c->fold); }
+  free(c);
+}
+
+////////////////////////////////////////
+// C API(lispy.h)
+////////////////////////////////////////
+
+// 式を順に評価し、最後の値を返す。exprは消費する。制限は全体で1回の評価として数える。
+lval* lval_eval_all(lenv* e, lval* expr) {
+  lctx* c = lenv_ctx(e);
+  lquota* prev = lquota_begin(c);
+  lctx* pc = lctx_cur;
+  lctx_cur = c;
+  lval* x = lval_sexpr();
+  while (expr->count) {
+    lval_del(x);
+    x = lval_eval(e, lval_pop(expr, 0));
+  }
+  lctx_cur = pc;
+  lquota_end(prev);
+  lval_del(expr);
+  return x;
+}
+
+// パース結果を環境eで評価する。パースに失敗していればエラーを返す。fileはlval_readに渡す。
+lval* lctx_eval_result(lenv* e, int ok, mpc_result_t* r, char* file) {
+  if (!ok) {
+    char* err_msg = mpc_err_string(r->error);
+    mpc_err_delete(r->error);
+    lval* err = lval_err("%s", err_msg);
+    free(err_msg);
+    return err;
+  }
+  lval* expr = lval_read(lenv_ctx(e), r->output, file);
+  mpc_ast_delete(r->output);
+  return lval_eval_all(e, expr);
+}
+
+lispy_t* lispy_new(void) { return lctx_new(); }
+void lispy_free(lispy_t* L) { lctx_del(L); }
+
+lispy_value* lispy_eval_string(lispy_t* L, const char* src) { return lispy_eval_string_in(L, L->env, src); }
+
+lispy_value* lispy_eval_string_in(lispy_t* L, lispy_env* env, const char* src) {
+  mpc_result_t r;
+  int ok = mpc_parse("<string>", src, L->Lispy, &r);
+  return lctx_eval_result(env, ok, &r, NULL);
+}
+
+lispy_value* lispy_eval_string_at(lispy_t* L, const char* src, const char* file, int line, int col) {
+  mpc_result_t r;
+  if (!mpc_parse(file, src, L->Lispy, &r)) { return lctx_eval_result(L->env, 0, &r, NULL); }
+  lval* expr = lval_read_at(L, r.output, lname_intern((char*)file)->str, line, col);
+  mpc_ast_delete(r.output);
+  // loadと同じく、式ごとに位置を設定して評価する。
+  lval* x = lval_sexpr();
+  while (expr->count) {
+    lval_del(x);
+    x = lquota_eval(L->env, lval_pop(expr, 0));
+  }
+  lval_del(expr);
+  return x;
+}
+
+lispy_value* lispy_eval_file(lispy_t* L, const char* path) {
+  mpc_result_t r;
+  int ok = mpc_parse_contents(path, L->Lispy, &r);
+  return lctx_eval_result(L->env, ok, &r, lname_intern((char*)path)->str);
+}
+
+lispy_value* lispy_read_file(lispy_t* L, const char* path) {
+  mpc_result_t r;
+  if (!mpc_parse_contents(path, L->Lispy, &r)) {
+    char* err_msg = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+    lval* err = lval_err("%s", err_msg);
+    free(err_msg);
+    return err;
+  }
+  lval* x = lval_read(L, r.output, lname_intern((char*)path)->str);
+  mpc_ast_delete(r.output);
+  return x;
+}
+
+// グローバル環境の写し。変数表を共有するので、グローバル環境の大きさによらず定数時間で作れる。
+lispy_env* lispy_env_new(lispy_t* L) { return lenv_copy(L->env); }
+void lispy_env_free(lispy_env* env) { lenv_del(env); }
+
+void lispy_freeze(lispy_t* L) { lenv_freeze(L->env); }
+
+void lispy_set_limits(lispy_t* L, long steps, long depth, long bytes) { lquota_set(L, steps, depth, bytes); }
+
+lispy_t* lispy_new_layer(lispy_t* base) {
+  if (!base->env->frozen) { return NULL; }
+  return lctx_new_layer(base);
+}
+
+void lispy_register(lispy_t* L, const char* name, lispy_builtin fn) {
+  lenv_add_builtin(L->env, (char*)name, fn);
+}
+
+void lispy_register_nullary(lispy_t* L, const char* name, lispy_builtin fn) {
+  lenv_add_nullary(L->env, (char*)name, fn);
+}
 
-  // グローバル環境を確保。
-  lenv* e = lenv_new();
-  // 組み込み関数をグローバル環境にロード。
-  lenv_add_builtins(e);
-  // ライブラリをロード。
+lispy_value* lispy_get(lispy_t* L, const char* name) {
+  lval* k = lval_sym((char*)name);
+  lval* v = lenv_get(L->env, k);
+  lval_del(k);
+  return v;
+}
+
+lispy_value* lispy_call(lispy_t* L, lispy_value* fn, lispy_value* args) {
+  if (fn->type != LVAL_FUN) {
+    lval_del(args);
+    return lval_err("Cannot call %s.", ltype_name(fn->type));
+  }
+  args->type = LVAL_SEXPR;
+  lquota* prev = lquota_begin(L);
+  lctx* pc = lctx_cur;
+  lctx_cur = L;
+  lval* r = lval_apply(L->env, fn, args);
+  lctx_cur = pc;
+  lquota_end(prev);
+  return r;
+}
+
+lispy_value* lispy_apply(lispy_env* env, const lispy_value* fn, lispy_value* args) {
+  if (fn->type != LVAL_FUN) {
+    lval_del(args);
+    return lval_err("S-Expression starts with incorrect type. Got %s, Expected %s.",
+                    ltype_name(fn->type), ltype_name(LVAL_FUN));
+  }
+  args->type = LVAL_SEXPR;
+  return lval_apply(env, (lval*)fn, args);
+}
+
+int lispy_is_nullary(const lispy_value* fn) { return lval_nullary((lval*)fn); }
+
+lispy_value* lispy_number(long x) { return lval_num(x); }
+lispy_value* lispy_string(const char* s) { return lval_str((char*)s); }
+lispy_value* lispy_error(const char* msg) { return lval_err("%s", msg); }
+lispy_value* lispy_list(void) { return lval_qexpr(); }
+lispy_value* lispy_list_push(lispy_value* list, lispy_value* x) { return lval_add(list, x); }
+
+int lispy_type(const lispy_value* v) { return v->type; }
+const char* lispy_type_name(const lispy_value* v) { return ltype_name(v->type); }
+
+int lispy_location(const lispy_value* v, const char** file, int* line, int* col) {
+  lsrc x;
+  if (!lsrc_get(v->loc, &x)) { return 0; }
+  if (file) { *file = x.file; }
+  if (line) { *line = x.line; }
+  if (col) { *col = x.col; }
+  return 1;
+}
+
+long lispy_to_number(const lispy_value* v) { return v->type == LVAL_NUM ? v->num : 0; }
+
+const char* lispy_to_string(const lispy_value* v) {
+  switch (v->type) {
+  case LVAL_STR: return v->str;
+  case LVAL_SYM: return v->sym;
+  case LVAL_ERR: return v->err;
+  default: return NULL;
+  }
+}
+
+int lispy_count(const lispy_value* v) {
+  return (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) ? v->count : 0;
+}
+
+lispy_value* lispy_item(const lispy_value* v, int i) {
+  return (i >= 0 && i < lispy_count(v)) ? v->cell[i] : NULL;
+}
+
+void lispy_print(const lispy_value* v) { lval_print((lval*)v); }
+
+char* lispy_to_text(const lispy_value* v) {
+  char* s = NULL;
+  size_t n = 0;
+  FILE* f = open_memstream(&s, &n);
+  lval_fprint(f, (lval*)v);
+  fclose(f);
+  return s;
+}
+lispy_value* lispy_value_copy(const lispy_value* v) { return lval_copy((lval*)v); }
+void lispy_value_free(lispy_value* v) { lval_del(v); }
+
+#ifndef LISPY_LIBRARY
+
+////////////////////////////////////////
+// main
+////////////////////////////////////////
+
+// 標準入力からの一括評価(バッチモード)。
+// 入力を大きな塊で読み、完結した式がそろうたびに1つずつパースして評価する。
+// 式は複数行にまたがってよい。構文エラーはその式だけを捨てるので、同じ塊の他の式は評価される。
+// 結果はバッファリングした標準出力に書く。
+typedef struct {
+  char* buf;
+  long len, cap;
+  long pos; // 走査済みの位置
+  int depth; // 括弧の深さ
+  int str; // 文字列の中
+  int esc; // 文字列の中で、バックスラッシュの直後
+  int comment; // コメントの中
+} lbatch;
+
+// 読み込んだ入力の続きを走査し、次の区切りの位置を返す。なければ0。
+// トップレベルでの閉じ括弧の直後と改行の直後を区切りとする。
+long lbatch_scan(lbatch* b) {
+  long end = 0;
+  for (; b->pos < b->len && !end; b->pos++) {
+    char ch = b->buf[b->pos];
+    if (b->comment) {
+      if (ch == '\n') { b->comment = 0; if (b->depth == 0) { end = b->pos + 1; } }
+      continue;
+    }
+    if (b->str) {
+      if (b->esc) { b->esc = 0; } else if (ch == '\\') { b->esc = 1; } else if (ch == '"') { b->str = 0; }
+      continue;
+    }
+    switch (ch) {
+    case ';': b->comment = 1; break;
+    case '"': b->str = 1; break;
+    case '(': case '{': b->depth++; break;
+    case ')': case '}':
+      // 対応しない閉じ括弧はパーサーにエラーを報告させる。
+      if (--b->depth <= 0) { b->depth = 0; end = b->pos + 1; }
+      break;
+    case '\n': if (b->depth == 0) { end = b->pos + 1; } break;
+    }
+  }
+  return end;
+}
+
+// 区切りと区切りの間のn文字をパースし、評価して結果を出力する。
+void lbatch_eval(lctx* c, char* s, long n) {
+  char saved = s[n];
+  s[n] = '\0';
+  mpc_result_t r;
+  if (mpc_parse("<stdin>", s, c->Lispy, &r)) {
+    lval* expr = lval_read(c, r.output, NULL);
+    mpc_ast_delete(r.output);
+    while (expr->count) {
+      lval* x = lquota_eval(c->env, lval_pop(expr, 0));
+      lval_println(x);
+      lval_del(x);
+    }
+    lval_del(expr);
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  }
+  s[n] = saved;
+}
+
+// 一括評価の出力を大きなバッファにためる。setvbufは標準出力への最初の出力より前に呼ぶこと。
+void lbatch_buffer(void) {
+  static char out[1 << 16];
+  setvbuf(stdout, out, _IOFBF, sizeof(out));
+}
+
+void lispy_batch(lctx* c, int fd) {
+  lbatch b = { malloc(1 << 16), 0, 1 << 16, 0, 0, 0, 0, 0 };
+  while (1) {
+    if (b.cap - b.len < (1 << 15)) { b.cap *= 2; b.buf = realloc(b.buf, b.cap); }
+    // 入力を待つ前に、それまでの結果を書き出す。
+    fflush(stdout);
+    ssize_t got = read(fd, b.buf + b.len, b.cap - b.len - 1);
+    if (got <= 0) { break; }
+    b.len += got;
+
+    // 区切りごとに評価し、評価済みの部分をまとめて詰める。
+    long start = 0, end;
+    while ((end = lbatch_scan(&b))) {
+      lbatch_eval(c, b.buf + start, end - start);
+      start = end;
+    }
+    memmove(b.buf, b.buf + start, b.len - start);
+    b.len -= start;
+    b.pos -= start;
+  }
+  // 末尾の改行のない式。
+  if (b.len > 0) { lbatch_eval(c, b.buf, b.len); }
+  fflush(stdout);
+  free(b.buf);
+}
+
+int main(int argc, char** argv) {
+  // --profile[=ファイル]は、ファイルの評価全体をプロファイルする。
+  // --statsは、終了時に実行時の統計を表示する。
+  // --heap-profileは、確保したオブジェクトを関数ごとに数え、終了時に生きているものを表示する。
+  // --hashconsは、関数の本体とdefした値の同じ構造を共有する。
+  // --jitは、よく呼ばれる関数を機械語にコンパイルする(x86-64のみ)。残りの引数を詰める。
+  int profile = 0, heap = 0;
+  char* profile_path = NULL;
+  int n = 1;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--stats") == 0) { atexit(lstats_atexit); }
+    else if (strcmp(argv[i], "--heap-profile") == 0) { heap = 1; lheap_start(); }
+    else if (strcmp(argv[i], "--hashcons") == 0) { lhcons_start(); }
+    else if (strcmp(argv[i], "--jit") == 0) { ljit_start(); }
+    else if (strcmp(argv[i], "--profile") == 0) { profile = 1; }
+    else if (strncmp(argv[i], "--profile=", 10) == 0) { profile = 1; profile_path = argv[i] + 10; }
+    else { argv[n++] = argv[i]; }
+  }
+  argc = n;
+
+  // 標準入力が端末でなければ、バナーや履歴なしで一括評価する。
+  // 標準入力を一括評価するなら、何か出力する前に出力のバッファを設定する。
+  int batch = argc == 1 && !isatty(STDIN_FILENO);
+  int stdin_arg = 0;
+  for (int i = 1; i < argc; i++) { if (strcmp(argv[i], "-") == 0) { stdin_arg = 1; } }
+  if (batch || stdin_arg) { lbatch_buffer(); }
+
+  lctx* c = lctx_new();
+  lenv* e = c->env;
+  // ライブラリをロード。一括評価の出力は入力した式の結果だけにする。
   lval* a = load_library(e);
-  lval_print(a);
-  putchar('\n');
-  if (argc == 1) {
+  if (!batch) {
+    lval_print(a);
+    putchar('\n');
+  }
+  lval_del(a);
+  if (profile) { lprof_start(); }
+  if (batch) {
+    lispy_batch(c, STDIN_FILENO);
+  } else if (argc == 1) {
     puts("Lispy Version 0.0.0.0.1");
     puts("Press Ctrl+c to Exit\n");
     
@@ -1043,8 +5939,8 @@ lispy    : /^/ <expr>* /$/ ;                                            \
       mpc_result_t r;
 
       // 入力をパース。
-      if (mpc_parse("<stdin>", input, Lispy, &r)) {
-        lval* x = lval_eval(e, lval_read(r.output));
+      if (mpc_parse("<stdin>", input, c->Lispy, &r)) {
+        lval* x = lquota_eval(e, lval_read(c, r.output, NULL));
         lval_println(x);
         lval_del(x);
       } else {
@@ -1060,6 +5956,8 @@ lispy    : /^/ <expr>* /$/ ;                                            \
     // 引数として与えられたファイルを一つずつしょり。
     // 第一引数は実行されたコマンドそのものであることに注意。
     for (int i = 1; i < argc; i++) {
+      // "-"は標準入力。
+      if (strcmp(argv[i], "-") == 0) { lispy_batch(c, STDIN_FILENO); continue; }
       // 文字列のみのS式を作成。
       lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
       // ファイルの内容を実行。
@@ -1069,9 +5967,13 @@ lispy    : /^/ <expr>* /$/ ;                                            \
       lval_del(x);
     }
   }
-  lenv_del(e);
-  
-  mpc_cleanup(8, Comment, Number, String, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  if (profile && !lprof_finish(stderr, profile_path)) {
+    fprintf(stderr, "Could not write '%s'.\n", profile_path);
+  }
+  if (heap) { lheap_report(stderr); }
+  lctx_del(c);
   
   return 0;
 }
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef LISPY_H
+#define LISPY_H
+
+// liblispyのC API。
+// インタプリタを作っておけば、プレリュードの読み込みなどを繰り返さずに何度でも式を評価できる。
+// 1つのインタプリタは1つのスレッドから使う。別々のインタプリタは別々のスレッドで同時に使える。
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct lctx lispy_t;
+typedef struct lval lispy_value;
+typedef struct lenv lispy_env;
+
+// 組み込み関数。argsは評価済みの引数のS式で、関数が所有する(lispy_value_freeで解放すること)。
+// 戻り値は新しく作った値。エラーはlispy_errorで作って返す。
+typedef lispy_value* (*lispy_builtin)(lispy_env* env, lispy_value* args);
+
+// 値の型。
+enum {
+  LISPY_ERROR, LISPY_NUMBER, LISPY_SYMBOL, LISPY_STRING, LISPY_FUNCTION,
+  LISPY_SEXPR, LISPY_QEXPR, LISPY_RANGE, LISPY_SEQUENCE, LISPY_ARRAY, LISPY_DICTIONARY, LISPY_FUTURE
+};
+
+// インタプリタの作成と破棄。作成直後は組み込み関数だけが登録されている。
+// 環境変数LISPY_HASHCONSが0以外なら、関数の本体とdefした値の同じ構造をプロセス全体で共有する(--hashconsと同じ)。
+// 環境変数LISPY_JITが0以外なら、よく呼ばれる整数の関数をx86-64の機械語にコンパイルする(--jitと同じ)。
+lispy_t* lispy_new(void);
+void lispy_free(lispy_t* L);
+
+// 文字列やファイルの式を順に評価し、最後の式の値を返す。
+// 構文エラーや評価中のエラーはエラー型の値として返す。戻り値は呼び出し元が解放する。
+lispy_value* lispy_eval_string(lispy_t* L, const char* src);
+lispy_value* lispy_eval_file(lispy_t* L, const char* path);
+// srcがファイルfileのline行col列から始まるものとして評価する。エラーの位置はそのファイルでの位置になる。
+lispy_value* lispy_eval_string_at(lispy_t* L, const char* src, const char* file, int line, int col);
+// ファイルの式を評価せずに読み込み、トップレベルの式を並べたS式を返す。構文エラーはエラー型の値。
+// 読み込んだ式の位置はlispy_locationで引ける。
+lispy_value* lispy_read_file(lispy_t* L, const char* path);
+
+// グローバル環境の上に重ねた、独立した環境。defはこの環境にだけ書き込まれ、他の環境からは見えない。
+// 作成と破棄はグローバル環境の大きさによらず定数時間。同じインタプリタのスレッドから使う。
+lispy_env* lispy_env_new(lispy_t* L);
+void lispy_env_free(lispy_env* env);
+lispy_value* lispy_eval_string_in(lispy_t* L, lispy_env* env, const char* src);
+
+// グローバル環境を凍結する。以後はグローバル環境へのdefがエラーになる。組み込み関数の登録は凍結前に済ませる。
+void lispy_freeze(lispy_t* L);
+// 凍結したインタプリタbaseのグローバル環境の上に重ねたインタプリタ。baseが凍結されていなければNULL。
+// プレリュードなどを読み込んだbaseを1つだけ用意し、スレッドごとに重ねて使う。
+// 作成はbaseのグローバル環境の大きさによらず定数時間で、参照にロックは要らない。baseは重ねたものより後に破棄する。
+lispy_t* lispy_new_layer(lispy_t* base);
+
+// 1回の評価(lispy_eval_*やlispy_callの1回の呼び出し)に課す制限。評価の段数、関数呼び出しの深さ、
+// 値のために確保するバイト数の上限で、0は制限なし。超えた評価は打ち切られ、エラー型の値が返る。
+// lispy_newで作ったインタプリタは環境変数LISPY_MAX_STEPS, LISPY_MAX_DEPTH, LISPY_MAX_BYTESの値で始まり、
+// lispy_new_layerで重ねたものはbaseの設定を引き継ぐ。
+void lispy_set_limits(lispy_t* L, long steps, long depth, long bytes);
+
+// 組み込み関数をグローバル環境に登録する。
+void lispy_register(lispy_t* L, const char* name, lispy_builtin fn);
+// 引数なしで呼び出す組み込み関数を登録する。(dict)のように、要素が1つのS式でも値として取り出さずに呼び出す。
+void lispy_register_nullary(lispy_t* L, const char* name, lispy_builtin fn);
+
+// グローバル変数の値(なければエラー)と、関数の呼び出し。argsはlispy_listで作ったリストで、消費される。
+lispy_value* lispy_get(lispy_t* L, const char* name);
+lispy_value* lispy_call(lispy_t* L, lispy_value* fn, lispy_value* args);
+// 組み込み関数の中から、渡された環境envで関数fnを呼び出す。fnは借用し、argsは消費される。
+// fnが関数でなければ、先頭が関数でないS式を評価したときと同じエラーを返す。
+lispy_value* lispy_apply(lispy_env* env, const lispy_value* fn, lispy_value* args);
+// 要素が1つのS式で、値として取り出さずに引数なしで呼び出される関数(lispy_register_nullaryで登録したもの)か。
+int lispy_is_nullary(const lispy_value* fn);
+
+// 値の作成。
+lispy_value* lispy_number(long x);
+lispy_value* lispy_string(const char* s);
+lispy_value* lispy_error(const char* msg);
+lispy_value* lispy_list(void);
+// リストの末尾にxを加える。xはリストが所有する。
+lispy_value* lispy_list_push(lispy_value* list, lispy_value* x);
+
+// 値の参照。
+int lispy_type(const lispy_value* v);
+const char* lispy_type_name(const lispy_value* v);
+long lispy_to_number(const lispy_value* v);
+// 文字列、シンボル、エラーの文字列。値が解放されるまで有効。
+const char* lispy_to_string(const lispy_value* v);
+// S式、リストの要素数とi番目の要素(借用)。
+int lispy_count(const lispy_value* v);
+lispy_value* lispy_item(const lispy_value* v, int i);
+// ファイルから読み込んだ式と、その評価中に起きたエラーのソースの位置。位置がなければ0を返す。
+// fileはインタプリタを破棄した後も有効。
+int lispy_location(const lispy_value* v, const char** file, int* line, int* col);
+// 値を標準出力に表示する。
+void lispy_print(const lispy_value* v);
+// 値を表示したときの文字列。呼び出し元がfreeで解放する。
+char* lispy_to_text(const lispy_value* v);
+
+lispy_value* lispy_value_copy(const lispy_value* v);
+void lispy_value_free(lispy_value* v);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
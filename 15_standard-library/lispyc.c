@@ -0,0 +1,884 @@
+// lispyc: Lispyのプログラムをプレリュードと合わせてCに変換し、ccで実行ファイルにするAOTコンパイラ。
+// 使い方: lispyc [-o 出力] [-p プレリュード] [-S] プログラム.lspy
+// -Sは変換したCのソース(出力.c)を書き出すだけで、ccを呼ばない。
+//
+// トップレベルで(fun {名前 引数...} {本体})か(def {名前} (\ {引数...} {本体}))と定義され、
+// 他で束縛し直されない関数をCの関数に変換する。変換した関数同士は名前を引かずに直接呼び合い、
+// 数値と分かっている引数と式はlongのまま計算する。それ以外の値はliblispyの値(lispy_value)で持ち、
+// 組み込み関数や変換しなかった関数はlispy_applyで呼び出す。
+// トップレベルの式と変換できない関数は、実行時にインタプリタで評価する。変換した関数の定義もまず
+// インタプリタで評価しておき、引数の数が違う呼び出し(部分適用)と、数値を想定した引数に
+// 数値以外が渡された呼び出しは、インタプリタの関数に任せる。
+//
+// インタプリタとの違い:
+// - 変換した関数の仮引数は環境に置かないので、呼び出した先の関数から動的スコープで見えない。
+//   グローバル変数は、呼び出し元の環境ではなくグローバル環境から引く。
+// - 数値を1度だけ束縛したグローバル変数(trueやfalseなど)は、その値に置き換える。
+// - 引数の評価中にエラーが起きたら、残りの引数を評価せずにそのエラーを返す。
+//   エラーの位置は、そのエラーになったトップレベルの式の位置を表示する。
+// =を使う関数、本体が空の関数、可変長引数(&)の関数と、仮引数を含むQ式を使う関数は変換しない。
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <unistd.h>
+#include "lispy.h"
+
+// ランタイム(lispy.h, liblispy.a, prelude.lspy)の場所。環境変数LISPYC_HOMEで上書きできる。
+#ifndef LISPYC_HOME
+#define LISPYC_HOME "."
+#endif
+
+enum { LC_INT, LC_VAL }; // 式の型。longのままの数値と、lispy_value
+
+////////////////////////////////////////
+// 文字列
+////////////////////////////////////////
+
+// 伸びる文字列。{0}で空。
+typedef struct {
+  char* s;
+  long n, cap;
+} lcbuf;
+
+void lcbuf_printf(lcbuf* b, const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  if (b->n + n + 1 > b->cap) {
+    b->cap = (b->n + n + 1) * 2;
+    b->s = realloc(b->s, b->cap);
+  }
+  va_start(ap, fmt);
+  vsnprintf(b->s + b->n, n + 1, fmt, ap);
+  va_end(ap);
+  b->n += n;
+}
+
+char* lcbuf_str(lcbuf* b) { return b->s ? b->s : ""; }
+
+// Cの文字列リテラル。
+void lcbuf_cstr(lcbuf* b, const char* s) {
+  lcbuf_printf(b, "\"");
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') { lcbuf_printf(b, "\\%c", c); }
+    else if (c == '\n') { lcbuf_printf(b, "\\n"); }
+    else if (c < ' ' || c == 127) { lcbuf_printf(b, "\\%03o", c); }
+    else { lcbuf_printf(b, "%c", c); }
+  }
+  lcbuf_printf(b, "\"");
+}
+
+////////////////////////////////////////
+// プログラム
+////////////////////////////////////////
+
+// トップレベルの式。
+typedef struct {
+  lispy_value* x;
+  char* src; // ソースの文字列。実行時にインタプリタで評価する。
+  const char* file;
+  int line, col;
+  int fn; // 関数の定義ならlc_fnsの番号、でなければ-1
+} lcform;
+
+// Cに変換する候補の関数。
+typedef struct {
+  const char* name;
+  int argc;
+  const char** params;
+  int* ptype; // 仮引数の型
+  lispy_value* body; // 本体のQ式
+  int ret; // 戻り値の型
+  int ok; // Cに変換できる
+} lcfn;
+
+// グローバルな名前の束縛の状況。
+typedef struct {
+  const char* name;
+  int defs; // defや=、funで束縛する箇所の数
+  int memo; // memoに渡している
+  int num; // トップレベルで数値を束縛している
+  long val;
+} lcname;
+
+lcform* lc_forms; int lc_nforms;
+lcfn* lc_fns; int lc_nfns;
+lcname* lc_names; int lc_nnames;
+char** lc_consts; int lc_nconsts; // 実行時に作っておくQ式の定数(表示した文字列)
+
+lcname* lc_name(const char* s) {
+  for (int i = 0; i < lc_nnames; i++) {
+    if (strcmp(lc_names[i].name, s) == 0) { return &lc_names[i]; }
+  }
+  lc_names = realloc(lc_names, sizeof(lcname) * (lc_nnames + 1));
+  lcname* n = &lc_names[lc_nnames++];
+  memset(n, 0, sizeof(lcname));
+  n->name = s;
+  return n;
+}
+
+int lc_is_sym(lispy_value* x, const char* s) {
+  return lispy_type(x) == LISPY_SYMBOL && strcmp(lispy_to_string(x), s) == 0;
+}
+
+int lc_is_list(lispy_value* x) { return lispy_type(x) == LISPY_SEXPR || lispy_type(x) == LISPY_QEXPR; }
+
+// プログラムのどこかで束縛し直されていない組み込み関数の名前か。
+int lc_builtin(const char* s) { return lc_name(s)->defs == 0; }
+
+// 名前を束縛する式を数える。関数の本体のQ式の中も含める。
+void lc_scan(lispy_value* x) {
+  if (!lc_is_list(x)) { return; }
+  int n = lispy_count(x);
+  if (n >= 2) {
+    lispy_value* h = lispy_item(x, 0);
+    lispy_value* a = lispy_item(x, 1);
+    if ((lc_is_sym(h, "def") || lc_is_sym(h, "=")) && lispy_type(a) == LISPY_QEXPR) {
+      for (int i = 0; i < lispy_count(a); i++) {
+        lispy_value* s = lispy_item(a, i);
+        if (lispy_type(s) == LISPY_SYMBOL) { lc_name(lispy_to_string(s))->defs++; }
+      }
+    }
+    if (lc_is_sym(h, "fun") && lispy_type(a) == LISPY_QEXPR && lispy_count(a) > 0 &&
+        lispy_type(lispy_item(a, 0)) == LISPY_SYMBOL) {
+      lc_name(lispy_to_string(lispy_item(a, 0)))->defs++;
+    }
+    if (lc_is_sym(h, "memo") && lispy_type(a) == LISPY_SYMBOL) { lc_name(lispy_to_string(a))->memo = 1; }
+  }
+  for (int i = 0; i < n; i++) { lc_scan(lispy_item(x, i)); }
+}
+
+// (def {名前} 数値)なら、その値を覚えておく。
+void lc_scan_num(lispy_value* x) {
+  if (lispy_type(x) != LISPY_SEXPR || lispy_count(x) != 3 || !lc_is_sym(lispy_item(x, 0), "def")) { return; }
+  lispy_value* a = lispy_item(x, 1);
+  lispy_value* v = lispy_item(x, 2);
+  if (lispy_type(a) != LISPY_QEXPR || lispy_count(a) != 1 || lispy_type(lispy_item(a, 0)) != LISPY_SYMBOL) { return; }
+  if (lispy_type(v) != LISPY_NUMBER) { return; }
+  lcname* n = lc_name(lispy_to_string(lispy_item(a, 0)));
+  n->num = 1;
+  n->val = lispy_to_number(v);
+}
+
+// 仮引数のQ式fからi番目以降のシンボルを仮引数にする。&があれば変換しない。
+int lc_params(lcfn* f, lispy_value* q, int i) {
+  f->argc = lispy_count(q) - i;
+  f->params = malloc(sizeof(char*) * (f->argc + 1));
+  f->ptype = malloc(sizeof(int) * (f->argc + 1));
+  for (int k = 0; k < f->argc; k++) {
+    lispy_value* s = lispy_item(q, i + k);
+    if (lispy_type(s) != LISPY_SYMBOL || lc_is_sym(s, "&")) { return 0; }
+    f->params[k] = lispy_to_string(s);
+    f->ptype[k] = LC_VAL;
+  }
+  return 1;
+}
+
+// 関数の定義の形をしたトップレベルの式から、変換する候補の関数を作る。
+int lc_fundef(lispy_value* x, lcfn* f) {
+  memset(f, 0, sizeof(lcfn));
+  if (lispy_type(x) != LISPY_SEXPR || lispy_count(x) != 3) { return 0; }
+  lispy_value* h = lispy_item(x, 0);
+  lispy_value* a = lispy_item(x, 1);
+  lispy_value* b = lispy_item(x, 2);
+  if (lispy_type(a) != LISPY_QEXPR || lispy_count(a) < 1 || lispy_type(lispy_item(a, 0)) != LISPY_SYMBOL) { return 0; }
+  f->name = lispy_to_string(lispy_item(a, 0));
+
+  // (fun {名前 引数...} {本体})。funはプレリュードで1度だけ定義されたもの。
+  if (lc_is_sym(h, "fun") && lc_name("fun")->defs == 1 && lispy_type(b) == LISPY_QEXPR) {
+    f->body = b;
+    return lc_params(f, a, 1);
+  }
+  // (def {名前} (\ {引数...} {本体}))
+  if (lc_is_sym(h, "def") && lc_builtin("def") && lispy_count(a) == 1 &&
+      lispy_type(b) == LISPY_SEXPR && lispy_count(b) == 3 && lc_is_sym(lispy_item(b, 0), "\\") && lc_builtin("\\") &&
+      lispy_type(lispy_item(b, 1)) == LISPY_QEXPR && lispy_type(lispy_item(b, 2)) == LISPY_QEXPR) {
+    f->body = lispy_item(b, 2);
+    return lc_params(f, lispy_item(b, 1), 0);
+  }
+  return 0;
+}
+
+int lc_param(lcfn* f, const char* s) {
+  for (int i = 0; i < f->argc; i++) {
+    if (strcmp(f->params[i], s) == 0) { return i; }
+  }
+  return -1;
+}
+
+// 直接呼び出せる変換済みの関数。束縛が1箇所だけで、memoに渡していないもの。
+lcfn* lc_known(const char* s) {
+  lcname* n = lc_name(s);
+  if (n->defs != 1 || n->memo) { return NULL; }
+  for (int i = 0; i < lc_nfns; i++) {
+    if (lc_fns[i].ok && strcmp(lc_fns[i].name, s) == 0) { return &lc_fns[i]; }
+  }
+  return NULL;
+}
+
+// 数値に置き換えられるグローバル変数。
+lcname* lc_const_num(const char* s) {
+  lcname* n = lc_name(s);
+  return n->num && n->defs == 1 ? n : NULL;
+}
+
+int lc_is_op(const char* s, const char** ops) {
+  for (; *ops; ops++) {
+    if (strcmp(s, *ops) == 0) { return 1; }
+  }
+  return 0;
+}
+
+const char* lc_arith[] = {"+", "-", "*", "/", NULL};
+const char* lc_ord[] = {"<", ">", "<=", ">=", NULL};
+const char* lc_eq[] = {"==", "!=", NULL};
+
+int lc_int_operand(lcfn* f, lispy_value* x) {
+  if (lispy_type(x) == LISPY_NUMBER) { return 1; }
+  if (lispy_type(x) != LISPY_SYMBOL) { return 0; }
+  int i = lc_param(f, lispy_to_string(x));
+  if (i >= 0) { return f->ptype[i] == LC_INT; }
+  return lc_const_num(lispy_to_string(x)) != NULL;
+}
+
+// 数値の演算に直接渡している仮引数を数値とする。(== x 0)のように数値と比べている仮引数も数値とする。
+// 数値以外が渡されたら、呼び出しはインタプリタの関数に任せるので、推論が外れても結果は変わらない。
+void lc_infer(lcfn* f, lispy_value* x) {
+  if (!lc_is_list(x)) { return; }
+  int n = lispy_count(x);
+  lispy_value* h = n > 0 ? lispy_item(x, 0) : NULL;
+  if (h && lispy_type(h) == LISPY_SYMBOL && lc_param(f, lispy_to_string(h)) < 0 && lc_builtin(lispy_to_string(h))) {
+    const char* op = lispy_to_string(h);
+    for (int i = 1; i < n; i++) {
+      lispy_value* a = lispy_item(x, i);
+      if (lispy_type(a) != LISPY_SYMBOL || lc_param(f, lispy_to_string(a)) < 0) { continue; }
+      if (lc_is_op(op, lc_arith) || lc_is_op(op, lc_ord) ||
+          (lc_is_op(op, lc_eq) && n == 3 && lc_int_operand(f, lispy_item(x, 3 - i)))) {
+        f->ptype[lc_param(f, lispy_to_string(a))] = LC_INT;
+      }
+    }
+  }
+  for (int i = 0; i < n; i++) { lc_infer(f, lispy_item(x, i)); }
+}
+
+// 仮引数を含むか。
+int lc_mentions(lcfn* f, lispy_value* x) {
+  if (lispy_type(x) == LISPY_SYMBOL) { return lc_param(f, lispy_to_string(x)) >= 0; }
+  if (!lc_is_list(x)) { return 0; }
+  for (int i = 0; i < lispy_count(x); i++) {
+    if (lc_mentions(f, lispy_item(x, i))) { return 1; }
+  }
+  return 0;
+}
+
+////////////////////////////////////////
+// 関数の変換
+////////////////////////////////////////
+
+// 変換中の関数。式は一時変数に順に計算する文にする(引数の評価順を保つため)。
+// 数値の一時変数はi0, i1, ...、値の一時変数はv0, v1, ...で、値は使うときにlc_takeで持ち出す。
+// エラーはlc_errに置いてfailへ飛ぶ。
+typedef struct {
+  lcfn* f;
+  lcbuf* out;
+  int depth; // 字下げ
+  int ints, vals;
+  int fail; // 変換できない式があった
+  int emit; // 定数を登録する(最後の書き出しのとき)
+} lcctx;
+
+// 式の結果。数値ならCの式、値なら一時変数の名前。
+typedef struct {
+  int type;
+  char s[64];
+} lcres;
+
+void lc_emit(lcctx* c, const char* fmt, ...) {
+  char line[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+  lcbuf_printf(c->out, "%*s%s\n", 2 * (c->depth + 1), "", line);
+}
+
+lcres lc_new(lcctx* c, int type) {
+  lcres r;
+  r.type = type;
+  if (type == LC_INT) { snprintf(r.s, sizeof(r.s), "i%d", c->ints++); }
+  else { snprintf(r.s, sizeof(r.s), "v%d", c->vals++); }
+  return r;
+}
+
+lcres lc_box(lcctx* c, lcres r) {
+  if (r.type == LC_VAL) { return r; }
+  lcres v = lc_new(c, LC_VAL);
+  lc_emit(c, "%s = lispy_number(%s);", v.s, r.s);
+  return v;
+}
+
+// 値の一時変数を持ち出す式。
+char* lc_take(lcres r) {
+  static char s[8][80];
+  static int k = 0;
+  k = (k + 1) % 8;
+  snprintf(s[k], sizeof(s[k]), "lc_take(&%s)", r.s);
+  return s[k];
+}
+
+char* lc_quote(const char* s) {
+  lcbuf b = {0};
+  lcbuf_cstr(&b, s);
+  return b.s;
+}
+
+int lc_const(const char* text) {
+  for (int i = 0; i < lc_nconsts; i++) {
+    if (strcmp(lc_consts[i], text) == 0) { return i; }
+  }
+  lc_consts = realloc(lc_consts, sizeof(char*) * (lc_nconsts + 1));
+  lc_consts[lc_nconsts] = strdup(text);
+  return lc_nconsts++;
+}
+
+lcres lc_expr(lcctx* c, lispy_value* x);
+lcres lc_sexpr(lcctx* c, lispy_value* x);
+
+lcres lc_fail(lcctx* c) {
+  lcres r = { LC_VAL, "NULL" };
+  c->fail = 1;
+  return r;
+}
+
+// (if 条件 {then} {else})。両方の枝が数値なら数値、でなければ値。
+lcres lc_if(lcctx* c, lispy_value* x) {
+  lcres cond = lc_expr(c, lispy_item(x, 1));
+  if (c->fail) { return cond; }
+  char test[96];
+  if (cond.type == LC_INT) {
+    snprintf(test, sizeof(test), "%s", cond.s);
+  } else {
+    lc_emit(c, "if (lispy_type(%s) != LISPY_NUMBER) { lc_err = lispy_error(\"if\"); goto fail; }", cond.s);
+    snprintf(test, sizeof(test), "lispy_to_number(%s)", cond.s);
+  }
+
+  lcbuf* out = c->out;
+  lcbuf b[2] = {{0}, {0}};
+  lcres r[2];
+  c->depth++;
+  for (int i = 0; i < 2; i++) {
+    c->out = &b[i];
+    r[i] = lc_sexpr(c, lispy_item(x, 2 + i));
+    if (c->fail) { c->out = out; c->depth--; return r[i]; }
+  }
+  int type = r[0].type == LC_INT && r[1].type == LC_INT ? LC_INT : LC_VAL;
+  lcres v = lc_new(c, type);
+  for (int i = 0; i < 2; i++) {
+    c->out = &b[i];
+    if (type == LC_INT) { lc_emit(c, "%s = %s;", v.s, r[i].s); }
+    else { lc_emit(c, "%s = %s;", v.s, lc_take(lc_box(c, r[i]))); }
+  }
+  c->out = out;
+  c->depth--;
+
+  lc_emit(c, "if (%s) {", test);
+  lcbuf_printf(c->out, "%s", lcbuf_str(&b[0]));
+  lc_emit(c, "} else {");
+  lcbuf_printf(c->out, "%s", lcbuf_str(&b[1]));
+  lc_emit(c, "}");
+  free(b[0].s);
+  free(b[1].s);
+  return v;
+}
+
+// 組み込みの数値演算を、引数がすべて数値のときにその場で計算する。できなければfailを立てずに0を返す。
+int lc_inline_op(lcctx* c, const char* op, lcres* a, int n, lcres* r) {
+  for (int i = 0; i < n; i++) {
+    if (a[i].type != LC_INT) { return 0; }
+  }
+  if (lc_is_op(op, lc_arith) && n >= 1) {
+    *r = lc_new(c, LC_INT);
+    if (strcmp(op, "-") == 0 && n == 1) { lc_emit(c, "%s = -%s;", r->s, a[0].s); return 1; }
+    lc_emit(c, "%s = %s;", r->s, a[0].s);
+    for (int i = 1; i < n; i++) {
+      if (strcmp(op, "/") == 0) {
+        lc_emit(c, "if (%s == 0) { lc_err = lispy_error(\"Division By Zero!\"); goto fail; }", a[i].s);
+      }
+      lc_emit(c, "%s %s= %s;", r->s, op, a[i].s);
+    }
+    return 1;
+  }
+  if ((lc_is_op(op, lc_ord) || lc_is_op(op, lc_eq)) && n == 2) {
+    *r = lc_new(c, LC_INT);
+    lc_emit(c, "%s = %s %s %s;", r->s, a[0].s, op, a[1].s);
+    return 1;
+  }
+  return 0;
+}
+
+// 関数呼び出しのS式。先頭と引数を順に評価してから呼び出す。
+lcres lc_call(lcctx* c, lispy_value* x) {
+  int n = lispy_count(x) - 1;
+  lispy_value* h = lispy_item(x, 0);
+  // 先頭が仮引数でないシンボルなら、名前から呼び出し方を決める。名前を引くのは引数の評価の後でよい。
+  const char* op = NULL;
+  if (lispy_type(h) == LISPY_SYMBOL && lc_param(c->f, lispy_to_string(h)) < 0) { op = lispy_to_string(h); }
+
+  if (op && strcmp(op, "if") == 0 && lc_builtin(op) && n == 3 &&
+      lispy_type(lispy_item(x, 2)) == LISPY_QEXPR && lispy_type(lispy_item(x, 3)) == LISPY_QEXPR) {
+    return lc_if(c, x);
+  }
+  // 関数の環境に束縛する=は、仮引数を環境に置かないので変換できない。
+  if (op && strcmp(op, "=") == 0) { return lc_fail(c); }
+
+  lcres f;
+  if (!op) {
+    f = lc_expr(c, h);
+    if (c->fail) { return f; }
+  }
+  lcres* a = malloc(sizeof(lcres) * (n + 1));
+  for (int i = 0; i < n; i++) {
+    a[i] = lc_expr(c, lispy_item(x, 1 + i));
+    if (c->fail) { free(a); return lc_fail(c); }
+  }
+
+  lcres r;
+  if (op && lc_builtin(op) && lc_inline_op(c, op, a, n, &r)) { free(a); return r; }
+
+  // 変換済みの関数は直接呼び出す。数値の仮引数には数値の式を渡せるときだけ。
+  lcfn* g = op ? lc_known(op) : NULL;
+  int direct = g && g->argc == n;
+  for (int i = 0; direct && i < n; i++) {
+    if (g->ptype[i] == LC_INT && a[i].type != LC_INT) { direct = 0; }
+  }
+  if (direct) {
+    lcbuf args = {0};
+    for (int i = 0; i < n; i++) {
+      lcbuf_printf(&args, ", %s", g->ptype[i] == LC_INT ? a[i].s : lc_take(lc_box(c, a[i])));
+    }
+    r = lc_new(c, g->ret);
+    lc_emit(c, "%s = lc_fn_%d(env%s);", r.s, (int)(g - lc_fns), lcbuf_str(&args));
+    lc_emit(c, "if (lc_err) { goto fail; }");
+    free(args.s);
+    free(a);
+    return r;
+  }
+
+  if (op) {
+    f = lc_new(c, LC_VAL);
+    lc_emit(c, "%s = lc_get(%s);", f.s, lc_quote(op));
+    lc_emit(c, "if (!%s) { goto fail; }", f.s);
+  }
+  f = lc_box(c, f);
+  lcres l = lc_new(c, LC_VAL);
+  lc_emit(c, "%s = lispy_list();", l.s);
+  for (int i = 0; i < n; i++) { lc_emit(c, "lispy_list_push(%s, %s);", l.s, lc_take(lc_box(c, a[i]))); }
+  r = lc_new(c, LC_VAL);
+  lc_emit(c, "%s = lc_apply(env, %s, %s);", r.s, lc_take(f), lc_take(l));
+  lc_emit(c, "if (!%s) { goto fail; }", r.s);
+  free(a);
+  return r;
+}
+
+// S式、または評価される本体のQ式。要素が1つなら、それを評価した値((dict)のような組み込み関数なら引数なしで呼び出す)。
+lcres lc_sexpr(lcctx* c, lispy_value* x) {
+  int n = lispy_count(x);
+  if (n == 0) { return lc_fail(c); }
+  if (n > 1) { return lc_call(c, x); }
+
+  lispy_value* y = lispy_item(x, 0);
+  lcres r = lc_expr(c, y);
+  if (c->fail || r.type == LC_INT || lispy_type(y) == LISPY_STRING || lispy_type(y) == LISPY_QEXPR) { return r; }
+  lcres v = lc_new(c, LC_VAL);
+  lc_emit(c, "%s = lc_single(env, %s);", v.s, lc_take(r));
+  lc_emit(c, "if (!%s) { goto fail; }", v.s);
+  return v;
+}
+
+lcres lc_expr(lcctx* c, lispy_value* x) {
+  lcres r;
+  switch (lispy_type(x)) {
+  case LISPY_NUMBER: {
+    long k = lispy_to_number(x);
+    r.type = LC_INT;
+    if (k == LONG_MIN) { snprintf(r.s, sizeof(r.s), "(-%ldL-1)", LONG_MAX); }
+    else { snprintf(r.s, sizeof(r.s), "%ldL", k); }
+    return r;
+  }
+  case LISPY_STRING:
+    r = lc_new(c, LC_VAL);
+    lc_emit(c, "%s = lispy_string(%s);", r.s, lc_quote(lispy_to_string(x)));
+    return r;
+  case LISPY_SYMBOL: {
+    const char* s = lispy_to_string(x);
+    int i = lc_param(c->f, s);
+    if (i >= 0 && c->f->ptype[i] == LC_INT) {
+      r.type = LC_INT;
+      snprintf(r.s, sizeof(r.s), "a%d", i);
+      return r;
+    }
+    lcname* k = i < 0 ? lc_const_num(s) : NULL;
+    if (k) {
+      r.type = LC_INT;
+      snprintf(r.s, sizeof(r.s), "%ldL", k->val);
+      return r;
+    }
+    r = lc_new(c, LC_VAL);
+    if (i >= 0) {
+      lc_emit(c, "%s = lispy_value_copy(a%d);", r.s, i);
+    } else {
+      lc_emit(c, "%s = lc_get(%s);", r.s, lc_quote(s));
+      lc_emit(c, "if (!%s) { goto fail; }", r.s);
+    }
+    return r;
+  }
+  case LISPY_QEXPR: {
+    // 仮引数を含むQ式は、別の環境で評価されるコードかもしれないので変換しない。
+    if (lc_mentions(c->f, x)) { return lc_fail(c); }
+    int k = 0;
+    if (c->emit) {
+      char* text = lispy_to_text(x);
+      k = lc_const(text);
+      free(text);
+    }
+    r = lc_new(c, LC_VAL);
+    lc_emit(c, "%s = lispy_value_copy(lc_k[%d]);", r.s, k);
+    return r;
+  }
+  case LISPY_SEXPR: return lc_sexpr(c, x);
+  }
+  return lc_fail(c);
+}
+
+// 関数fをCの関数にする。変換できなければNULL。戻り値の型はfに書き込む。
+char* lc_function(lcfn* f, int emit) {
+  lcbuf body = {0};
+  lcctx c = { f, &body, 0, 0, 0, 0, emit };
+  lcres r = lc_sexpr(&c, f->body);
+  if (c.fail) { free(body.s); return NULL; }
+  f->ret = r.type;
+
+  int id = (int)(f - lc_fns);
+  lcbuf b = {0};
+  lcbuf_printf(&b, "// %s\n", f->name);
+  lcbuf_printf(&b, "static %s lc_fn_%d(lispy_env* env", f->ret == LC_INT ? "long" : "lispy_value*", id);
+  for (int i = 0; i < f->argc; i++) { lcbuf_printf(&b, f->ptype[i] == LC_INT ? ", long a%d" : ", lispy_value* a%d", i); }
+  lcbuf_printf(&b, ") {\n");
+  lcbuf_printf(&b, f->ret == LC_INT ? "  long r = 0;\n" : "  lispy_value* r = NULL;\n");
+  for (int i = 0; i < c.ints; i++) { lcbuf_printf(&b, "  long i%d;\n", i); }
+  for (int i = 0; i < c.vals; i++) { lcbuf_printf(&b, "  lispy_value* v%d = NULL;\n", i); }
+  lcbuf_printf(&b, "%s", lcbuf_str(&body));
+  lcbuf_printf(&b, "  r = %s;\n", f->ret == LC_INT ? r.s : lc_take(r));
+  lcbuf_printf(&b, " fail:\n");
+  for (int i = 0; i < c.vals; i++) { lcbuf_printf(&b, "  lc_free(v%d);\n", i); }
+  for (int i = 0; i < f->argc; i++) {
+    if (f->ptype[i] == LC_VAL) { lcbuf_printf(&b, "  lc_free(a%d);\n", i); }
+  }
+  lcbuf_printf(&b, "  return r;\n}\n\n");
+
+  // 組み込み関数として束縛する入口。引数が合わなければインタプリタの関数を呼ぶ。
+  lcbuf_printf(&b, "static lispy_value* lc_fb_%d;\n", id);
+  lcbuf_printf(&b, "static lispy_value* lc_w_%d(lispy_env* env, lispy_value* a) {\n", id);
+  lcbuf_printf(&b, "  if (lispy_count(a) != %d", f->argc);
+  for (int i = 0; i < f->argc; i++) {
+    if (f->ptype[i] == LC_INT) { lcbuf_printf(&b, " || lispy_type(lispy_item(a, %d)) != LISPY_NUMBER", i); }
+  }
+  lcbuf_printf(&b, ") { return lispy_apply(env, lc_fb_%d, a); }\n", id);
+  for (int i = 0; i < f->argc; i++) {
+    if (f->ptype[i] == LC_INT) { lcbuf_printf(&b, "  long a%d = lispy_to_number(lispy_item(a, %d));\n", i, i); }
+    else { lcbuf_printf(&b, "  lispy_value* a%d = lispy_value_copy(lispy_item(a, %d));\n", i, i); }
+  }
+  lcbuf_printf(&b, "  lispy_value_free(a);\n");
+  lcbuf_printf(&b, "  %s r = lc_fn_%d(env", f->ret == LC_INT ? "long" : "lispy_value*", id);
+  for (int i = 0; i < f->argc; i++) { lcbuf_printf(&b, ", a%d", i); }
+  lcbuf_printf(&b, ");\n");
+  lcbuf_printf(&b, "  if (lc_err) { return lc_raise(); }\n");
+  lcbuf_printf(&b, f->ret == LC_INT ? "  return lispy_number(r);\n}\n\n" : "  return r;\n}\n\n");
+  free(body.s);
+  return b.s;
+}
+
+////////////////////////////////////////
+// 出力
+////////////////////////////////////////
+
+// 生成するCのソースの先頭。実行時の補助関数。
+const char* lc_prelude =
+  "#include <stdio.h>\n"
+  "#include \"lispy.h\"\n"
+  "\n"
+  "static lispy_t* L;\n"
+  "static __thread lispy_value* lc_err; // 変換した関数で起きたエラー\n"
+  "\n"
+  "static lispy_value* lc_take(lispy_value** p) { lispy_value* v = *p; *p = NULL; return v; }\n"
+  "static void lc_free(lispy_value* v) { if (v) { lispy_value_free(v); } }\n"
+  "static lispy_value* lc_raise(void) { lispy_value* e = lc_err; lc_err = NULL; return e; }\n"
+  "\n"
+  "// エラーならlc_errに移してNULLを返す。\n"
+  "static lispy_value* lc_check(lispy_value* v) {\n"
+  "  if (lispy_type(v) == LISPY_ERROR) { lc_err = v; return NULL; }\n"
+  "  return v;\n"
+  "}\n"
+  "\n"
+  "static lispy_value* lc_get(const char* name) { return lc_check(lispy_get(L, name)); }\n"
+  "\n"
+  "static lispy_value* lc_apply(lispy_env* env, lispy_value* f, lispy_value* a) {\n"
+  "  lispy_value* r = lispy_apply(env, f, a);\n"
+  "  lispy_value_free(f);\n"
+  "  return lc_check(r);\n"
+  "}\n"
+  "\n"
+  "// 要素が1つのS式の値。引数なしで呼び出すように登録した組み込み関数((dict)など)だけは呼び出す。\n"
+  "static lispy_value* lc_single(lispy_env* env, lispy_value* v) {\n"
+  "  if (!lispy_is_nullary(v)) { return v; }\n"
+  "  return lc_apply(env, v, lispy_list());\n"
+  "}\n"
+  "\n"
+  "// トップレベルの式をインタプリタで評価する。loadと同じく、エラーは位置を付けて表示する。\n"
+  "static void lc_top(const char* src, const char* file, int line, int col) {\n"
+  "  lispy_value* r = lispy_eval_string_at(L, src, file, line, col);\n"
+  "  if (lispy_type(r) == LISPY_ERROR) {\n"
+  "    const char* f;\n"
+  "    int l, c;\n"
+  "    if (lispy_location(r, &f, &l, &c)) { printf(\"%s:%d:%d: \", f, l, c); }\n"
+  "    lispy_print(r);\n"
+  "    putchar('\\n');\n"
+  "  }\n"
+  "  lispy_value_free(r);\n"
+  "}\n"
+  "\n"
+  "// インタプリタで定義した関数を残しておき、変換した関数を同じ名前に束縛する。\n"
+  "static void lc_bind(const char* name, lispy_builtin w, lispy_value** fb) {\n"
+  "  *fb = lispy_get(L, name);\n"
+  "  if (lispy_type(*fb) == LISPY_FUNCTION) { lispy_register(L, name, w); }\n"
+  "}\n"
+  "\n";
+
+// プログラム全体のCのソース。
+char* lc_program(void) {
+  lcbuf fns = {0};
+  for (int i = 0; i < lc_nfns; i++) {
+    if (!lc_fns[i].ok) { continue; }
+    char* s = lc_function(&lc_fns[i], 1);
+    lcbuf_printf(&fns, "%s", s);
+    free(s);
+  }
+
+  lcbuf b = {0};
+  lcbuf_printf(&b, "// lispycが生成したソース。\n");
+  lcbuf_printf(&b, "%s", lc_prelude);
+  lcbuf_printf(&b, "static lispy_value* lc_k[%d]; // Q式の定数\n\n", lc_nconsts ? lc_nconsts : 1);
+  for (int i = 0; i < lc_nfns; i++) {
+    lcfn* f = &lc_fns[i];
+    if (!f->ok) { continue; }
+    lcbuf_printf(&b, "static %s lc_fn_%d(lispy_env* env", f->ret == LC_INT ? "long" : "lispy_value*", i);
+    for (int k = 0; k < f->argc; k++) { lcbuf_printf(&b, f->ptype[k] == LC_INT ? ", long" : ", lispy_value*"); }
+    lcbuf_printf(&b, ");\n");
+  }
+  lcbuf_printf(&b, "\n%s", lcbuf_str(&fns));
+  free(fns.s);
+
+  lcbuf_printf(&b, "int main(void) {\n");
+  lcbuf_printf(&b, "  L = lispy_new();\n");
+  for (int i = 0; i < lc_nconsts; i++) {
+    lcbuf_printf(&b, "  lc_k[%d] = lispy_eval_string(L, ", i);
+    lcbuf_cstr(&b, lc_consts[i]);
+    lcbuf_printf(&b, ");\n");
+  }
+  for (int i = 0; i < lc_nforms; i++) {
+    lcform* x = &lc_forms[i];
+    lcbuf_printf(&b, "  lc_top(");
+    lcbuf_cstr(&b, x->src);
+    lcbuf_printf(&b, ", ");
+    lcbuf_cstr(&b, x->file);
+    lcbuf_printf(&b, ", %d, %d);\n", x->line, x->col);
+    if (x->fn >= 0 && lc_fns[x->fn].ok) {
+      lcbuf_printf(&b, "  lc_bind(");
+      lcbuf_cstr(&b, lc_fns[x->fn].name);
+      lcbuf_printf(&b, ", lc_w_%d, &lc_fb_%d);\n", x->fn, x->fn);
+    }
+  }
+  for (int i = 0; i < lc_nfns; i++) {
+    if (lc_fns[i].ok) { lcbuf_printf(&b, "  lc_free(lc_fb_%d);\n", i); }
+  }
+  for (int i = 0; i < lc_nconsts; i++) { lcbuf_printf(&b, "  lc_free(lc_k[%d]);\n", i); }
+  lcbuf_printf(&b, "  lispy_free(L);\n");
+  lcbuf_printf(&b, "  return 0;\n}\n");
+  return b.s;
+}
+
+// 位置iから始まる括弧の式の終わり。文字列とコメントの中の括弧は数えない。
+long lc_form_end(const char* s, long i) {
+  int depth = 0;
+  for (; s[i]; i++) {
+    if (s[i] == '"') {
+      for (i++; s[i] && s[i] != '"'; i++) {
+        if (s[i] == '\\' && s[i+1]) { i++; }
+      }
+      if (!s[i]) { break; }
+    } else if (s[i] == ';') {
+      while (s[i] && s[i] != '\n') { i++; }
+      if (!s[i]) { break; }
+    } else if (s[i] == '(' || s[i] == '{') {
+      depth++;
+    } else if ((s[i] == ')' || s[i] == '}') && --depth == 0) {
+      return i + 1;
+    }
+  }
+  return i;
+}
+
+// 式のソースの文字列。エラーの位置がインタプリタと同じになるように、ファイルの中の文字列をそのまま使う。
+// 位置のない式(数値やシンボル)は表示した文字列。
+char* lc_source(const char* text, lcform* f) {
+  long i = 0;
+  for (int line = 1; text[i] && line < f->line; i++) {
+    if (text[i] == '\n') { line++; }
+  }
+  i += f->col - 1;
+  if (f->line == 0 || (text[i] != '(' && text[i] != '{')) { return lispy_to_text(f->x); }
+  long n = lc_form_end(text, i) - i;
+  char* s = malloc(n + 1);
+  memcpy(s, text + i, n);
+  s[n] = '\0';
+  return s;
+}
+
+// ファイルのトップレベルの式を加える。
+int lc_read(lispy_t* L, const char* path) {
+  lispy_value* x = lispy_read_file(L, path);
+  if (lispy_type(x) == LISPY_ERROR) {
+    fprintf(stderr, "lispyc: %s\n", lispy_to_string(x));
+    lispy_value_free(x);
+    return 0;
+  }
+  lcbuf text = {0};
+  FILE* fp = fopen(path, "r");
+  char chunk[4096];
+  for (size_t k; fp && (k = fread(chunk, 1, sizeof(chunk), fp)) > 0;) { lcbuf_printf(&text, "%.*s", (int)k, chunk); }
+  if (fp) { fclose(fp); }
+  // 読み込んだ式は最後まで使うので解放しない。
+  int n = lispy_count(x);
+  lc_forms = realloc(lc_forms, sizeof(lcform) * (lc_nforms + n));
+  for (int i = 0; i < n; i++) {
+    lcform* f = &lc_forms[lc_nforms++];
+    f->x = lispy_item(x, i);
+    f->file = path;
+    f->line = f->col = 0;
+    lispy_location(f->x, NULL, &f->line, &f->col);
+    f->src = lc_source(lcbuf_str(&text), f);
+    f->fn = -1;
+  }
+  free(text.s);
+  return 1;
+}
+
+int main(int argc, char** argv) {
+  const char* home = getenv("LISPYC_HOME") ? getenv("LISPYC_HOME") : LISPYC_HOME;
+  char* out = NULL;
+  char* prelude = NULL;
+  char* src = NULL;
+  int only_c = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) { out = argv[++i]; }
+    else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) { prelude = argv[++i]; }
+    else if (strcmp(argv[i], "-S") == 0) { only_c = 1; }
+    else if (!src) { src = argv[i]; }
+    else { src = NULL; break; }
+  }
+  if (!src) {
+    fprintf(stderr, "usage: lispyc [-o output] [-p prelude] [-S] program.lspy\n");
+    return 1;
+  }
+  lcbuf path = {0};
+  if (!prelude) {
+    lcbuf_printf(&path, "%s/prelude.lspy", home);
+    prelude = path.s;
+  }
+  // 出力の名前は、既定ではプログラムの名前から.lspyを除いたもの。
+  if (!out) {
+    out = strdup(src);
+    char* dot = strrchr(out, '.');
+    if (dot && strcmp(dot, ".lspy") == 0) { *dot = '\0'; }
+    else { out = "a.out"; }
+  }
+
+  lispy_t* L = lispy_new();
+  if (!lc_read(L, prelude) || !lc_read(L, src)) { return 1; }
+
+  // 名前の束縛を数え、関数の定義を候補にする。
+  for (int i = 0; i < lc_nforms; i++) {
+    lc_scan(lc_forms[i].x);
+    lc_scan_num(lc_forms[i].x);
+  }
+  lc_fns = malloc(sizeof(lcfn) * (lc_nforms + 1));
+  for (int i = 0; i < lc_nforms; i++) {
+    lcfn f;
+    if (!lc_fundef(lc_forms[i].x, &f)) { continue; }
+    f.ok = lc_name(f.name)->defs == 1 && !lc_name(f.name)->memo && lispy_count(f.body) > 0;
+    lc_forms[i].fn = lc_nfns;
+    lc_fns[lc_nfns++] = f;
+  }
+  for (int i = 0; i < lc_nfns; i++) {
+    // ==での推論は他の仮引数の推論結果を使うので、2回たどる。
+    lc_infer(&lc_fns[i], lc_fns[i].body);
+    lc_infer(&lc_fns[i], lc_fns[i].body);
+    lc_fns[i].ret = LC_INT;
+  }
+
+  // 変換できない関数と、数値を返さない関数が決まるまで繰り返す。
+  // 最初はすべて数値を返すとし、変わるのは変換できる→できない、数値→値の向きだけなので、必ず止まる。
+  for (int changed = 1; changed;) {
+    changed = 0;
+    for (int i = 0; i < lc_nfns; i++) {
+      lcfn* f = &lc_fns[i];
+      if (!f->ok) { continue; }
+      int ret = f->ret;
+      char* s = lc_function(f, 0);
+      if (!s) { f->ok = 0; changed = 1; continue; }
+      free(s);
+      if (f->ret != ret) { changed = 1; }
+    }
+  }
+
+  char* prog = lc_program();
+  int compiled = 0;
+  for (int i = 0; i < lc_nfns; i++) { compiled += lc_fns[i].ok; }
+  fprintf(stderr, "lispyc: compiled %d of %d functions\n", compiled, lc_nfns);
+
+  // ccに渡すソースは一時ディレクトリに書き、終わったら消す。
+  lcbuf cpath = {0};
+  char dir[] = "/tmp/lispycXXXXXX";
+  if (only_c) {
+    lcbuf_printf(&cpath, "%s.c", out);
+  } else {
+    if (!mkdtemp(dir)) { perror("lispyc"); return 1; }
+    lcbuf_printf(&cpath, "%s/prog.c", dir);
+  }
+  FILE* fp = fopen(cpath.s, "w");
+  if (!fp) { perror(cpath.s); return 1; }
+  fputs(prog, fp);
+  fclose(fp);
+  if (only_c) { return 0; }
+
+  // 数値の演算はインタプリタと同じく桁あふれで折り返す(-fwrapv)。
+  lcbuf cmd = {0};
+  const char* cc = getenv("CC") ? getenv("CC") : "cc";
+  lcbuf_printf(&cmd, "%s -std=c99 -O2 -fwrapv -pthread -I'%s' -o '%s' '%s' '%s/liblispy.a' -lm",
+               cc, home, out, cpath.s, home);
+  int status = system(cmd.s);
+  unlink(cpath.s);
+  rmdir(dir);
+  if (status != 0) {
+    fprintf(stderr, "lispyc: %s failed\n", cc);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,320 @@
+// lispyd: 式を評価するサーバー。
+// プロセスを起動したままにして、起動とプレリュードの読み込みを多数のリクエストで使い回す。
+//
+// Unixドメインソケット(-u パス)か、localhostのTCP(-p ポート)で待ち受ける。
+// 暴走したリクエストが評価スレッドを占有しないよう、リクエストごとに評価の段数(-s)、
+// 関数呼び出しの深さ(-d)、確保するバイト数(-m)の上限を設けられる。
+// 受信はepollのイベントループ1本で行い、評価は評価スレッド(-t 数)に任せる。
+// プレリュードは起動時に1度だけ読み込み、そのグローバル環境を凍結しておく。
+// 評価スレッドはそれぞれ凍結した環境の上に重ねたインタプリタを1つ持ち、接続はどれか1つの評価スレッドに割り当てられる。
+// 接続ごとに独立した環境をさらに重ねて評価するので、defは他の接続から見えない。
+// レスポンスを一定時間(LSRV_WRITE_TIMEOUT)内に読み取らない接続は、評価スレッドを止めないよう切断する。
+//
+// フレームは4バイトのビッグエンディアンの長さと、それに続く本体。
+// リクエストの本体は評価する式。レスポンスの本体は1行目が"ok 評価時間(マイクロ秒)"か
+// "err 評価時間(マイクロ秒)"で、2行目以降が値を表示した文字列。
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "lispy.h"
+
+// リクエストの大きさの上限。
+#define LSRV_MAX_FRAME (16 << 20)
+// 受信バッファの初期の大きさ。大きなリクエストで広げたバッファは、空になったらこの大きさに戻す。
+#define LSRV_INCAP 8192
+// レスポンスを送り切るまでの時間の上限(ミリ秒)。読まないクライアントが評価スレッドを止めないよう、超えたら切断する。
+#define LSRV_WRITE_TIMEOUT 5000
+
+struct lsrv_worker;
+
+// 接続。受信はイベントループが、評価と送信は割り当てられた評価スレッドが行う。
+typedef struct {
+  int fd;
+  struct lsrv_worker* worker;
+  lispy_env* env; // 接続の環境。最初のリクエストで評価スレッドが作る。
+  char* in; // 受信バッファ
+  long inlen, incap;
+  int dead; // 送信に失敗した。残りのリクエストは評価しない(評価スレッドだけが触る)。
+} lsrv_conn;
+
+// 評価スレッドへの仕事。srcがNULLの場合は接続を閉じる。
+typedef struct lsrv_job {
+  lsrv_conn* conn;
+  char* src;
+  struct lsrv_job* next;
+} lsrv_job;
+
+// 評価スレッド。
+typedef struct lsrv_worker {
+  pthread_t thread;
+  lispy_t* base; // プレリュードを読み込んで凍結したインタプリタ
+  lsrv_job* head;
+  lsrv_job* tail;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+} lsrv_worker;
+
+long lsrv_usec(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000L + t.tv_nsec / 1000;
+}
+
+// ブロックしないソケットに全て書き込む。書けない間はpollで待つが、LSRV_WRITE_TIMEOUTを過ぎたら-1。
+int lsrv_write_all(int fd, const char* buf, long n) {
+  long deadline = lsrv_usec() + LSRV_WRITE_TIMEOUT * 1000L;
+  while (n > 0) {
+    ssize_t w = write(fd, buf, n);
+    if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      long left = deadline - lsrv_usec();
+      struct pollfd p = { fd, POLLOUT, 0 };
+      if (left <= 0 || poll(&p, 1, (int)((left + 999) / 1000)) == 0) { return -1; }
+      continue;
+    }
+    if (w < 0 && errno == EINTR) { continue; }
+    if (w <= 0) { return -1; }
+    buf += w;
+    n -= w;
+  }
+  return 0;
+}
+
+// 長さを前に付けて送る。
+int lsrv_send_frame(int fd, const char* head, const char* body) {
+  long hn = strlen(head), bn = strlen(body);
+  char* buf = malloc(4 + hn + bn);
+  unsigned long n = hn + bn;
+  buf[0] = n >> 24; buf[1] = n >> 16; buf[2] = n >> 8; buf[3] = n;
+  memcpy(buf + 4, head, hn);
+  memcpy(buf + 4 + hn, body, bn);
+  int r = lsrv_write_all(fd, buf, 4 + hn + bn);
+  free(buf);
+  return r;
+}
+
+void lsrv_push(lsrv_worker* w, lsrv_conn* c, char* src) {
+  lsrv_job* j = malloc(sizeof(lsrv_job));
+  j->conn = c;
+  j->src = src;
+  j->next = NULL;
+  pthread_mutex_lock(&w->lock);
+  if (w->tail) { w->tail->next = j; } else { w->head = j; }
+  w->tail = j;
+  pthread_cond_signal(&w->ready);
+  pthread_mutex_unlock(&w->lock);
+}
+
+// 評価スレッドの本体。
+void* lsrv_worker_main(void* arg) {
+  lsrv_worker* w = arg;
+  lispy_t* L = lispy_new_layer(w->base);
+
+  while (1) {
+    pthread_mutex_lock(&w->lock);
+    while (!w->head) { pthread_cond_wait(&w->ready, &w->lock); }
+    lsrv_job* j = w->head;
+    w->head = j->next;
+    if (!w->head) { w->tail = NULL; }
+    pthread_mutex_unlock(&w->lock);
+
+    lsrv_conn* c = j->conn;
+    if (!j->src) {
+      // 接続を閉じる。それより前のリクエストは全て処理済み。
+      if (c->env) { lispy_env_free(c->env); }
+      close(c->fd);
+      free(c->in);
+      free(c);
+    } else if (c->dead) {
+      free(j->src);
+    } else {
+      if (!c->env) { c->env = lispy_env_new(L); }
+      long start = lsrv_usec();
+      lispy_value* v = lispy_eval_string_in(L, c->env, j->src);
+      long took = lsrv_usec() - start;
+
+      char head[64];
+      snprintf(head, sizeof(head), "%s %ld\n", lispy_type(v) == LISPY_ERROR ? "err" : "ok", took);
+      char* text = lispy_to_text(v);
+      if (lsrv_send_frame(c->fd, head, text) < 0) {
+        // 送れなかった接続は閉じる。イベントループが切断として検出し、後始末の仕事を積む。
+        c->dead = 1;
+        shutdown(c->fd, SHUT_RDWR);
+      }
+      free(text);
+      lispy_value_free(v);
+      free(j->src);
+    }
+    free(j);
+  }
+  return NULL;
+}
+
+// 受信バッファからそろったフレームを取り出して、評価スレッドに渡す。不正なフレームなら-1。
+int lsrv_dispatch(lsrv_conn* c) {
+  long pos = 0;
+  while (c->inlen - pos >= 4) {
+    unsigned char* h = (unsigned char*)c->in + pos;
+    long n = ((long)h[0] << 24) | (h[1] << 16) | (h[2] << 8) | h[3];
+    if (n > LSRV_MAX_FRAME) { return -1; }
+    if (c->inlen - pos - 4 < n) { break; }
+    char* src = malloc(n + 1);
+    memcpy(src, c->in + pos + 4, n);
+    src[n] = '\0';
+    lsrv_push(c->worker, c, src);
+    pos += 4 + n;
+  }
+  if (pos == 0) { return 0; }
+  memmove(c->in, c->in + pos, c->inlen - pos);
+  c->inlen -= pos;
+  if (c->inlen == 0 && c->incap > LSRV_INCAP) {
+    c->incap = LSRV_INCAP;
+    c->in = realloc(c->in, c->incap);
+  }
+  return 0;
+}
+
+// 読めるだけ読む。接続が閉じられたかエラーなら-1。
+// 読むたびにフレームを取り出すので、残るのは長さを確かめた途中のフレームだけになり、
+// バッファはLSRV_MAX_FRAME + 4より大きくならない。
+int lsrv_read(lsrv_conn* c) {
+  while (1) {
+    if (c->inlen == c->incap) {
+      c->incap = c->incap * 2 < LSRV_MAX_FRAME + 4 ? c->incap * 2 : LSRV_MAX_FRAME + 4;
+      c->in = realloc(c->in, c->incap);
+    }
+    ssize_t r = read(c->fd, c->in + c->inlen, c->incap - c->inlen);
+    if (r > 0) {
+      c->inlen += r;
+      if (lsrv_dispatch(c) < 0) { return -1; }
+      continue;
+    }
+    if (r < 0 && errno == EINTR) { continue; }
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { return 0; }
+    return -1;
+  }
+}
+
+int lsrv_nonblock(int fd) { return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK); }
+
+// 待ち受けソケットを作る。
+int lsrv_listen(const char* path, int port) {
+  int fd;
+  if (path) {
+    struct sockaddr_un a;
+    memset(&a, 0, sizeof(a));
+    a.sun_family = AF_UNIX;
+    strncpy(a.sun_path, path, sizeof(a.sun_path) - 1);
+    unlink(path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&a, sizeof(a)) < 0) { return -1; }
+  } else {
+    struct sockaddr_in a;
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (fd < 0 || bind(fd, (struct sockaddr*)&a, sizeof(a)) < 0) { return -1; }
+  }
+  if (listen(fd, 128) < 0) { return -1; }
+  lsrv_nonblock(fd);
+  return fd;
+}
+
+int main(int argc, char** argv) {
+  const char* path = NULL;
+  int port = 0;
+  long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+  long steps = 0, depth = 0, bytes = 0;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-u") == 0) { path = argv[i+1]; }
+    else if (strcmp(argv[i], "-p") == 0) { port = atoi(argv[i+1]); }
+    else if (strcmp(argv[i], "-t") == 0) { nworkers = atol(argv[i+1]); }
+    else if (strcmp(argv[i], "-s") == 0) { steps = atol(argv[i+1]); }
+    else if (strcmp(argv[i], "-d") == 0) { depth = atol(argv[i+1]); }
+    else if (strcmp(argv[i], "-m") == 0) { bytes = atol(argv[i+1]); }
+  }
+  if (!path && !port) {
+    fprintf(stderr, "usage: lispyd [-u path | -p port] [-t threads] [-s steps] [-d depth] [-m bytes]\n");
+    return 1;
+  }
+  if (nworkers < 1) { nworkers = 1; }
+
+  // 切断された接続への書き込みは、シグナルではなくエラーとして扱う。
+  signal(SIGPIPE, SIG_IGN);
+
+  int lfd = lsrv_listen(path, port);
+  if (lfd < 0) { perror("lispyd"); return 1; }
+
+  lispy_t* base = lispy_new();
+  lispy_value* p = lispy_eval_file(base, "prelude.lspy");
+  if (lispy_type(p) == LISPY_ERROR) { fprintf(stderr, "lispyd: %s\n", lispy_to_string(p)); }
+  lispy_value_free(p);
+  lispy_freeze(base);
+  lispy_set_limits(base, steps, depth, bytes);
+
+  lsrv_worker* workers = calloc(nworkers, sizeof(lsrv_worker));
+  for (long i = 0; i < nworkers; i++) {
+    workers[i].base = base;
+    pthread_mutex_init(&workers[i].lock, NULL);
+    pthread_cond_init(&workers[i].ready, NULL);
+    pthread_create(&workers[i].thread, NULL, lsrv_worker_main, &workers[i]);
+  }
+
+  int ep = epoll_create1(0);
+  struct epoll_event ev = { EPOLLIN, { .ptr = NULL } };
+  epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+  if (path) { fprintf(stderr, "lispyd: listening on %s (%ld threads)\n", path, nworkers); }
+  else { fprintf(stderr, "lispyd: listening on 127.0.0.1:%d (%ld threads)\n", port, nworkers); }
+
+  long next = 0;
+  struct epoll_event evs[64];
+  while (1) {
+    int n = epoll_wait(ep, evs, 64, -1);
+    for (int i = 0; i < n; i++) {
+      lsrv_conn* c = evs[i].data.ptr;
+
+      // 新しい接続。評価スレッドには順番に割り当てる。
+      if (!c) {
+        int fd;
+        while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+          lsrv_nonblock(fd);
+          if (!path) { int one = 1; setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); }
+          c = calloc(1, sizeof(lsrv_conn));
+          c->fd = fd;
+          c->worker = &workers[next++ % nworkers];
+          c->incap = LSRV_INCAP;
+          c->in = malloc(c->incap);
+          struct epoll_event cev = { EPOLLIN | EPOLLRDHUP, { .ptr = c } };
+          epoll_ctl(ep, EPOLL_CTL_ADD, fd, &cev);
+        }
+        continue;
+      }
+
+      // 切断されたら、評価スレッドに後始末を任せる。
+      if (lsrv_read(c) < 0) {
+        epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+        lsrv_push(c->worker, c, NULL);
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,153 @@
+// lispydの負荷生成ベンチマーク。
+// 複数の接続からそれぞれリクエストを順に送り、スループットとレイテンシの分位点を計測する。
+// 使い方: lispyd_bench [-u パス | -p ポート] [-c 接続数] [-n 接続あたりのリクエスト数] [-e 式]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+const char* path = NULL;
+int port = 0;
+long requests = 10000;
+const char* expr = "(+ 1 2)";
+
+// 接続ごとの計測結果。
+typedef struct {
+  pthread_t thread;
+  long* lat; // リクエストごとのレイテンシ(ナノ秒)
+  long eval; // サーバーが報告した評価時間の合計(マイクロ秒)
+  long errors;
+} lbench_conn;
+
+long lbench_nsec(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+int lbench_connect(void) {
+  int fd;
+  if (path) {
+    struct sockaddr_un a;
+    memset(&a, 0, sizeof(a));
+    a.sun_family = AF_UNIX;
+    strncpy(a.sun_path, path, sizeof(a.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*)&a, sizeof(a)) < 0) { return -1; }
+  } else {
+    struct sockaddr_in a;
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*)&a, sizeof(a)) < 0) { return -1; }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+int lbench_read_all(int fd, char* buf, long n) {
+  while (n > 0) {
+    ssize_t r = read(fd, buf, n);
+    if (r < 0 && errno == EINTR) { continue; }
+    if (r <= 0) { return -1; }
+    buf += r;
+    n -= r;
+  }
+  return 0;
+}
+
+void* lbench_main(void* arg) {
+  lbench_conn* c = arg;
+  int fd = lbench_connect();
+  if (fd < 0) { perror("lispyd_bench"); exit(1); }
+
+  long n = strlen(expr);
+  char* req = malloc(4 + n);
+  req[0] = n >> 24; req[1] = n >> 16; req[2] = n >> 8; req[3] = n;
+  memcpy(req + 4, expr, n);
+
+  long cap = 4096;
+  char* res = malloc(cap);
+  for (long i = 0; i < requests; i++) {
+    long start = lbench_nsec();
+    if (write(fd, req, 4 + n) != 4 + n) { perror("lispyd_bench"); exit(1); }
+
+    unsigned char h[4];
+    if (lbench_read_all(fd, (char*)h, 4) < 0) { fprintf(stderr, "lispyd_bench: connection closed\n"); exit(1); }
+    long m = ((long)h[0] << 24) | (h[1] << 16) | (h[2] << 8) | h[3];
+    if (m + 1 > cap) { cap = m + 1; res = realloc(res, cap); }
+    if (lbench_read_all(fd, res, m) < 0) { fprintf(stderr, "lispyd_bench: connection closed\n"); exit(1); }
+    c->lat[i] = lbench_nsec() - start;
+
+    res[m] = '\0';
+    if (strncmp(res, "ok ", 3) != 0) { c->errors++; }
+    c->eval += strtol(res + 3, NULL, 10);
+  }
+  free(req);
+  free(res);
+  close(fd);
+  return NULL;
+}
+
+int lbench_cmp(const void* a, const void* b) {
+  long x = *(const long*)a, y = *(const long*)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char** argv) {
+  long conns = 4;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-u") == 0) { path = argv[i+1]; }
+    else if (strcmp(argv[i], "-p") == 0) { port = atoi(argv[i+1]); }
+    else if (strcmp(argv[i], "-c") == 0) { conns = atol(argv[i+1]); }
+    else if (strcmp(argv[i], "-n") == 0) { requests = atol(argv[i+1]); }
+    else if (strcmp(argv[i], "-e") == 0) { expr = argv[i+1]; }
+  }
+  if ((!path && !port) || conns < 1 || requests < 1) {
+    fprintf(stderr, "usage: lispyd_bench [-u path | -p port] [-c conns] [-n requests] [-e expr]\n");
+    return 1;
+  }
+
+  lbench_conn* cs = calloc(conns, sizeof(lbench_conn));
+  long start = lbench_nsec();
+  for (long i = 0; i < conns; i++) {
+    cs[i].lat = malloc(sizeof(long) * requests);
+    pthread_create(&cs[i].thread, NULL, lbench_main, &cs[i]);
+  }
+  for (long i = 0; i < conns; i++) { pthread_join(cs[i].thread, NULL); }
+  double sec = (lbench_nsec() - start) / 1e9;
+
+  // 全接続のレイテンシをまとめて分位点を求める。
+  long total = conns * requests, errors = 0, eval = 0;
+  long* all = malloc(sizeof(long) * total);
+  for (long i = 0; i < conns; i++) {
+    memcpy(all + i * requests, cs[i].lat, sizeof(long) * requests);
+    errors += cs[i].errors;
+    eval += cs[i].eval;
+    free(cs[i].lat);
+  }
+  qsort(all, total, sizeof(long), lbench_cmp);
+
+  printf("%ld requests over %ld connections in %.3fs: %.0f req/s\n", total, conns, sec, total / sec);
+  printf("latency p50 %.1fus  p99 %.1fus  max %.1fus  (server eval mean %.1fus)\n",
+         all[total / 2] / 1e3, all[total * 99 / 100] / 1e3, all[total - 1] / 1e3, (double)eval / total);
+  if (errors) { printf("%ld error responses\n", errors); }
+
+  free(all);
+  free(cs);
+  return 0;
+}